@@ -0,0 +1,89 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "utils.h"
+
+#include <utility>
+
+// Axis-aligned bounding box, stored as one interval per axis
+class aabb {
+    public:
+        interval x, y, z;
+
+        aabb() {} // Default constructor (the default intervals are empty, so is the box)
+
+        aabb(const interval &ix, const interval &iy, const interval &iz) : x(ix), y(iy), z(iz) {} // Parametrized constructor
+
+        // Creates the box spanned by two opposite corner points
+        aabb(const point3 &a, const point3 &b) {
+            x = interval(fmin(a[0], b[0]), fmax(a[0], b[0]));
+            y = interval(fmin(a[1], b[1]), fmax(a[1], b[1]));
+            z = interval(fmin(a[2], b[2]), fmax(a[2], b[2]));
+        }
+
+        // Creates the tightest box enclosing both given boxes
+        aabb(const aabb &box0, const aabb &box1) : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {}
+
+        // Returns the interval of the given axis (0 = x, 1 = y, 2 = z)
+        const interval &axis(int n) const {
+            if (n == 1) return y;
+            if (n == 2) return z;
+            return x;
+        }
+
+        // Returns true if the box has no volume at all (any of its intervals is empty)
+        bool is_empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
+        // Returns the index of the longest axis of the box
+        int longest_axis() const {
+            if (x.size() > y.size())
+                return x.size() > z.size() ? 0 : 2;
+            return y.size() > z.size() ? 1 : 2;
+        }
+
+        // Returns the surface area of the box (used by the SAH cost model)
+        real surface_area() const {
+            if (is_empty())
+                return 0;
+            auto dx = x.size(), dy = y.size(), dz = z.size();
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        // Returns the center point of the box
+        point3 centroid() const {
+            return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+        }
+
+        // Checks if a ray hits the box within the interval (slab test)
+        bool hit(const ray &r, interval ray_t) const {
+            const vec3 &dir = r.direction();
+            return hit(r.origin(), vec3(1 / dir[0], 1 / dir[1], 1 / dir[2]), ray_t);
+        }
+
+        /*
+         * Slab test with a precomputed reciprocal ray direction, for callers that test
+         * the same ray against many boxes (e.g. during acceleration structure traversal)
+         */
+        bool hit(const point3 &origin, const vec3 &inv_direction, interval ray_t) const {
+            for (int a = 0; a < 3; a++) {
+                const interval &ax = axis(a);
+                auto t0 = (ax.min - origin[a]) * inv_direction[a];
+                auto t1 = (ax.max - origin[a]) * inv_direction[a];
+
+                if (inv_direction[a] < 0)
+                    std::swap(t0, t1);
+                t1 *= 1 + 2 * rounding_error_bound(3); // Rounded distances must not let a grazing ray slip past the box
+
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+
+                if (ray_t.max < ray_t.min)
+                    return false;
+            }
+            return true;
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,244 @@
+#ifndef ACCUMULATION_BUFFER_H
+#define ACCUMULATION_BUFFER_H
+
+#include "utils.h"
+#include "color.h"
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Running mean and variance of a stream of values (Welford), mergeable across batches (Chan et al.)
+struct running_stats {
+    long long count = 0;
+    double mean = 0;
+    double m2 = 0;        // Sum of squared differences from the mean
+
+    // Adds one value
+    void push(double value) {
+        count++;
+        double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+
+    // Adds all the values summarized by `other`
+    void merge(const running_stats &other) {
+        if (other.count == 0)
+            return;
+        long long total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (static_cast<double>(count) * other.count / total);
+        count = total;
+    }
+
+    // Unbiased sample variance (0 with fewer than two values)
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+};
+
+/*
+ * Per-pixel running sum of sample radiance and number of samples taken, along with the
+ * running mean and variance of the sample luminance used to drive adaptive sampling.
+ * Unlike a framebuffer it can keep growing: more samples can be added at any time,
+ * it can be written to disk and loaded back to continue an interrupted render, and buffers
+ * rendered separately (e.g. tiles from worker processes) can be merged into one.
+ *
+ * Snapshot layout (little-endian):
+ *   char[8]   magic "RTACCUM2"
+ *   uint32    width, height
+ *   uint64    scene hash, camera hash
+ *   width * height records of { float r, g, b; uint32 samples; float mean, m2 }
+ */
+class accumulation_buffer {
+    public:
+        // Per-pixel record, also the on-disk layout
+        struct pixel {
+            float sum[3];       // Sum of the radiance of all samples
+            uint32_t samples;   // Number of samples summed
+            float mean;         // Mean luminance of the samples
+            float m2;           // Sum of squared differences of the sample luminance from the mean
+        };
+
+        accumulation_buffer() {} // Default constructor (empty buffer)
+
+        accumulation_buffer(int width, int height) // Creates a buffer with no samples
+            : w(width), h(height), pixels(static_cast<size_t>(width) * height, pixel{{0, 0, 0}, 0, 0, 0}) {}
+
+        int width() const { return w; }
+        int height() const { return h; }
+
+        // Number of samples accumulated in the pixel at column x, row y
+        int samples(int x, int y) const { return static_cast<int>(at(x, y).samples); }
+
+        /*
+         * Adds more samples to the pixel at column x, row y: `sum` is their total radiance and
+         * `luminance` the statistics of their luminance, which also give the sample count.
+         */
+        void add(int x, int y, const color &sum, const running_stats &luminance) {
+            pixel &p = at(x, y);
+            running_stats merged = stats(p);
+            merged.merge(luminance);
+
+            p.sum[0] += static_cast<float>(sum.x());
+            p.sum[1] += static_cast<float>(sum.y());
+            p.sum[2] += static_cast<float>(sum.z());
+            p.samples = static_cast<uint32_t>(merged.count);
+            p.mean = static_cast<float>(merged.mean);
+            p.m2 = static_cast<float>(merged.m2);
+        }
+
+        // Standard error of the mean luminance of the pixel at column x, row y
+        double standard_error(int x, int y) const {
+            running_stats luminance = stats(at(x, y));
+            return luminance.count > 1 ? std::sqrt(luminance.variance() / luminance.count) : infinity;
+        }
+
+        // Mean luminance of the pixel at column x, row y
+        double mean_luminance(int x, int y) const { return at(x, y).mean; }
+
+        // Returns the mean radiance of the pixel at column x, row y (black without samples)
+        color average(int x, int y) const {
+            const pixel &p = at(x, y);
+            if (p.samples == 0)
+                return color(0, 0, 0);
+            auto scale = 1.0 / p.samples;
+            return scale * color(p.sum[0], p.sum[1], p.sum[2]);
+        }
+
+        // Total number of samples over all pixels
+        long long total_samples() const {
+            long long total = 0;
+            for (const auto &p : pixels)
+                total += p.samples;
+            return total;
+        }
+
+        // Smallest number of samples of any pixel
+        int min_samples() const {
+            uint32_t least = pixels.empty() ? 0 : pixels[0].samples;
+            for (const auto &p : pixels)
+                least = std::min(least, p.samples);
+            return static_cast<int>(least);
+        }
+
+        // Writes the mean radiance of every pixel into the image
+        void resolve(framebuffer &image) const {
+            image = framebuffer(w, h);
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++)
+                    image.set(x, y, average(x, y));
+        }
+
+        // Writes every pixel's sample count divided by `max_samples` into the image, as gray
+        void sample_map(framebuffer &image, int max_samples) const {
+            image = framebuffer(w, h);
+            auto scale = 1.0 / std::max(max_samples, 1);
+            for (int y = 0; y < h; y++)
+                for (int x = 0; x < w; x++) {
+                    auto value = scale * samples(x, y);
+                    image.set(x, y, color(value, value, value));
+                }
+        }
+
+        // Adds the samples of `part`, a buffer covering the pixels from column x0, row y0 on
+        void merge(const accumulation_buffer &part, int x0, int y0) {
+            for (int y = 0; y < part.h; y++) {
+                for (int x = 0; x < part.w; x++) {
+                    const pixel &q = part.at(x, y);
+                    pixel &p = at(x0 + x, y0 + y);
+                    running_stats merged = stats(p);
+                    merged.merge(stats(q));
+
+                    for (int c = 0; c < 3; c++)
+                        p.sum[c] += q.sum[c];
+                    p.samples = static_cast<uint32_t>(merged.count);
+                    p.mean = static_cast<float>(merged.mean);
+                    p.m2 = static_cast<float>(merged.m2);
+                }
+            }
+        }
+
+        // Writes a snapshot to `out`
+        bool write(std::ostream &out, uint64_t scene_hash, uint64_t camera_hash) const {
+            uint32_t size[2] = {static_cast<uint32_t>(w), static_cast<uint32_t>(h)};
+            uint64_t hashes[2] = {scene_hash, camera_hash};
+            out.write(magic(), 8);
+            out.write(reinterpret_cast<const char *>(size), sizeof(size));
+            out.write(reinterpret_cast<const char *>(hashes), sizeof(hashes));
+            out.write(reinterpret_cast<const char *>(pixels.data()),
+                      static_cast<std::streamsize>(pixels.size() * sizeof(pixel)));
+            return static_cast<bool>(out.flush());
+        }
+
+        /*
+         * Reads a snapshot written by `write`. Fails, leaving the buffer untouched, if the data is
+         * truncated, or if it was made for a different size, scene or camera.
+         */
+        bool read(std::istream &in, uint64_t scene_hash, uint64_t camera_hash) {
+            char file_magic[8];
+            uint32_t size[2];
+            uint64_t hashes[2];
+            in.read(file_magic, 8);
+            in.read(reinterpret_cast<char *>(size), sizeof(size));
+            in.read(reinterpret_cast<char *>(hashes), sizeof(hashes));
+            if (!in || std::string(file_magic, 8) != std::string(magic(), 8))
+                return false;
+            if (size[0] != static_cast<uint32_t>(w) || size[1] != static_cast<uint32_t>(h))
+                return false;
+            if (hashes[0] != scene_hash || hashes[1] != camera_hash)
+                return false;
+
+            std::vector<pixel> loaded(pixels.size());
+            in.read(reinterpret_cast<char *>(loaded.data()), static_cast<std::streamsize>(loaded.size() * sizeof(pixel)));
+            if (!in)
+                return false;
+
+            pixels.swap(loaded);
+            return true;
+        }
+
+        /*
+         * Writes a snapshot to `path`. The data goes to a temporary file first which then replaces
+         * `path`, so an interruption while saving never destroys the previous snapshot.
+         */
+        bool save(const std::string &path, uint64_t scene_hash, uint64_t camera_hash) const {
+            std::string temp_path = path + ".tmp";
+            {
+                std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+                if (!out || !write(out, scene_hash, camera_hash))
+                    return false;
+            }
+            return std::rename(temp_path.c_str(), path.c_str()) == 0;
+        }
+
+        // Loads a snapshot written by `save`; fails like `read`, or if the file is missing
+        bool load(const std::string &path, uint64_t scene_hash, uint64_t camera_hash) {
+            std::ifstream in(path, std::ios::binary);
+            return in && read(in, scene_hash, camera_hash);
+        }
+
+    private:
+        static const char *magic() { return "RTACCUM2"; }
+
+        int w = 0, h = 0;
+        std::vector<pixel> pixels;
+
+        static running_stats stats(const pixel &p) {
+            running_stats luminance;
+            luminance.count = p.samples;
+            luminance.mean = p.mean;
+            luminance.m2 = p.m2;
+            return luminance;
+        }
+
+        pixel &at(int x, int y) { return pixels[static_cast<size_t>(y) * w + x]; }
+        const pixel &at(int x, int y) const { return pixels[static_cast<size_t>(y) * w + x]; }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,240 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "utils.h"
+#include "camera.h"
+#include "flat_scene.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Value of a parameter over the frames of a sequence, interpolated linearly between keyframes
+template <typename T>
+class keyframe_track {
+    public:
+        // Sets the value at `frame`, replacing any key already there
+        void add(double frame, const T &value) {
+            auto next = std::lower_bound(keys.begin(), keys.end(), frame,
+                                         [](const key &k, double f) { return k.frame < f; });
+            if (next != keys.end() && next->frame == frame)
+                next->value = value;
+            else
+                keys.insert(next, key{frame, value});
+        }
+
+        bool empty() const { return keys.empty(); }
+
+        double last_frame() const { return keys.empty() ? 0 : keys.back().frame; }
+
+        // Value at `frame`; before the first key and after the last the value holds still
+        T at(double frame) const {
+            if (frame <= keys.front().frame)
+                return keys.front().value;
+            if (frame >= keys.back().frame)
+                return keys.back().value;
+            auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                         [](double f, const key &k) { return f < k.frame; });
+            auto prev = next - 1;
+            double t = (frame - prev->frame) / (next->frame - prev->frame);
+            return (1 - t) * prev->value + t * next->value;
+        }
+
+    private:
+        struct key {
+            double frame;
+            T value;
+        };
+
+        std::vector<key> keys;      // Sorted by frame
+};
+
+/*
+ * Keyframes of a sequence: the camera's lookfrom, lookat and focus_dist, and the center and
+ * radius of spheres, which are identified by their number in a sphere_batch (the order they
+ * were added in, which is also their order in a scene file). A parameter without keys keeps
+ * the value it has.
+ */
+class animation {
+    public:
+        int frame_count = 0;                    // Frames in the sequence (0 = through the last key)
+        keyframe_track<point3> lookfrom;
+        keyframe_track<point3> lookat;
+        keyframe_track<double> focus_dist;
+
+        // Places sphere number `sphere` at `center` with `radius` at `frame`
+        void add_sphere_key(int sphere, double frame, const point3 &center, double radius) {
+            sphere_track &track = spheres[sphere];
+            track.center.add(frame, center);
+            track.radius.add(frame, radius);
+        }
+
+        // True if nothing is keyframed
+        bool empty() const { return lookfrom.empty() && lookat.empty() && focus_dist.empty() && spheres.empty(); }
+
+        // True if spheres move, so the scene's BVH has to follow
+        bool moves_spheres() const { return !spheres.empty(); }
+
+        // Number of frames to render
+        int frames() const {
+            if (frame_count > 0)
+                return frame_count;
+            double last = std::max(lookfrom.last_frame(), std::max(lookat.last_frame(), focus_dist.last_frame()));
+            for (const auto &entry : spheres)
+                last = std::max(last, entry.second.center.last_frame());
+            return static_cast<int>(last) + 1;
+        }
+
+        // Sets the keyframed camera parameters to their values at `frame`
+        void pose_camera(camera &cam, double frame) const {
+            if (!lookfrom.empty())
+                cam.lookfrom = lookfrom.at(frame);
+            if (!lookat.empty())
+                cam.lookat = lookat.at(frame);
+            if (!focus_dist.empty())
+                cam.focus_dist = focus_dist.at(frame);
+        }
+
+        /*
+         * Moves the keyframed spheres of `batch` to where they are at `frame`; the batch's BVH is
+         * then out of date. Throws std::out_of_range for a key on a sphere the batch does not have.
+         */
+        void pose_spheres(sphere_batch &batch, double frame) const {
+            for (const auto &entry : spheres) {
+                if (entry.first < 0 || entry.first >= batch.size())
+                    throw std::out_of_range("animation: no sphere " + std::to_string(entry.first) + " in the scene");
+                batch.set_sphere(entry.first, entry.second.center.at(frame),
+                                 static_cast<real>(entry.second.radius.at(frame)));
+            }
+        }
+
+    private:
+        struct sphere_track {
+            keyframe_track<point3> center;
+            keyframe_track<double> radius;
+        };
+
+        std::map<int, sphere_track> spheres;    // By sphere number
+};
+
+/*
+ * Renders the frames of an animation back to back, each to its own image file, reusing the scene
+ * between frames. When spheres move, the BVH is refitted to their new boxes rather than rebuilt,
+ * which keeps its shape; refitted boxes get looser as spheres drift from where the tree was
+ * built, so once the estimated cost of a ray (bvh_tree::sah_cost) exceeds `rebuild_threshold`
+ * times its value after the last build, the tree is built again instead.
+ */
+class sequence_renderer {
+    public:
+        std::string output_pattern = "frame_####.ppm"; // Image files; the run of '#' becomes the zero-padded frame number
+        double rebuild_threshold = 1.3;     // Rebuild the BVH once refitting has made rays this much more expensive
+        bool skip_existing = false;         // Leave out frames whose image exists, to resume an interrupted sequence
+        bool show_progress = true;          // Report every frame on std::clog
+
+        int refits = 0;                     // BVH updates of the last render()
+        int rebuilds = 0;
+        render_stats stats;                 // Sums of the frames' statistics, plus the "animate" phase
+
+        /*
+         * Renders every frame of `anim` with `cam` and `batch` (whose spheres are left as in the
+         * last frame). The camera's own output and checkpoints are not used: frames are written to
+         * a temporary file renamed once complete. Returns false if stopped by a signal.
+         */
+        bool render(camera &cam, shared_ptr<sphere_batch> batch, const animation &anim) {
+            stats = render_stats();
+            refits = rebuilds = 0;
+            cam.checkpoint_path.clear();
+
+            flat_scene world(batch);
+            double built_cost = batch->bvh_cost();
+            std::ostream *previous_output = cam.output;
+            int frames = anim.frames();
+            for (int frame = 0; frame < frames; frame++) {
+                std::string path = frame_path(output_pattern, frame);
+                if (skip_existing && std::ifstream(path)) {
+                    if (show_progress)
+                        std::clog << "Frame " << frame << ": " << path << " exists, skipped\n";
+                    continue;
+                }
+
+                // Pose the scene: refit the tree, or build it again once refitting no longer pays
+                auto animate_start = std::chrono::steady_clock::now();
+                anim.pose_camera(cam, frame);
+                if (anim.moves_spheres()) {
+                    anim.pose_spheres(*batch, frame);
+                    world.update_lights();
+                    batch->refit_bvh();
+                    if (batch->bvh_cost() > rebuild_threshold * built_cost) {
+                        batch->build_bvh();
+                        built_cost = batch->bvh_cost();
+                        rebuilds++;
+                    } else {
+                        refits++;
+                    }
+                }
+                stats.add_phase("animate", std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                                         - animate_start).count());
+
+                std::string temp_path = path + ".tmp";
+                bool finished;
+                {
+                    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+                    if (!out)
+                        throw std::runtime_error(temp_path + ": cannot write frame");
+                    cam.output = &out;
+                    finished = cam.render(world);
+                    cam.output = previous_output;
+                }
+                add_frame_stats(cam.stats);
+                if (!finished) {
+                    std::remove(temp_path.c_str());
+                    return false;
+                }
+                if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+                    throw std::runtime_error(path + ": cannot write frame");
+                if (show_progress)
+                    std::clog << "Frame " << frame << " of " << frames << " written to " << path
+                              << " (BVH cost " << batch->bvh_cost() << ")\n";
+            }
+            return true;
+        }
+
+        /*
+         * File name of `frame`: the first run of '#' in `pattern` replaced by the zero-padded number.
+         * A pattern without '#' gets "_####" before its extension ("out.ppm" becomes "out_0001.ppm").
+         */
+        static std::string frame_path(const std::string &pattern, int frame) {
+            std::string number = std::to_string(frame);
+            size_t first = pattern.find('#');
+            if (first == std::string::npos) {
+                size_t dot = pattern.rfind('.');
+                size_t slash = pattern.find_last_of("/\\");
+                if (dot == std::string::npos || dot == 0 || (slash != std::string::npos && dot <= slash + 1))
+                    dot = pattern.size();
+                return frame_path(pattern.substr(0, dot) + "_####" + pattern.substr(dot), frame);
+            }
+            size_t last = pattern.find_first_not_of('#', first);
+            size_t width = (last == std::string::npos ? pattern.size() : last) - first;
+            if (number.size() < width)
+                number.insert(0, width - number.size(), '0');
+            return pattern.substr(0, first) + number + pattern.substr(first + width);
+        }
+
+    private:
+        void add_frame_stats(const render_stats &frame) {
+            stats.samples += frame.samples;
+            stats.rays += frame.rays;
+            stats.counters.add(frame.counters);
+            for (const auto &phase : frame.phases)
+                stats.add_phase(phase.name, phase.seconds);
+        }
+};
+
+#endif
\ No newline at end of file
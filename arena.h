@@ -0,0 +1,129 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Monotonic allocator that owns the objects of a scene. Objects are constructed back to back
+ * in large blocks, so a scene lies in memory in the order it was built, and they are all
+ * destroyed (in reverse order of creation) and freed at once by clear() or the destructor;
+ * nothing is freed individually.
+ * `make` returns a non-owning shared_ptr (see `unowned` in utils.h), so arena objects go into
+ * hittable_list, sphere and the other shared_ptr based interfaces as they are. Those pointers
+ * must not outlive the arena.
+ */
+class scene_arena {
+    public:
+        // Reserves memory `block_size` bytes at a time (or more for a larger object)
+        explicit scene_arena(size_t block_size = 64 * 1024) : block_size(block_size) {}
+
+        scene_arena(const scene_arena &) = delete;
+        scene_arena &operator=(const scene_arena &) = delete;
+
+        ~scene_arena() { clear(); }
+
+        // Constructs a T in the arena
+        template <typename T, typename... Args>
+        T *create(Args &&...args) {
+            // Registering the object below cannot throw; the capacity grows geometrically, not by one
+            if (!std::is_trivially_destructible<T>::value && destructors.size() == destructors.capacity())
+                destructors.reserve(2 * destructors.size() + 16);
+            T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value)
+                destructors.push_back(destructor{object, &destroy<T>});
+            objects++;
+            return object;
+        }
+
+        // Constructs a T in the arena and returns a pointer to it that owns nothing
+        template <typename T, typename... Args>
+        shared_ptr<T> make(Args &&...args) {
+            return unowned(create<T>(std::forward<Args>(args)...));
+        }
+
+        // Destroys every object; the first block is kept for reuse and the others freed
+        void clear() {
+            for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+                d->destroy(d->object);
+            destructors.clear();
+            objects = 0;
+
+            if (blocks.size() > 1)
+                blocks.resize(1);
+            if (!blocks.empty()) {
+                cursor = blocks[0].data.get();
+                end = cursor + blocks[0].size;
+            }
+        }
+
+        // Number of objects created since the last clear()
+        size_t object_count() const { return objects; }
+
+        // Bytes of memory held in blocks
+        size_t capacity() const {
+            size_t total = 0;
+            for (const auto &b : blocks)
+                total += b.size;
+            return total;
+        }
+
+    private:
+        struct block {
+            std::unique_ptr<unsigned char[]> data;
+            size_t size;
+        };
+
+        // Object to destroy on clear() and the function that destroys it
+        struct destructor {
+            void *object;
+            void (*destroy)(void *);
+        };
+
+        size_t block_size;
+        std::vector<block> blocks;
+        std::vector<destructor> destructors;
+        unsigned char *cursor = nullptr;    // Free space left in the last block
+        unsigned char *end = nullptr;
+        size_t objects = 0;
+
+        template <typename T>
+        static void destroy(void *object) { static_cast<T *>(object)->~T(); }
+
+        // Returns `size` bytes aligned to `alignment` (a power of two), starting a new block when needed
+        void *allocate(size_t size, size_t alignment) {
+            unsigned char *start = align(cursor, alignment);
+            if (!cursor || static_cast<size_t>(start - cursor) + size > static_cast<size_t>(end - cursor)) {
+                size_t bytes = std::max(block_size, size + alignment);
+                blocks.push_back(block{std::unique_ptr<unsigned char[]>(new unsigned char[bytes]), bytes});
+                cursor = blocks.back().data.get();
+                end = cursor + bytes;
+                start = align(cursor, alignment);
+            }
+            cursor = start + size;
+            return start;
+        }
+
+        static unsigned char *align(unsigned char *p, size_t alignment) {
+            auto address = reinterpret_cast<uintptr_t>(p);
+            return p + ((alignment - address % alignment) % alignment);
+        }
+};
+
+// Constructs a T in `arena`, or on the heap with shared ownership when `arena` is null
+template <typename T, typename... Args>
+shared_ptr<T> make_in(scene_arena *arena, Args &&...args) {
+    if (arena)
+        return arena->make<T>(std::forward<Args>(args)...);
+    return make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1461 @@
+#include "utils.h"
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "demo_scene.h"
+#include "distributed.h"
+#include "flat_scene.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "render_server.h"
+#include "sampler.h"
+#include "scene_cache.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+#include "stream_renderer.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef RAYTRACER_BUILD_TYPE
+#define RAYTRACER_BUILD_TYPE "unknown"
+#endif
+
+/*
+ * Micro and macro benchmarks of the renderer, written to std::cout as JSON so that runs of
+ * different versions can be compared. Every benchmark repeats its operation in rounds until
+ * `min_time` seconds have passed and reports the throughput over all rounds. The image quality
+ * comparisons render once each and report the error against a reference image. The checks
+ * compare optimized code with the code it must agree with; the program exits with 1 if one fails,
+ * and `--filter check/` runs only them. `--worker` runs the program as a worker of the distributed
+ * render check, which starts it that way.
+ *
+ * Usage: raytracer_bench [--filter <text>] [--min-time <seconds>] [--threads <count>]
+ * raytracer_bench_float is the same program built with RAYTRACER_FLOAT.
+ */
+
+// Result of one benchmark
+struct benchmark_result {
+    std::string name;
+    std::string unit;        // What the operations are: rays, scatters, calls
+    long long operations;    // Operations performed over all rounds
+    double seconds;          // Wall time of all rounds
+
+    double per_second() const { return seconds > 0 ? operations / seconds : 0; }
+};
+
+// Error of one render against a reference image
+struct quality_result {
+    std::string name;
+    int samples_per_pixel;
+    double seconds;          // Wall time of the render, denoising included
+    double rmse;             // Root mean square error of the displayed image (see framebuffer::display_rmse)
+};
+
+// Outcome of one correctness check
+struct check_result {
+    std::string name;
+    std::string mismatch;    // First disagreement found, empty if the check passed
+};
+
+// Keeps the results of the benchmarked calls alive so the compiler cannot drop the calls
+volatile double sink = 0;
+
+// Settings from the command line
+struct bench_options {
+    std::string filter;      // Only run benchmarks whose name contains this text
+    double min_time = 0.5;   // Seconds each benchmark runs for
+    int threads = 1;         // Render threads of the full render benchmark (0 = all hardware threads)
+};
+
+class bench_suite {
+    public:
+        bench_suite(const bench_options &options) : opts(options) {}
+
+        /*
+         * Runs `round` until min_time has passed, unless the name is filtered out.
+         * `round` performs a fixed amount of work and returns the number of operations it did.
+         */
+        void run(const std::string &name, const std::string &unit, const std::function<long long()> &round) {
+            if (!selected(name))
+                return;
+
+            std::clog << name << "..." << std::flush;
+            round(); // Warm up caches and branch predictors
+
+            benchmark_result result{name, unit, 0, 0};
+            auto start = std::chrono::steady_clock::now();
+            do {
+                result.operations += round();
+                result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            } while (result.seconds < opts.min_time);
+
+            std::clog << ' ' << result.per_second() << ' ' << unit << "/s\n";
+            results.push_back(result);
+        }
+
+        /*
+         * Renders once with `render`, unless the name is filtered out, and compares the image with
+         * the one `reference` returns (which is called only if some comparison runs).
+         */
+        void compare(const std::string &name, int samples_per_pixel, const std::function<framebuffer()> &render,
+                     const std::function<const framebuffer &()> &reference) {
+            if (!selected(name))
+                return;
+
+            const framebuffer &expected = reference();
+            std::clog << name << "..." << std::flush;
+            auto start = std::chrono::steady_clock::now();
+            framebuffer image = render();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            quality_result result{name, samples_per_pixel, seconds, framebuffer::display_rmse(image, expected)};
+            std::clog << " RMSE " << result.rmse << " in " << seconds << " s\n";
+            quality.push_back(result);
+        }
+
+        /*
+         * Runs the check `test`, unless the name is filtered out. `test` returns a description of
+         * the first mismatch it finds, or an empty string.
+         */
+        void check(const std::string &name, const std::function<std::string()> &test) {
+            if (!selected(name))
+                return;
+
+            std::clog << name << "..." << std::flush;
+            check_result result{name, test()};
+            std::clog << (result.mismatch.empty() ? " ok" : " FAILED: " + result.mismatch) << '\n';
+            checks.push_back(result);
+        }
+
+        // True if any check found a mismatch
+        bool failed() const {
+            for (const auto &result : checks)
+                if (!result.mismatch.empty())
+                    return true;
+            return false;
+        }
+
+        // True unless the name is filtered out
+        bool selected(const std::string &name) const { return name.find(opts.filter) != std::string::npos; }
+
+        // True unless all of the names are filtered out; guards setup that only those benchmarks need
+        bool selected_any(const std::vector<std::string> &names) const {
+            for (const auto &name : names)
+                if (selected(name))
+                    return true;
+            return false;
+        }
+
+        // Writes every result as JSON to `out`
+        void write_json(std::ostream &out) const {
+            out << "{\n";
+            out << "  \"build_type\": \"" << RAYTRACER_BUILD_TYPE << "\",\n";
+            out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+            out << "  \"precision\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\",\n";
+            out << "  \"vec3_lanes\": " << vec3_layout<real>::lanes << ",\n";
+            out << "  \"sphere_lanes\": " << sphere_batch::lanes() << ",\n";
+            out << "  \"min_time\": " << opts.min_time << ",\n";
+            out << "  \"render_threads\": " << opts.threads << ",\n";
+            out << "  \"benchmarks\": [";
+            for (size_t i = 0; i < results.size(); i++) {
+                const auto &result = results[i];
+                out << (i == 0 ? "\n" : ",\n");
+                out << "    {\"name\": \"" << result.name << "\", \"unit\": \"" << result.unit
+                    << "\", \"operations\": " << result.operations << ", \"seconds\": " << result.seconds
+                    << ", \"per_second\": " << result.per_second() << "}";
+            }
+            out << "\n  ],\n  \"image_quality\": [";
+            for (size_t i = 0; i < quality.size(); i++) {
+                const auto &result = quality[i];
+                out << (i == 0 ? "\n" : ",\n");
+                out << "    {\"name\": \"" << result.name << "\", \"samples_per_pixel\": " << result.samples_per_pixel
+                    << ", \"seconds\": " << result.seconds << ", \"rmse\": " << result.rmse << "}";
+            }
+            out << "\n  ],\n  \"checks\": [";
+            for (size_t i = 0; i < checks.size(); i++) {
+                const auto &result = checks[i];
+                out << (i == 0 ? "\n" : ",\n");
+                out << "    {\"name\": \"" << result.name << "\", \"passed\": "
+                    << (result.mismatch.empty() ? "true" : "false") << "}";
+            }
+            out << "\n  ]\n}\n";
+        }
+
+    private:
+        bench_options opts;
+        std::vector<benchmark_result> results;
+        std::vector<quality_result> quality;
+        std::vector<check_result> checks;
+};
+
+// Rays from random points in a box of half-size `extent` towards random points of a smaller box
+static std::vector<ray> random_rays(rng &gen, int count, double extent) {
+    std::vector<ray> rays;
+    for (int i = 0; i < count; i++) {
+        point3 origin = vec3::random(gen, -extent, extent);
+        point3 target = vec3::random(gen, -extent / 4, extent / 4);
+        rays.push_back(ray(origin, target - origin));
+    }
+    return rays;
+}
+
+// A list of `count` small spheres spread through a cube of half-size `extent`, created in `arena` if given
+static hittable_list random_spheres(rng &gen, int count, double extent, scene_arena *arena = nullptr) {
+    auto mat = make_in<lambertian>(arena, color(0.5, 0.5, 0.5));
+    double radius = extent / (2 * std::cbrt(static_cast<double>(count)));
+    hittable_list list;
+    for (int i = 0; i < count; i++)
+        list.add(make_in<sphere>(arena, vec3::random(gen, -extent, extent), radius, mat));
+    return list;
+}
+
+// A sphere of the given radius tessellated into 2 * stacks * slices triangles
+static shared_ptr<mesh_geometry> sphere_mesh(int stacks, int slices, double radius) {
+    std::vector<point3> positions;
+    std::vector<uint32_t> indices;
+    for (int i = 0; i <= stacks; i++) {
+        double theta = pi * i / stacks;
+        for (int j = 0; j < slices; j++) {
+            double phi = 2 * pi * j / slices;
+            positions.push_back(radius * point3(std::sin(theta) * std::cos(phi), std::cos(theta),
+                                                std::sin(theta) * std::sin(phi)));
+        }
+    }
+    for (int i = 0; i < stacks; i++) {
+        for (int j = 0; j < slices; j++) {
+            uint32_t a = i * slices + j, b = i * slices + (j + 1) % slices;
+            uint32_t quad[6] = {a, a + slices, b + slices, a, b + slices, b};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return make_shared<mesh_geometry>(std::move(positions), std::move(indices));
+}
+
+// `count` spheres of random radii from 0.5 to 2.5 packed into a cube of half-size 3, so they overlap
+static hittable_list overlapping_spheres(rng &gen, int count) {
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    hittable_list list;
+    for (int i = 0; i < count; i++)
+        list.add(make_shared<sphere>(vec3::random(gen, -3, 3), 0.5 + 2 * random_double(gen), mat));
+    return list;
+}
+
+// Writes a number with every digit, for mismatch reports
+static std::string exact(double x) {
+    std::ostringstream out;
+    out.precision(17);
+    out << x;
+    return out.str();
+}
+
+/*
+ * Casts every ray at `tested` and at `reference`, which it must agree with: the same rays hit and
+ * are blocked, at the same distances, points and normals up to rounding, on the same side and
+ * material. `what` names the case in the mismatch. Returns the first mismatch, or an empty string.
+ */
+static std::string compare_hits(const hittable &tested, const hittable &reference, const std::vector<ray> &rays,
+                                const std::string &what) {
+    const double tolerance = 1000 * std::numeric_limits<real>::epsilon();
+    auto close = [&](double a, double b) { return std::fabs(a - b) <= tolerance * std::max(1.0, std::fabs(b)); };
+    interval ray_t(0.0001, infinity);
+    for (size_t n = 0; n < rays.size(); n++) {
+        hit_record got, expected{};
+        bool hit = tested.hit(rays[n], ray_t, got);
+        bool expected_hit = reference.hit(rays[n], ray_t, expected);
+        std::string where = what + ", ray " + std::to_string(n) + ": ";
+        if (hit != expected_hit)
+            return where + (hit ? "hit" : "missed") + ", the reference " + (expected_hit ? "hits" : "misses");
+        if (tested.occluded(rays[n], ray_t) != expected_hit)
+            return where + "occluded disagrees with the reference's hit";
+        if (!hit)
+            continue;
+        if (!close(got.t, expected.t))
+            return where + "t = " + exact(got.t) + ", the reference " + exact(expected.t);
+        for (int axis = 0; axis < 3; axis++)
+            if (!close(got.p[axis], expected.p[axis]) || !close(got.normal[axis], expected.normal[axis]))
+                return where + "hit point or normal differs";
+        if (got.front_face != expected.front_face || got.mat != expected.mat)
+            return where + "other side or material";
+    }
+    return std::string();
+}
+
+/*
+ * Compares sphere_batch with sphere::hit, which its SIMD lanes and its scalar tail must agree
+ * with: every ray against the first n spheres of `spheres` for every n up to three registers
+ * and a tail, without a BVH so that one hit_range call sees them all, then against all of them
+ * through the BVH. Returns the first mismatch, or an empty string.
+ */
+static std::string compare_sphere_batch(const hittable_list &spheres, const std::vector<ray> &rays) {
+    int max_count = std::min(3 * sphere_batch::lanes() + 1, static_cast<int>(spheres.objects.size()));
+    for (int count = 1; count <= max_count; count++) {
+        hittable_list reference;
+        for (int i = 0; i < count; i++)
+            reference.add(spheres.objects[i]);
+        std::string mismatch = compare_hits(sphere_batch(reference), reference, rays, std::to_string(count) + " spheres");
+        if (!mismatch.empty())
+            return mismatch;
+    }
+    sphere_batch tree(spheres);
+    tree.build_bvh();
+    return compare_hits(tree, spheres, rays, std::to_string(spheres.objects.size()) + " spheres with a BVH");
+}
+
+/*
+ * Compares a mesh placed by a rotating, unevenly scaling transform, as an instance and as an
+ * instance_group, with the same mesh whose vertices were transformed beforehand. Returns the
+ * first mismatch, or an empty string.
+ */
+static std::string compare_instances(rng &gen) {
+    auto prototype = sphere_mesh(8, 16, 1);
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    affine_transform placement = affine_transform::translation(vec3(0.4, -0.3, 0.2))
+                                 * affine_transform::rotation(vec3(1, 2, -0.5), 37)
+                                 * affine_transform::scaling(vec3(2, 0.6, 1.3));
+
+    std::vector<point3> positions;
+    for (const auto &p : prototype->get_positions())
+        positions.push_back(placement.point(p));
+    triangle_mesh transformed(make_shared<mesh_geometry>(std::move(positions), prototype->get_indices()), mat);
+
+    auto object = make_shared<triangle_mesh>(prototype, mat);
+    auto rays = random_rays(gen, 20000, 4);
+    std::string mismatch = compare_hits(instance(object, placement), transformed, rays, "instance");
+    if (!mismatch.empty())
+        return mismatch;
+
+    instance_group group;
+    group.add(group.add_prototype(object), placement);
+    group.add(0, affine_transform::translation(vec3(100, 0, 0)));   // Out of the rays' way, gives the group a tree
+    group.build_bvh();
+    return compare_hits(group, transformed, rays, "instance_group");
+}
+
+/*
+ * Casts rays through the shared edges and vertices of a closed mesh, a tessellated sphere away from
+ * the origin, from points inside it and from points outside beyond the one aimed at. The mesh is
+ * convex, so every ray must hit it where it was aimed (at t = 1) and none may slip between the
+ * triangles around an edge or vertex. Returns the first ray that did, or an empty string.
+ */
+static std::string check_watertight(rng &gen) {
+    const point3 center(3.3, -1.7, 0.9);
+    auto tessellated = sphere_mesh(12, 24, 2);
+    std::vector<point3> positions;
+    for (auto p : tessellated->get_positions()) {
+        // sin(pi) is not 0: weld the ring of vertices at the bottom pole into one, closing the mesh
+        if (std::fabs(p.x()) < 1e-6 && std::fabs(p.z()) < 1e-6)
+            p = point3(0, p.y(), 0);
+        positions.push_back(center + p);
+    }
+    mesh_geometry mesh(std::move(positions), tessellated->get_indices());
+
+    // The vertices of every triangle and points along its edges
+    const auto &vertices = mesh.get_positions();
+    const auto &indices = mesh.get_indices();
+    std::vector<point3> targets;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        for (int corner = 0; corner < 3; corner++) {
+            const point3 &a = vertices[indices[i + corner]];
+            const point3 &b = vertices[indices[i + (corner + 1) % 3]];
+            targets.push_back(a);
+            for (double s : {0.25, 0.5, 0.75})
+                targets.push_back((1 - s) * a + s * b);
+        }
+    }
+
+    const double tolerance = 1000 * std::numeric_limits<real>::epsilon();
+    for (size_t n = 0; n < targets.size(); n++) {
+        const point3 &target = targets[n];
+        point3 inside = center + vec3::random(gen, -0.5, 0.5);
+        point3 outside = center + (3 + random_double(gen)) * (target - center) + vec3::random(gen, -0.5, 0.5);
+        for (const point3 &origin : {inside, outside}) {
+            ray r(origin, target - origin);
+            hit_record rec;
+            std::string where = "target " + std::to_string(n) + (&origin == &inside ? " from inside: " : " from outside: ");
+            if (!mesh.hit(r, interval(0, infinity), rec))
+                return where + "the ray went through the mesh";
+            if (std::fabs(rec.t - 1) > tolerance)
+                return where + "hit at t = " + exact(rec.t) + " instead of 1";
+            if (!mesh.occluded(r, interval(0, infinity)))
+                return where + "occluded disagrees with hit";
+        }
+    }
+    return std::string();
+}
+
+/*
+ * Moves the spheres of a batch three times, refitting its BVH after each move, and compares it
+ * with a batch of the same spheres whose BVH is built from scratch. Returns the first mismatch,
+ * or an empty string.
+ */
+static std::string compare_refit(rng &gen) {
+    hittable_list spheres = overlapping_spheres(gen, 300);
+    sphere_batch refitted(spheres), rebuilt(spheres);
+    refitted.build_bvh();
+    auto rays = random_rays(gen, 5000, 4);
+    for (int move = 1; move <= 3; move++) {
+        for (int i = 0; i < refitted.size(); i++) {
+            point3 center = refitted.get_center(i) + vec3::random(gen, -1, 1);
+            real radius = refitted.get_radius(i) * static_cast<real>(0.5 + random_double(gen));
+            refitted.set_sphere(i, center, radius);
+            rebuilt.set_sphere(i, center, radius);
+        }
+        refitted.refit_bvh();
+        rebuilt.build_bvh();
+        std::string mismatch = compare_hits(refitted, rebuilt, rays, "move " + std::to_string(move));
+        if (!mismatch.empty())
+            return mismatch;
+    }
+    return std::string();
+}
+
+// The spheres of a sphere_batch in file order, sharing its materials
+static hittable_list sphere_list(const sphere_batch &batch) {
+    hittable_list list;
+    for (int i = 0; i < batch.size(); i++) {
+        list.add(make_shared<sphere>(batch.get_center(i), batch.get_radius(i),
+                                     batch.get_materials()[batch.get_material_id(i)]));
+    }
+    return list;
+}
+
+// A sphere_batch and camera written out in the scene format, to compare the scenes they hold
+static std::string scene_text(const sphere_batch &batch, const camera &cam) {
+    std::ostringstream out;
+    save_scene(out, sphere_list(batch), cam);
+    return out.str();
+}
+
+/*
+ * Loads the scene file at `path` through its cache, which must (or must not) be used as
+ * `from_cache` says, and compares the scene, camera and keyframes with those of the file parsed
+ * without the cache, and the BVH with one built for the loaded spheres. Returns the first
+ * mismatch, or an empty string.
+ */
+static std::string compare_cached_scene(const std::string &path, bool from_cache, const std::vector<ray> &rays,
+                                        const std::string &what) {
+    camera cam, parsed_cam;
+    animation anim, parsed_anim;
+    uint64_t scene_hash = 0;
+    bool used_cache = false;
+    auto batch = load_scene_cached(path, cam, scene_hash, used_cache, &anim);
+    hittable_list parsed;
+    load_scene(path, parsed, parsed_cam, nullptr, &parsed_anim);
+    sphere_batch built(parsed);
+    built.build_bvh();
+
+    if (used_cache != from_cache)
+        return what + (used_cache ? ": loaded the out of date cache" : ": did not load the cache");
+    if (scene_hash != parsed.fingerprint())
+        return what + ": scene hash differs from the parsed file's";
+    if (scene_text(*batch, cam) != scene_text(built, parsed_cam))
+        return what + ": spheres, materials or camera differ from the parsed file";
+    sphere_batch rebuilt(sphere_list(*batch));     // The loaded spheres and materials with a new BVH
+    rebuilt.build_bvh();
+    std::string mismatch = compare_hits(*batch, rebuilt, rays, what);
+    if (!mismatch.empty())
+        return mismatch;
+
+    // The keyframes, halfway between two keys
+    anim.pose_camera(cam, 1.5);
+    anim.pose_spheres(*batch, 1.5);
+    parsed_anim.pose_camera(parsed_cam, 1.5);
+    parsed_anim.pose_spheres(built, 1.5);
+    if (anim.frames() != parsed_anim.frames() || scene_text(*batch, cam) != scene_text(built, parsed_cam))
+        return what + ": keyframes differ from the parsed file";
+    return std::string();
+}
+
+/*
+ * Writes a scene file and loads it through its cache: first building the cache, then from it, then
+ * after edits that change the file's size, and its bytes and modification time but not its size,
+ * each of which must leave the out of date cache unused. Returns the first mismatch, or an empty
+ * string.
+ */
+static std::string check_scene_cache(rng &gen) {
+    char dir_template[] = "/tmp/raytracer_bench_XXXXXX";
+    if (!::mkdtemp(dir_template))
+        return "cannot create a temporary directory";
+    const std::string dir = dir_template, path = dir + "/check.scene";
+
+    std::ostringstream scene;
+    scene << "camera image_width 320\ncamera vfov 30\ncamera lookfrom 13 2 3\ncamera lookat 0 0 0\n"
+          << "material ground lambertian 0.5 0.5 0.5\nmaterial gold metal 0.8 0.6 0.2 0.1\n"
+          << "material glass dielectric 1.5\nmaterial lamp light 4 4 3\n"
+          << "sphere 0 -1000 0 1000 ground\n";
+    const char *names[] = {"ground", "gold", "glass", "lamp"};
+    for (int i = 0; i < 200; i++) {
+        point3 center = vec3::random(gen, -4, 4);
+        scene << "sphere " << center << ' ' << 0.1 + 0.4 * random_double(gen) << ' ' << names[i % 4] << '\n';
+    }
+    scene << "frames 3\nkey 0 camera lookfrom 13 2 3\nkey 2 camera lookfrom 10 4 6\n"
+          << "key 0 sphere 1 0 1 0 0.5\nkey 2 sphere 1 1 2 -1 0.7\n";
+    std::string text = scene.str();
+    auto rays = random_rays(gen, 2000, 5);
+
+    auto write = [&](const std::string &contents) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << contents;
+        return static_cast<bool>(out);
+    };
+    auto run = [&]() -> std::string {
+        std::string mismatch;
+        if (!write(text))
+            return "cannot write " + path;
+        if (!(mismatch = compare_cached_scene(path, false, rays, "new file")).empty()
+            || !(mismatch = compare_cached_scene(path, true, rays, "cached file")).empty())
+            return mismatch;
+
+        // A change of size
+        text += "sphere 5 1 5 0.5 gold\n";
+        if (!write(text))
+            return "cannot write " + path;
+        if (!(mismatch = compare_cached_scene(path, false, rays, "longer file")).empty()
+            || !(mismatch = compare_cached_scene(path, true, rays, "longer file cached")).empty())
+            return mismatch;
+
+        // A change of the same size, made an hour back in time
+        text.replace(text.find("sphere 0 -1000 0 1000"), 21, "sphere 0 -1001 0 1001");
+        if (!write(text))
+            return "cannot write " + path;
+        struct timespec times[2] = {{0, UTIME_OMIT}, {::time(nullptr) - 3600, 0}};
+        if (::utimensat(AT_FDCWD, path.c_str(), times, 0) != 0)
+            return "cannot set the modification time of " + path;
+        if (!(mismatch = compare_cached_scene(path, false, rays, "edited file")).empty()
+            || !(mismatch = compare_cached_scene(path, true, rays, "edited file cached")).empty())
+            return mismatch;
+        return std::string();
+    };
+
+    std::string mismatch;
+    try {
+        mismatch = run();
+    } catch (const std::exception &error) {
+        mismatch = error.what();
+    }
+    std::remove((path + ".cache").c_str());
+    std::remove(path.c_str());
+    ::rmdir(dir.c_str());
+    return mismatch;
+}
+
+// Casts every ray at `object` once and returns the number of rays
+static long long cast_all(const hittable &object, const std::vector<ray> &rays) {
+    hit_record rec;
+    double hits = 0;
+    for (const auto &r : rays)
+        if (object.hit(r, interval(0.0001, infinity), rec))
+            hits += rec.t;
+    sink = sink + hits;
+    return static_cast<long long>(rays.size());
+}
+
+// Asks whether anything blocks each ray, as a shadow ray would, returns the number of rays
+static long long occlude_all(const hittable &object, const std::vector<ray> &rays) {
+    long long blocked = 0;
+    for (const auto &r : rays)
+        blocked += object.occluded(r, interval(0.0001, infinity));
+    sink = sink + blocked;
+    return static_cast<long long>(rays.size());
+}
+
+// Scatters random incoming rays off a fixed hit on an upward facing surface
+static long long scatter_all(const material &mat, const std::vector<ray> &rays, rng &gen) {
+    hit_record rec;
+    rec.p = point3(0, 0, 0);
+    rec.t = 1;
+    color attenuation;
+    ray scattered;
+    double total = 0;
+    for (const auto &r : rays) {
+        rec.set_face_normal(r, vec3(0, 1, 0));
+        if (mat.scatter(r, rec, attenuation, scattered, gen))
+            total += scattered.direction().y();
+    }
+    sink = sink + total;
+    return static_cast<long long>(rays.size());
+}
+
+// Sets up `cam` for the demo view at 160 pixels, rendering into memory only
+static void demo_camera(camera &cam, int samples_per_pixel, int threads) {
+    demo_view(cam);
+    cam.image_width = 160;
+    cam.samples_per_pixel = samples_per_pixel;
+    cam.max_depth = 50;
+    cam.seed = 0;
+    cam.integrator = integrator_type::path;
+    cam.num_threads = threads;
+    cam.output = nullptr;
+    cam.show_progress = false;
+}
+
+// Renders the demo view of `world` at 8 samples per pixel, returns the number of rays
+template <typename scene_type>
+static long long render_demo(const scene_type &world, int threads) {
+    camera cam;
+    demo_camera(cam, 8, threads);
+    cam.render(world);
+    return cam.stats.rays;
+}
+
+// Renders the demo view of `world` with `sampling`, denoised if asked to, and returns the image
+template <typename scene_type>
+static framebuffer render_demo_image(const scene_type &world, int samples_per_pixel, bool denoise, int threads,
+                                     sampler_type sampling = sampler_type::independent) {
+    camera cam;
+    demo_camera(cam, samples_per_pixel, threads);
+    cam.denoise = denoise;
+    cam.sampling = sampling;
+    cam.render(world);
+    return cam.frame;
+}
+
+/*
+ * Three spheres on a floor under a dim sky, lit by two small lamps: most of the light arrives
+ * directly from the lamps, which paths rarely hit by scattering.
+ */
+static hittable_list lamp_scene() {
+    hittable_list list;
+    auto floor = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    list.add(make_shared<sphere>(point3(0, -1000, 0), 1000, floor));
+    list.add(make_shared<sphere>(point3(0, 1, 0), 1, make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+    list.add(make_shared<sphere>(point3(-2.2, 1, -1.5), 1, make_shared<metal>(color(0.8, 0.8, 0.85), 0.05)));
+    list.add(make_shared<sphere>(point3(2, 0.7, 1.8), 0.7, make_shared<dielectric>(1.5)));
+    list.add(make_shared<sphere>(point3(1.5, 4, -1), 0.25, make_shared<diffuse_light>(color(40, 30, 20))));
+    list.add(make_shared<sphere>(point3(-3, 3, 3), 0.5, make_shared<diffuse_light>(color(8, 10, 16))));
+    return list;
+}
+
+// Renders the lamp scene, sending shadow rays to the lamps if asked to, and returns the image
+template <typename scene_type>
+static framebuffer render_lamp_image(const scene_type &world, int samples_per_pixel, bool sample_lights, int threads,
+                                     integrator_type integrator = integrator_type::path) {
+    camera cam;
+    demo_camera(cam, samples_per_pixel, threads);
+    cam.vfov = 25;
+    cam.lookfrom = point3(10, 3, 6);
+    cam.lookat = point3(0, 0.8, 0);
+    cam.defocus_angle = 0;
+    cam.sky_brightness = 0.02;
+    cam.sample_lights = sample_lights;
+    cam.integrator = integrator;
+    cam.render(world);
+    return cam.frame;
+}
+
+// Sets up `cam` for the distributed render check: the lamp scene, small, at a fixed sample count
+static void distributed_check_camera(camera &cam) {
+    demo_camera(cam, 4, 1);
+    cam.image_width = 96;
+    cam.vfov = 25;
+    cam.lookfrom = point3(10, 3, 6);
+    cam.lookat = point3(0, 0.8, 0);
+    cam.defocus_angle = 0;
+    cam.sky_brightness = 0.02;
+    cam.output_format = image_format::pfm;
+}
+
+/*
+ * Renders the lamp scene with `workers` worker processes (`program` run with --worker) and in this
+ * process, and compares the two images byte for byte: jobs seed their samples by pixel and sample
+ * index, so without adaptive sampling the merged image must be the same. Returns the mismatch, or
+ * an empty string.
+ */
+static std::string compare_distributed(const std::string &program, int workers) {
+    flat_scene world(lamp_scene());
+    std::ostringstream single, merged;
+    camera cam;
+    distributed_check_camera(cam);
+    cam.output = &single;
+    if (!cam.render(world) || single.str().empty())
+        return "the single-process render wrote no image";
+
+    camera coordinated;
+    distributed_check_camera(coordinated);
+    coordinated.output = &merged;
+    render_coordinator coordinator;
+    coordinator.job_size = 32;
+    coordinator.show_progress = false;
+    for (int w = 0; w < workers; w++)
+        coordinator.worker_commands.push_back({program, "--worker"});
+    try {
+        if (!coordinator.render(coordinated))
+            return "the distributed render stopped";
+    } catch (const std::runtime_error &error) {
+        return error.what();
+    }
+    if (merged.str() != single.str())
+        return "the merged image differs from the single-process render";
+    return std::string();
+}
+
+// Reads a whole file, empty if it cannot be opened
+static std::string file_contents(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+/*
+ * Renders the lamp scene in progressive mode with a noise target, then once more with a single
+ * pass. The passes must take 1, 1, 2, 4... samples per pixel, doubling the image until the
+ * target is met (or cuts the last pass short), and the render must stop with the image error at
+ * the target rather than at samples_per_pixel, and not later: samples are seeded by pixel and
+ * index, so the image before the last pass, rendered on its own, must miss the target. The preview written after the first pass must
+ * replace the file that was there whole, leaving no temporary behind. Returns the mismatch, or an
+ * empty string.
+ */
+static std::string check_progressive() {
+    char dir_template[] = "/tmp/raytracer_bench_XXXXXX";
+    if (!::mkdtemp(dir_template))
+        return "cannot create a temporary directory";
+    const std::string dir = dir_template, preview = dir + "/preview.ppm";
+    flat_scene world(lamp_scene());
+
+    camera cam;
+    distributed_check_camera(cam);
+    cam.samples_per_pixel = 1 << 16;
+    cam.progressive = true;
+    cam.noise_target = 0.02;
+    bool finished = cam.render(world);
+    const auto &passes = cam.stats.pass_sizes;
+
+    std::string mismatch;
+    long long pixels = static_cast<long long>(cam.image_width) * cam.get_image_height(), before = 0;
+    for (size_t pass = 0; pass < passes.size() && mismatch.empty(); pass++) {
+        long long doubled = std::max(before, 1LL);
+        if (passes[pass] != doubled && !(pass + 1 == passes.size() && passes[pass] < doubled))
+            mismatch = "pass " + std::to_string(pass + 1) + " took " + std::to_string(passes[pass])
+                + " samples per pixel instead of " + std::to_string(doubled);
+        before += passes[pass];
+    }
+    if (!finished)
+        mismatch = "the progressive render stopped";
+    else if (mismatch.empty() && passes.size() < 4)
+        mismatch = "the noise target was met after " + std::to_string(passes.size()) + " passes";
+    else if (mismatch.empty() && cam.accum.total_samples() != before * pixels)
+        mismatch = "the passes do not add up to the samples taken";
+    else if (mismatch.empty() && !(cam.image_error() <= cam.noise_target))
+        mismatch = "the render stopped at an image error of " + std::to_string(cam.image_error());
+    if (mismatch.empty()) {
+        camera before_last;
+        distributed_check_camera(before_last);
+        before_last.samples_per_pixel = static_cast<int>(before - passes.back());
+        before_last.render(world);
+        if (before_last.image_error() <= cam.noise_target)
+            mismatch = "the render went on for a pass after the noise target was met";
+    }
+
+    // One sample per pixel is a single pass, whose preview replaces the file there
+    {
+        std::ofstream(preview) << "not an image";
+    }
+    camera first;
+    distributed_check_camera(first);
+    first.progressive = true;
+    first.samples_per_pixel = 1;
+    first.preview_path = preview;
+    first.output_format = image_format::ppm;
+    std::ostringstream image;
+    first.output = &image;
+    if (mismatch.empty() && (!first.render(world) || first.stats.pass_sizes != std::vector<int>{1}))
+        mismatch = "a render of one sample per pixel did not take one pass";
+    else if (mismatch.empty() && file_contents(preview) != image.str())
+        mismatch = "the preview after the first pass is not the image of that pass";
+    else if (mismatch.empty() && ::access((preview + ".tmp").c_str(), F_OK) == 0)
+        mismatch = "the preview's temporary file was left behind";
+
+    std::remove((preview + ".tmp").c_str());
+    std::remove(preview.c_str());
+    ::rmdir(dir.c_str());
+    return mismatch;
+}
+
+// Sends a request to a render_server
+static bool send_request(int fd, request_type type, uint32_t id, int priority, const std::string &payload) {
+    server_request request{static_cast<uint32_t>(type), id, priority, static_cast<uint32_t>(image_format::ppm), payload.size()};
+    return write_all(fd, &request, sizeof(request)) && write_all(fd, payload.data(), payload.size());
+}
+
+/*
+ * Serves a job of the lamp scene and a much larger one of lower priority over a pipe
+ * (render_server::serve_stream), cancelling the large one right after sending it. The small job
+ * must be answered with the image camera::render makes, the large one as cancelled. Returns the
+ * mismatch, or an empty string.
+ */
+static std::string check_render_server() {
+    camera cam;
+    distributed_check_camera(cam);
+    std::ostringstream single;
+    cam.output = &single;
+    cam.output_format = image_format::ppm;
+    if (!cam.render(flat_scene(lamp_scene())))
+        return "the single-process render stopped";
+
+    char dir_template[] = "/tmp/raytracer_bench_XXXXXX";
+    if (!::mkdtemp(dir_template))
+        return "cannot create a temporary directory";
+    const std::string dir = dir_template, path = dir + "/server.scene";
+    {
+        std::ofstream out(path);
+        save_scene(out, lamp_scene(), cam);
+    }
+
+    int requests[2], replies[2];
+    if (::pipe(requests) != 0)
+        return "cannot create a pipe";
+    if (::pipe(replies) != 0) {
+        ::close(requests[0]);
+        ::close(requests[1]);
+        return "cannot create a pipe";
+    }
+    render_server server(cam);
+    server.num_threads = 2;
+    server.show_progress = false;
+    std::thread serving([&] {
+        server.serve_stream(requests[0], replies[1]);
+        ::close(replies[1]);
+    });
+
+    bool sent = send_request(requests[1], request_type::render, 1, 0,
+                             path + "\ncamera image_width 640\ncamera samples_per_pixel 4096")
+        && send_request(requests[1], request_type::render, 2, 1, path + "\ncamera samples_per_pixel " +
+                        std::to_string(cam.samples_per_pixel))
+        && send_request(requests[1], request_type::cancel, 1, 0, std::string());
+    ::close(requests[1]);
+
+    std::string mismatch;
+    std::map<uint32_t, std::pair<uint32_t, std::string>> answers;
+    server_reply reply;
+    while (read_all(replies[0], &reply, sizeof(reply))) {
+        std::string payload(static_cast<size_t>(reply.bytes), '\0');
+        if (!read_all(replies[0], &payload[0], payload.size()))
+            break;
+        answers[reply.id] = std::make_pair(reply.status, payload);
+    }
+    serving.join();
+    ::close(requests[0]);
+    ::close(replies[0]);
+    std::remove((path + ".cache").c_str());
+    std::remove(path.c_str());
+    ::rmdir(dir.c_str());
+
+    if (!sent)
+        return "cannot send the requests";
+    if (answers.size() != 2)
+        return "the server answered " + std::to_string(answers.size()) + " of 2 jobs";
+    if (answers[1].first != static_cast<uint32_t>(reply_status::cancelled))
+        return "the cancelled job was not answered as cancelled";
+    if (answers[2].first != static_cast<uint32_t>(reply_status::done))
+        return "the job failed: " + answers[2].second;
+    if (answers[2].second != single.str())
+        return "the served image differs from the single-process render";
+    return std::string();
+}
+
+// Reads DEFLATE bits least significant first, and Huffman codes most significant first
+class bit_reader {
+    public:
+        bit_reader(const std::vector<uint8_t> &data, size_t start) : data(data), pos(start * 8) {}
+
+        bool exhausted() const { return pos > data.size() * 8; }
+
+        uint32_t bits(int count) {
+            uint32_t value = 0;
+            for (int b = 0; b < count; b++, pos++)
+                if (pos < data.size() * 8)
+                    value |= static_cast<uint32_t>((data[pos / 8] >> (pos % 8)) & 1) << b;
+            return value;
+        }
+
+        uint32_t code(int count) {
+            uint32_t value = 0;
+            for (int b = 0; b < count; b++)
+                value = (value << 1) | bits(1);
+            return value;
+        }
+
+        void align() { pos = (pos + 7) / 8 * 8; }
+
+    private:
+        const std::vector<uint8_t> &data;
+        size_t pos;
+};
+
+// Next literal/length symbol of a block compressed with the fixed Huffman code
+static int fixed_literal(bit_reader &in) {
+    uint32_t code = in.code(7);
+    if (code <= 0x17)
+        return 256 + static_cast<int>(code);
+    code = (code << 1) | in.code(1);
+    if (code >= 0x30 && code <= 0xBF)
+        return static_cast<int>(code) - 0x30;
+    if (code >= 0xC0 && code <= 0xC7)
+        return 280 + static_cast<int>(code) - 0xC0;
+    code = (code << 1) | in.code(1);
+    return 144 + static_cast<int>(code) - 0x190;
+}
+
+/*
+ * Inflates a zlib stream made of stored and fixed Huffman blocks, the ones deflate_encoder
+ * writes (dynamic Huffman blocks are rejected). Returns false on a malformed stream.
+ */
+static bool inflate_fixed(const std::vector<uint8_t> &zlib, std::vector<uint8_t> &out) {
+    static const int length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                          8193, 12289, 16385, 24577};
+    static const int distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                           7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    if (zlib.size() < 2 || (zlib[0] & 0x0F) != 8)
+        return false;
+    bit_reader in(zlib, 2);
+    bool final = false;
+    while (!final) {
+        final = in.bits(1) != 0;
+        uint32_t type = in.bits(2);
+        if (type == 0) {
+            in.align();
+            uint32_t length = in.bits(16);
+            if ((length ^ in.bits(16)) != 0xFFFF)
+                return false;
+            for (uint32_t i = 0; i < length; i++)
+                out.push_back(static_cast<uint8_t>(in.bits(8)));
+        } else if (type == 1) {
+            while (true) {
+                int symbol = fixed_literal(in);
+                if (in.exhausted() || symbol > 285)
+                    return false;
+                if (symbol < 256) {
+                    out.push_back(static_cast<uint8_t>(symbol));
+                    continue;
+                }
+                if (symbol == 256)
+                    break;
+                int length = length_base[symbol - 257] + static_cast<int>(in.bits(length_extra[symbol - 257]));
+                int d = static_cast<int>(in.code(5));
+                if (d > 29)
+                    return false;
+                size_t distance = static_cast<size_t>(distance_base[d]) + in.bits(distance_extra[d]);
+                if (distance > out.size())
+                    return false;
+                for (int i = 0; i < length; i++)
+                    out.push_back(out[out.size() - distance]);
+            }
+        } else {
+            return false;
+        }
+        if (in.exhausted())
+            return false;
+    }
+    return true;
+}
+
+// Decodes an 8-bit RGB PNG into packed rows; returns false if it is not one inflate_fixed can read
+static bool decode_png(const std::string &file, int &width, int &height, std::vector<uint8_t> &rgb) {
+    static const char signature[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    if (file.size() < 8 || file.compare(0, 8, signature, 8) != 0)
+        return false;
+    auto u32 = [&](size_t at) {
+        return static_cast<uint32_t>(static_cast<uint8_t>(file[at])) << 24 | static_cast<uint32_t>(static_cast<uint8_t>(file[at + 1])) << 16
+            | static_cast<uint32_t>(static_cast<uint8_t>(file[at + 2])) << 8 | static_cast<uint8_t>(file[at + 3]);
+    };
+    std::vector<uint8_t> zlib;
+    width = height = 0;
+    for (size_t at = 8; at + 12 <= file.size();) {
+        size_t length = u32(at);
+        std::string type = file.substr(at + 4, 4);
+        if (at + 12 + length > file.size())
+            return false;
+        if (type == "IHDR") {
+            width = static_cast<int>(u32(at + 8));
+            height = static_cast<int>(u32(at + 12));
+            if (file[at + 16] != 8 || file[at + 17] != 2 || file[at + 20] != 0)
+                return false;  // Only 8-bit RGB without interlacing
+        } else if (type == "IDAT") {
+            zlib.insert(zlib.end(), file.begin() + static_cast<std::ptrdiff_t>(at + 8),
+                        file.begin() + static_cast<std::ptrdiff_t>(at + 8 + length));
+        }
+        at += 12 + length;
+    }
+    std::vector<uint8_t> filtered;
+    size_t row_bytes = static_cast<size_t>(width) * 3;
+    if (width <= 0 || height <= 0 || !inflate_fixed(zlib, filtered) || filtered.size() != (row_bytes + 1) * height)
+        return false;
+
+    // Undo the filter of every row, against the row above it
+    rgb.assign(row_bytes * height, 0);
+    for (int y = 0; y < height; y++) {
+        const uint8_t *src = &filtered[y * (row_bytes + 1)];
+        uint8_t *row = &rgb[y * row_bytes];
+        const uint8_t *up = y > 0 ? row - row_bytes : nullptr;
+        for (size_t i = 0; i < row_bytes; i++) {
+            int a = i >= 3 ? row[i - 3] : 0, b = up ? up[i] : 0, c = up && i >= 3 ? up[i - 3] : 0;
+            int predicted;
+            switch (src[0]) {
+                case 0: predicted = 0; break;
+                case 1: predicted = a; break;
+                case 2: predicted = b; break;
+                case 3: predicted = (a + b) / 2; break;
+                case 4: {
+                    int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                    predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                    break;
+                }
+                default: return false;
+            }
+            row[i] = static_cast<uint8_t>(src[1 + i] + predicted);
+        }
+    }
+    return true;
+}
+
+/*
+ * Streams the lamp scene band by band in every format, on 4 threads with at most one band ahead
+ * of the writer and a height that is not a whole number of bands, and compares each file with the
+ * one camera::render writes: PPM and PFM byte for byte, PNG (compressed band by band) pixel for
+ * pixel. Returns the mismatch, or an empty string.
+ */
+static std::string compare_stream_renderer() {
+    flat_scene world(lamp_scene());
+    for (image_format format : {image_format::ppm, image_format::pfm, image_format::png}) {
+        camera cam;
+        distributed_check_camera(cam);
+        cam.output_format = format;
+        std::ostringstream whole, streamed;
+        cam.output = &whole;
+        if (!cam.render(world))
+            return "the whole-image render stopped";
+
+        stream_renderer streamer;
+        streamer.num_threads = 4;
+        streamer.max_pending_bands = 1;
+        streamer.show_progress = false;
+        if (cam.get_image_height() % streamer.band_height == 0)
+            return "the image height is a whole number of bands";
+        if (!streamer.render(cam, world, streamed))
+            return "the streamed render stopped";
+        if (streamer.peak_pending_bands > 1)
+            return "more bands waited for the writer than max_pending_bands";
+
+        const char *name = format == image_format::ppm ? "PPM" : format == image_format::pfm ? "PFM" : "PNG";
+        if (format != image_format::png) {
+            if (streamed.str() != whole.str())
+                return std::string("the streamed ") + name + " differs from the whole-image one";
+            continue;
+        }
+        int whole_width, whole_height, streamed_width, streamed_height;
+        std::vector<uint8_t> whole_rgb, streamed_rgb;
+        if (!decode_png(whole.str(), whole_width, whole_height, whole_rgb)
+            || !decode_png(streamed.str(), streamed_width, streamed_height, streamed_rgb))
+            return "a PNG could not be decoded";
+        if (streamed_width != whole_width || streamed_height != whole_height || streamed_rgb != whole_rgb)
+            return "the pixels of the streamed PNG differ from the whole-image one";
+    }
+    return std::string();
+}
+
+// A lambertian that reflects like a mirror, which a shader calling lambertian::scatter would miss
+class mirrored_lambertian : public lambertian {
+    public:
+        using lambertian::lambertian;
+
+        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &)
+        const override {
+            scattered = ray(rec.p, reflect(unit_vector(r_in.direction()), rec.normal));
+            attenuation = get_albedo();
+            return true;
+        }
+};
+
+// A light whose emission is not its get_emission(), which next-event estimation must not sample by it
+class dimmed_light : public diffuse_light {
+    public:
+        using diffuse_light::diffuse_light;
+
+        color emitted(const hit_record &rec) const override { return 0.5 * diffuse_light::emitted(rec); }
+};
+
+/*
+ * Renders the lamp scene with a class derived from lambertian on one sphere, with the recursive
+ * and the wavefront integrator: the wavefront one must still call its own scatter, so the images
+ * must be the same up to rounding. Saving the scene must fail rather than write the sphere as a
+ * plain lambertian, and a derived light must be left to scattered rays. Returns the mismatch, or
+ * an empty string.
+ */
+static std::string compare_derived_material() {
+    hittable_list world = lamp_scene();
+    world.add(make_shared<sphere>(point3(0, 0.6, 2.2), 0.6, make_shared<mirrored_lambertian>(color(0.9, 0.9, 0.9))));
+    framebuffer recursive = render_lamp_image(world, 2, false, 1, integrator_type::recursive);
+    framebuffer wavefront = render_lamp_image(world, 2, false, 1, integrator_type::wavefront);
+    if (recursive.width() != wavefront.width() || recursive.height() != wavefront.height())
+        return "the images differ in size";
+    size_t floats = static_cast<size_t>(recursive.width()) * recursive.height() * 3;
+    for (size_t k = 0; k < floats; k++) {
+        double a = recursive.data()[k], b = wavefront.data()[k];
+        if (std::fabs(a - b) > 1e-4 * (std::fabs(a) + 1e-3))  // The integrators round in a different order
+            return "the wavefront image differs from the recursive one";
+    }
+
+    hittable_list dimmed;
+    dimmed.add(make_shared<sphere>(point3(0, 4, 0), 0.5, make_shared<dimmed_light>(color(4, 4, 4))));
+    if (light_list(dimmed).size() != 0 || light_list(sphere_batch(dimmed)).size() != 0)
+        return "a light derived from diffuse_light is sampled by its base emission";
+
+    std::ostringstream text;
+    try {
+        save_scene(text, world, camera());
+    } catch (const std::invalid_argument &) {
+        return std::string();
+    }
+    return "save_scene wrote the derived material as its base";
+}
+
+int main(int argc, char **argv) {
+    bench_options opts;
+    for (int arg = 1; arg < argc; arg++) {
+        if (std::strcmp(argv[arg], "--worker") == 0) {
+            camera cam;
+            distributed_check_camera(cam);
+            return serve_render_jobs(cam, flat_scene(lamp_scene())) ? 0 : 1;
+        }
+        if (std::strcmp(argv[arg], "--filter") == 0 && arg + 1 < argc)
+            opts.filter = argv[++arg];
+        else if (std::strcmp(argv[arg], "--min-time") == 0 && arg + 1 < argc)
+            opts.min_time = std::atof(argv[++arg]);
+        else if (std::strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc)
+            opts.threads = std::atoi(argv[++arg]);
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--filter <text>] [--min-time <seconds>] [--threads <count>]\n";
+            return 2;
+        }
+    }
+
+    bench_suite suite(opts);
+    rng gen(1, 0, 0);
+    auto rays = random_rays(gen, 4096, 10);
+
+    /*
+     * Fixtures are built only for the benchmarks that pass the filter, each from a generator of
+     * its own so that the filter does not change the data the other benchmarks see.
+     */
+    auto fixture_rng = [](uint32_t group) { return rng(1, group, 0); };
+
+    // Correctness: the SIMD intersection of this build against the plain one
+    suite.check("check/sphere_batch::hit", [&] {
+        rng check_gen(2, 0, 0);
+        auto spheres = overlapping_spheres(check_gen, 200);
+        return compare_sphere_batch(spheres, random_rays(check_gen, 20000, 4));
+    });
+
+    // Correctness: an image merged from worker processes against one rendered in a single process
+    suite.check("check/render_coordinator", [&] { return compare_distributed(argv[0], 2); });
+
+    // Correctness: no ray through a shared edge or vertex of a mesh falls between its triangles
+    suite.check("check/triangle_mesh::watertight", [&] {
+        rng check_gen(3, 0, 0);
+        return check_watertight(check_gen);
+    });
+
+    // Correctness: a transformed instance against the same mesh transformed vertex by vertex
+    suite.check("check/instance::hit", [&] {
+        rng check_gen(4, 0, 0);
+        return compare_instances(check_gen);
+    });
+
+    // Correctness: a BVH refitted to moved spheres against one built for them from scratch
+    suite.check("check/sphere_batch::refit_bvh", [&] {
+        rng check_gen(5, 0, 0);
+        return compare_refit(check_gen);
+    });
+
+    // Correctness: a scene loaded from its cache against the file parsed, and a cache going out of date
+    suite.check("check/scene_cache", [&] {
+        rng check_gen(6, 0, 0);
+        return check_scene_cache(check_gen);
+    });
+
+    // Correctness: progressive passes doubling the image until a noise target stops them, and the preview
+    suite.check("check/progressive", [&] { return check_progressive(); });
+
+    // Correctness: a render_server job against the same render in this process, and a job cancelled
+    suite.check("check/render_server", [&] { return check_render_server(); });
+
+    // Correctness: an image streamed band by band against one rendered whole
+    suite.check("check/stream_renderer", [&] { return compare_stream_renderer(); });
+
+    // Correctness: a class derived from a built-in material is shaded by its own scatter
+    suite.check("check/material::type", [&] { return compare_derived_material(); });
+
+    // Intersection
+    sphere single(point3(0, 0, 0), 2.5, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    suite.run("sphere::hit", "rays", [&] { return cast_all(single, rays); });
+
+    for (int count : {1, 10, 100, 1000}) {
+        std::string name = "hittable_list::hit/" + std::to_string(count);
+        if (!suite.selected(name))
+            continue;
+        rng list_gen = fixture_rng(count);
+        auto list = random_spheres(list_gen, count, 10);
+        suite.run(name, "rays", [&] { return cast_all(list, rays); });
+    }
+
+    for (int count : {1000, 100000}) {
+        std::string size = std::to_string(count);
+        if (!suite.selected_any({"bvh_node::hit/" + size, "bvh_node::occluded/" + size,
+                                 "sphere_batch::hit/" + size, "sphere_batch::occluded/" + size}))
+            continue;
+        rng list_gen = fixture_rng(count + 1);
+        auto list = random_spheres(list_gen, count, 10);
+        if (suite.selected_any({"bvh_node::hit/" + size, "bvh_node::occluded/" + size})) {
+            bvh_node tree(list);
+            suite.run("bvh_node::hit/" + size, "rays", [&] { return cast_all(tree, rays); });
+            suite.run("bvh_node::occluded/" + size, "rays", [&] { return occlude_all(tree, rays); });
+        }
+        if (suite.selected_any({"sphere_batch::hit/" + size, "sphere_batch::occluded/" + size})) {
+            sphere_batch batch(list);
+            batch.build_bvh();
+            suite.run("sphere_batch::hit/" + size, "rays", [&] { return cast_all(batch, rays); });
+            suite.run("sphere_batch::occluded/" + size, "rays", [&] { return occlude_all(batch, rays); });
+        }
+    }
+
+    for (int stacks : {10, 220}) {
+        std::string name = "triangle_mesh::hit/" + std::to_string(2 * stacks * 2 * stacks);
+        if (!suite.selected(name))
+            continue;
+        triangle_mesh mesh(sphere_mesh(stacks, 2 * stacks, 5), make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+        suite.run(name, "rays", [&] { return cast_all(mesh, rays); });
+    }
+
+    // The same copies of a small mesh flattened into one mesh, and instanced through a two-level BVH
+    const int copies = 1000;
+    if (suite.selected_any({"triangle_mesh::hit/" + std::to_string(copies) + "_copies",
+                            "instance_group::hit/" + std::to_string(copies)})) {
+        rng placement_gen = fixture_rng(2);
+        auto prototype = sphere_mesh(10, 20, 0.4);
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        std::vector<affine_transform> placements;
+        for (int i = 0; i < copies; i++) {
+            placements.push_back(affine_transform::translation(vec3::random(placement_gen, -10, 10))
+                                 * affine_transform::rotation(vec3::random(placement_gen, -1, 1),
+                                                              360 * random_double(placement_gen))
+                                 * affine_transform::scaling(vec3::random(placement_gen, 0.5, 1.5)));
+        }
+
+        std::vector<point3> positions;
+        std::vector<uint32_t> indices;
+        for (const auto &placement : placements) {
+            auto base = static_cast<uint32_t>(positions.size());
+            for (const auto &p : prototype->get_positions())
+                positions.push_back(placement.point(p));
+            for (auto index : prototype->get_indices())
+                indices.push_back(base + index);
+        }
+        triangle_mesh flattened(make_shared<mesh_geometry>(std::move(positions), std::move(indices)), mat);
+        suite.run("triangle_mesh::hit/" + std::to_string(copies) + "_copies", "rays", [&] { return cast_all(flattened, rays); });
+
+        instance_group group;
+        int id = group.add_prototype(make_shared<triangle_mesh>(prototype, mat));
+        for (const auto &placement : placements)
+            group.add(id, placement);
+        group.build_bvh();
+        suite.run("instance_group::hit/" + std::to_string(copies), "rays", [&] { return cast_all(group, rays); });
+    }
+
+    // Building and destroying a scene, one heap allocation per object or all of them in an arena
+    const int scene_size = 100000;
+    suite.run("scene/build_heap/" + std::to_string(scene_size), "objects", [&] {
+        sink = sink + random_spheres(gen, scene_size, 10).bounding_box().x.size();
+        return static_cast<long long>(scene_size);
+    });
+    scene_arena arena(1 << 20);
+    suite.run("scene/build_arena/" + std::to_string(scene_size), "objects", [&] {
+        sink = sink + random_spheres(gen, scene_size, 10, &arena).bounding_box().x.size();
+        arena.clear();
+        return static_cast<long long>(scene_size);
+    });
+    if (suite.selected("bvh_node::hit/" + std::to_string(scene_size) + "/arena")) {
+        rng list_gen = fixture_rng(3);
+        auto list = random_spheres(list_gen, scene_size, 10, &arena);
+        bvh_node tree(list);
+        suite.run("bvh_node::hit/" + std::to_string(scene_size) + "/arena", "rays", [&] { return cast_all(tree, rays); });
+    }
+    arena.clear();
+
+    // Updating the BVH of a batch whose spheres moved: refit in place or build from scratch
+    if (suite.selected_any({"sphere_batch::refit_bvh/" + std::to_string(scene_size),
+                            "sphere_batch::build_bvh/" + std::to_string(scene_size)})) {
+        rng list_gen = fixture_rng(4);
+        sphere_batch batch(random_spheres(list_gen, scene_size, 10));
+        batch.build_bvh();
+        suite.run("sphere_batch::refit_bvh/" + std::to_string(scene_size), "spheres", [&] {
+            batch.set_sphere(0, batch.get_center(0) + vec3(0.01, 0, 0), batch.get_radius(0));
+            batch.refit_bvh();
+            return static_cast<long long>(scene_size);
+        });
+        suite.run("sphere_batch::build_bvh/" + std::to_string(scene_size), "spheres", [&] {
+            batch.build_bvh();
+            return static_cast<long long>(scene_size);
+        });
+    }
+
+    // Shading
+    lambertian diffuse(color(0.5, 0.5, 0.5));
+    metal mirror(color(0.7, 0.6, 0.5), 0.3);
+    dielectric glass(1.5);
+    suite.run("lambertian::scatter", "scatters", [&] { return scatter_all(diffuse, rays, gen); });
+    suite.run("metal::scatter", "scatters", [&] { return scatter_all(mirror, rays, gen); });
+    suite.run("dielectric::scatter", "scatters", [&] { return scatter_all(glass, rays, gen); });
+
+    // Math and random numbers; std::rand, which the renderer used before Philox, for comparison
+    const int calls = 1 << 16;
+    suite.run("random_double", "calls", [&] {
+        double total = 0;
+        for (int i = 0; i < calls; i++)
+            total += random_double(gen);
+        sink = sink + total;
+        return static_cast<long long>(calls);
+    });
+    suite.run("std::rand", "calls", [&] {
+        double total = 0;
+        for (int i = 0; i < calls; i++)
+            total += std::rand() / (RAND_MAX + 1.0);
+        sink = sink + total;
+        return static_cast<long long>(calls);
+    });
+    suite.run("unit_vector", "calls", [&] {
+        vec3 total(0, 0, 0);
+        for (const auto &r : rays)
+            total += unit_vector(r.direction());
+        sink = sink + total.x();
+        return static_cast<long long>(rays.size());
+    });
+
+    // The main.cpp scene at reduced size with a fixed seed, behind virtual calls and flattened as main.cpp renders it
+    hittable_list demo_list;
+    auto get_demo_list = [&]() -> const hittable_list & {
+        if (demo_list.objects.empty()) {
+            rng scene_gen(0, 0xFFFFFFFF, 0);
+            demo_list = demo_scene(scene_gen);
+        }
+        return demo_list;
+    };
+    if (suite.selected("render/demo_scene")) {
+        hittable_list world(make_shared<bvh_node>(get_demo_list()));
+        suite.run("render/demo_scene", "rays", [&] { return render_demo(world, opts.threads); });
+    }
+    std::unique_ptr<flat_scene> flat_demo;
+    auto flat = [&]() -> const flat_scene & {
+        if (!flat_demo)
+            flat_demo.reset(new flat_scene(get_demo_list()));
+        return *flat_demo;
+    };
+    suite.run("render/demo_scene_flat", "rays", [&] { return render_demo(flat(), opts.threads); });
+
+    // Error of low sample counts, with and without the denoiser, against a 1024 samples per pixel render
+    const int reference_samples = 1024;
+    framebuffer reference;
+    auto get_reference = [&]() -> const framebuffer & {
+        if (reference.width() == 0) {
+            std::clog << "Rendering the reference image at " << reference_samples << " samples per pixel\n";
+            reference = render_demo_image(flat(), reference_samples, false, opts.threads);
+        }
+        return reference;
+    };
+    for (int samples : {4, 16, 32, 64}) {
+        std::string name = "quality/demo_scene/" + std::to_string(samples) + "spp";
+        suite.compare(name, samples, [&] { return render_demo_image(flat(), samples, false, opts.threads); }, get_reference);
+        suite.compare(name + "/denoised", samples, [&] { return render_demo_image(flat(), samples, true, opts.threads); },
+                      get_reference);
+    }
+
+    /*
+     * The samplers compared at equal sample counts, and at equal time: each gets the time the
+     * independent sampler takes for 64 samples per pixel, turned into a sample count from the
+     * time it takes for 64 itself.
+     */
+    const sampler_type samplers[] = {sampler_type::independent, sampler_type::stratified, sampler_type::sobol,
+                                     sampler_type::blue_noise};
+    double budget = 0;
+    for (sampler_type type : samplers) {
+        std::string name = std::string("quality/samplers/") + sampler_name(type) + "/";
+        for (int samples : {4, 16, 64}) {
+            suite.compare(name + std::to_string(samples) + "spp", samples,
+                          [&] { return render_demo_image(flat(), samples, false, opts.threads, type); }, get_reference);
+        }
+
+        if (!suite.selected(name + "equal_time"))
+            continue;
+        auto seconds_of = [&](int samples, sampler_type sampling) {
+            auto start = std::chrono::steady_clock::now();
+            render_demo_image(flat(), samples, false, opts.threads, sampling);
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+        if (budget == 0)
+            budget = seconds_of(64, sampler_type::independent);
+        int samples = std::max(1, static_cast<int>(64 * budget / seconds_of(64, type) + 0.5));
+        suite.compare(name + "equal_time", samples,
+                      [&] { return render_demo_image(flat(), samples, false, opts.threads, type); }, get_reference);
+    }
+
+    /*
+     * Next-event estimation against finding the lamps by scattering alone, at equal sample
+     * counts. The recursive and wavefront integrators never aim at lights, so they are held to
+     * the same reference to show they agree with it.
+     */
+    std::unique_ptr<flat_scene> lamp_flat;
+    auto lamps = [&]() -> const flat_scene & {
+        if (!lamp_flat)
+            lamp_flat.reset(new flat_scene(lamp_scene()));
+        return *lamp_flat;
+    };
+    framebuffer lamp_reference;
+    auto get_lamp_reference = [&]() -> const framebuffer & {
+        if (lamp_reference.width() == 0) {
+            std::clog << "Rendering the lamp reference image at " << reference_samples << " samples per pixel\n";
+            lamp_reference = render_lamp_image(lamps(), reference_samples, true, opts.threads);
+        }
+        return lamp_reference;
+    };
+    for (int samples : {4, 16, 64}) {
+        std::string name = "quality/lamps/" + std::to_string(samples) + "spp";
+        suite.compare(name, samples, [&] { return render_lamp_image(lamps(), samples, true, opts.threads); },
+                      get_lamp_reference);
+        suite.compare(name + "/no_light_sampling", samples,
+                      [&] { return render_lamp_image(lamps(), samples, false, opts.threads); }, get_lamp_reference);
+    }
+    suite.compare("quality/lamps/64spp/recursive", 64,
+                  [&] { return render_lamp_image(lamps(), 64, false, opts.threads, integrator_type::recursive); },
+                  get_lamp_reference);
+    suite.compare("quality/lamps/64spp/wavefront", 64,
+                  [&] { return render_lamp_image(lamps(), 64, false, opts.threads, integrator_type::wavefront); },
+                  get_lamp_reference);
+
+    suite.write_json(std::cout);
+    if (suite.failed()) {
+        std::cerr << "A check failed\n";
+        return 1;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,443 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "utils.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/*
+ * Bounding volume hierarchy over an array of primitive boxes.
+ * The tree only knows about boxes and primitive indices, so it can be shared by any
+ * primitive type: `bvh_node` uses it over hittable objects.
+ *
+ * Construction uses binned SAH (surface area heuristic): at each node the primitive centroids
+ * are dropped into a fixed number of bins along every axis and the split plane with the lowest
+ * estimated traversal cost wins. Large subtrees are built concurrently.
+ * The finished tree is flattened into a depth-first node array: the left child of an inner node
+ * always directly follows it, the index of the right child is stored in the node.
+ */
+class bvh_tree {
+    public:
+        // Flattened tree node
+        struct node {
+            aabb bbox;      // Box enclosing everything below this node
+            int offset;     // Leaf: first entry in `indices`; inner node: index of the right child
+            int count;      // Leaf: number of primitives; inner node: 0
+            int axis;       // Inner node: axis the children were split along
+        };
+
+        std::vector<node> nodes;       // Depth-first node array, nodes[0] is the root
+        std::vector<int> indices;      // Primitive indices referenced by the leaves
+
+        static const int bin_count = 16;        // Bins per axis used to evaluate SAH splits
+        static const int max_sah_depth = 48;    // Below this depth nodes are split at the median instead
+
+        /*
+         * Builds the tree over the given primitive boxes.
+         * Leaves never hold more than `max_leaf_size` primitives; callers intersecting whole
+         * leaves at once (e.g. with SIMD) can raise it to match their batch width.
+         */
+        void build(const std::vector<aabb> &boxes, int max_leaf_size = 4) {
+            nodes.clear();
+            indices.resize(boxes.size());
+            for (size_t i = 0; i < boxes.size(); i++)
+                indices[i] = static_cast<int>(i);
+
+            if (boxes.empty())
+                return;
+
+            std::vector<point3> centroids(boxes.size());
+            for (size_t i = 0; i < boxes.size(); i++)
+                centroids[i] = boxes[i].centroid();
+
+            // Spawn threads for the top levels only, enough to keep every core busy
+            int parallel_depth = 0;
+            for (unsigned int n = std::thread::hardware_concurrency(); n > 1; n >>= 1)
+                parallel_depth++;
+
+            build_context ctx{boxes, centroids, indices, std::max(max_leaf_size, 1)};
+            auto root = build_recursive(ctx, 0, static_cast<int>(boxes.size()), 0, parallel_depth + 1);
+
+            nodes.reserve(root->subtree_size);
+            flatten(*root);
+        }
+
+        /*
+         * Recomputes the box of every node from new primitive boxes (indexed as in `build`) and
+         * keeps the tree's shape, for primitives that moved. It costs a pass over the nodes, but
+         * the boxes grow and overlap as the primitives drift from where the tree was built:
+         * compare sah_cost() to its value after the build to decide when to build again.
+         */
+        void refit(const std::vector<aabb> &boxes) {
+            // Children follow their parent in the array, so a backward pass sees them first
+            for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+                node &n = nodes[i];
+                if (n.count > 0) {
+                    n.bbox = aabb();
+                    for (int k = n.offset; k < n.offset + n.count; k++)
+                        n.bbox = aabb(n.bbox, boxes[indices[k]]);
+                } else {
+                    n.bbox = aabb(nodes[i + 1].bbox, nodes[n.offset].bbox);
+                }
+            }
+        }
+
+        /*
+         * Expected cost of a ray through the root, in units of primitive tests, as estimated by
+         * the surface area heuristic: every node is entered with a probability of its area over
+         * the root's, entering an inner node costs 1 and a leaf 1 per primitive.
+         */
+        double sah_cost() const {
+            if (nodes.empty() || nodes[0].bbox.surface_area() <= 0)
+                return 0;
+            double cost = 0;
+            for (const auto &n : nodes)
+                cost += n.bbox.surface_area() * std::max(n.count, 1);
+            return cost / nodes[0].bbox.surface_area();
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        // Returns the box enclosing the whole tree
+        aabb bounding_box() const {
+            return nodes.empty() ? aabb() : nodes[0].bbox;
+        }
+
+        /*
+         * Visits the primitives hit by the ray front to back.
+         * `hit_primitive(index, closest)` must test primitive `index` against (ray_t.min, closest)
+         * and return true after shrinking `closest` to the new hit distance.
+         * Subtrees entirely beyond the closest hit so far are skipped.
+         */
+        template <typename hit_function>
+        bool intersect(const ray &r, interval ray_t, hit_function &&hit_primitive) const {
+            return intersect_leaves(r, ray_t, [&](int first, int count, real &closest_so_far) {
+                bool hit_anything = false;
+                for (int i = first; i < first + count; i++) {
+                    if (hit_primitive(indices[i], closest_so_far))
+                        hit_anything = true;
+                }
+                return hit_anything;
+            });
+        }
+
+        /*
+         * Same traversal as `intersect`, but hands whole leaves to the callback:
+         * `hit_leaf(first, count, closest)` covers indices[first, first + count).
+         * Useful when primitives are stored in leaf order and tested in batches.
+         */
+        template <typename leaf_function>
+        bool intersect_leaves(const ray &r, interval ray_t, leaf_function &&hit_leaf) const {
+            if (nodes.empty())
+                return false;
+
+            const vec3 &dir = r.direction();
+            const vec3 inv_dir(1 / dir[0], 1 / dir[1], 1 / dir[2]);
+            const bool dir_negative[3] = {inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0};
+            const point3 origin = r.origin();
+
+            bool hit_anything = false;
+            auto closest_so_far = ray_t.max;
+
+            int stack[128];
+            int stack_size = 0;
+            stack[stack_size++] = 0;
+
+            while (stack_size > 0) {
+                const node &n = nodes[stack[--stack_size]];
+                STAT_INC(box_tests);
+                if (!n.bbox.hit(origin, inv_dir, interval(ray_t.min, closest_so_far)))
+                    continue;
+
+                if (n.count > 0) {
+                    if (hit_leaf(n.offset, n.count, closest_so_far))
+                        hit_anything = true;
+                    continue;
+                }
+
+                // Visit the child on the ray's side of the split first, the far child afterwards
+                int left = static_cast<int>(&n - nodes.data()) + 1;
+                int right = n.offset;
+                if (dir_negative[n.axis]) {
+                    stack[stack_size++] = left;
+                    stack[stack_size++] = right;
+                } else {
+                    stack[stack_size++] = right;
+                    stack[stack_size++] = left;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        /*
+         * Any-hit traversal for occlusion tests: `occludes(index)` tests primitive `index`
+         * against ray_t and the first one hit ends the traversal. Children are visited in the
+         * same order as by `intersect`, but nothing is skipped by distance.
+         */
+        template <typename occlusion_function>
+        bool occluded(const ray &r, interval ray_t, occlusion_function &&occludes) const {
+            return occluded_leaves(r, ray_t, [&](int first, int count) {
+                for (int i = first; i < first + count; i++)
+                    if (occludes(indices[i]))
+                        return true;
+                return false;
+            });
+        }
+
+        // Same traversal as `occluded`, handing whole leaves to `occludes_leaf(first, count)`
+        template <typename leaf_function>
+        bool occluded_leaves(const ray &r, interval ray_t, leaf_function &&occludes_leaf) const {
+            if (nodes.empty())
+                return false;
+
+            const vec3 &dir = r.direction();
+            const vec3 inv_dir(1 / dir[0], 1 / dir[1], 1 / dir[2]);
+            const bool dir_negative[3] = {inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0};
+            const point3 origin = r.origin();
+
+            int stack[128];
+            int stack_size = 0;
+            stack[stack_size++] = 0;
+
+            while (stack_size > 0) {
+                const node &n = nodes[stack[--stack_size]];
+                STAT_INC(box_tests);
+                if (!n.bbox.hit(origin, inv_dir, ray_t))
+                    continue;
+
+                if (n.count > 0) {
+                    if (occludes_leaf(n.offset, n.count))
+                        return true;
+                    continue;
+                }
+
+                int left = static_cast<int>(&n - nodes.data()) + 1;
+                int right = n.offset;
+                if (dir_negative[n.axis]) {
+                    stack[stack_size++] = left;
+                    stack[stack_size++] = right;
+                } else {
+                    stack[stack_size++] = right;
+                    stack[stack_size++] = left;
+                }
+            }
+
+            return false;
+        }
+
+    private:
+        // Temporary pointer-based node used during construction
+        struct build_node {
+            aabb bbox;
+            int first = 0, count = 0;          // Primitive range (leaves only)
+            int axis = 0;
+            int subtree_size = 1;              // Number of nodes in this subtree, including itself
+            std::unique_ptr<build_node> left, right;  // Both null for leaves
+        };
+
+        // Read-only inputs shared by all build tasks, `order` is partitioned in place over disjoint ranges
+        struct build_context {
+            const std::vector<aabb> &boxes;
+            const std::vector<point3> &centroids;
+            std::vector<int> &order;
+            int max_leaf_size;
+        };
+
+        // Accumulated bounds of one SAH bin
+        struct bin {
+            aabb bbox;
+            int count = 0;
+        };
+
+        // Builds the subtree over order[first, first + count)
+        static std::unique_ptr<build_node> build_recursive(build_context &ctx, int first, int count, int depth,
+                                                           int spawn_depth) {
+            std::unique_ptr<build_node> node_ptr(new build_node());
+            build_node &result = *node_ptr;
+            aabb centroid_bounds;
+            for (int i = first; i < first + count; i++) {
+                const auto &c = ctx.centroids[ctx.order[i]];
+                result.bbox = aabb(result.bbox, ctx.boxes[ctx.order[i]]);
+                centroid_bounds = aabb(centroid_bounds, aabb(c, c));
+            }
+
+            result.first = first;
+            result.count = count;
+            if (count <= 1)
+                return node_ptr;
+
+            int axis = centroid_bounds.longest_axis();
+            int mid = first + count / 2;
+
+            if (centroid_bounds.axis(axis).size() <= 0) {
+                // All centroids coincide, binning cannot separate them
+                if (count <= ctx.max_leaf_size)
+                    return node_ptr;
+            } else if (depth >= max_sah_depth) {
+                // Deep enough already: median splits keep the remaining depth logarithmic
+                std::nth_element(ctx.order.begin() + first, ctx.order.begin() + mid, ctx.order.begin() + first + count,
+                    [&](int a, int b) { return ctx.centroids[a][axis] < ctx.centroids[b][axis]; });
+            } else {
+                double best_cost;
+                int best_split;
+                find_sah_split(ctx, first, count, result.bbox, centroid_bounds, axis, best_cost, best_split);
+
+                // Stop when splitting is not expected to be cheaper than testing every primitive
+                double leaf_cost = count;
+                if (count <= ctx.max_leaf_size && best_cost >= leaf_cost)
+                    return node_ptr;
+
+                const interval &range = centroid_bounds.axis(axis);
+                double scale = bin_count / range.size();
+                auto split = std::partition(ctx.order.begin() + first, ctx.order.begin() + first + count,
+                    [&](int index) { return bin_index(ctx.centroids[index][axis], range, scale) < best_split; });
+                mid = static_cast<int>(split - ctx.order.begin());
+
+                if (mid == first || mid == first + count)
+                    mid = first + count / 2;
+            }
+
+            result.axis = axis;
+
+            const int parallel_threshold = 4096;
+            if (spawn_depth > 0 && count > parallel_threshold) {
+                auto left = std::async(std::launch::async, [&ctx, first, mid, depth, spawn_depth] {
+                    return build_recursive(ctx, first, mid - first, depth + 1, spawn_depth - 1);
+                });
+                result.right = build_recursive(ctx, mid, first + count - mid, depth + 1, spawn_depth - 1);
+                result.left = left.get();
+            } else {
+                result.left = build_recursive(ctx, first, mid - first, depth + 1, 0);
+                result.right = build_recursive(ctx, mid, first + count - mid, depth + 1, 0);
+            }
+
+            result.subtree_size = 1 + result.left->subtree_size + result.right->subtree_size;
+            return node_ptr;
+        }
+
+        // Maps a centroid coordinate to its bin along an axis, `scale` is bin_count / range.size()
+        static int bin_index(double value, const interval &range, double scale) {
+            int b = static_cast<int>((value - range.min) * scale);
+            return std::min(std::max(b, 0), bin_count - 1);
+        }
+
+        // Evaluates every bin boundary along every axis, returns the cheapest (axis, boundary) pair
+        static void find_sah_split(const build_context &ctx, int first, int count, const aabb &bbox,
+                                   const aabb &centroid_bounds, int &best_axis, double &best_cost, int &best_split) {
+            best_cost = infinity;
+            best_split = bin_count / 2;
+
+            double scale[3];
+            for (int axis = 0; axis < 3; axis++) {
+                auto size = centroid_bounds.axis(axis).size();
+                scale[axis] = size > 0 ? bin_count / size : 0;
+            }
+
+            // Fill the bins of all three axes in a single pass over the primitives
+            bin bins[3][bin_count];
+            for (int i = first; i < first + count; i++) {
+                int index = ctx.order[i];
+                const aabb &box = ctx.boxes[index];
+                const point3 &c = ctx.centroids[index];
+                for (int axis = 0; axis < 3; axis++) {
+                    if (scale[axis] == 0)
+                        continue;
+                    auto &b = bins[axis][bin_index(c[axis], centroid_bounds.axis(axis), scale[axis])];
+                    b.bbox = aabb(b.bbox, box);
+                    b.count++;
+                }
+            }
+
+            for (int axis = 0; axis < 3; axis++) {
+                if (centroid_bounds.axis(axis).size() <= 0)
+                    continue;
+
+                // Sweep from the right to collect the cost of every right-hand side
+                double right_cost[bin_count];
+                aabb right_box;
+                int right_count = 0;
+                for (int i = bin_count - 1; i > 0; i--) {
+                    right_box = aabb(right_box, bins[axis][i].bbox);
+                    right_count += bins[axis][i].count;
+                    right_cost[i] = right_count * right_box.surface_area();
+                }
+
+                // Sweep from the left and combine
+                aabb left_box;
+                int left_count = 0;
+                for (int i = 1; i < bin_count; i++) {
+                    left_box = aabb(left_box, bins[axis][i - 1].bbox);
+                    left_count += bins[axis][i - 1].count;
+                    double cost = left_count * left_box.surface_area() + right_cost[i];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = i;
+                    }
+                }
+            }
+
+            // Express the cost relative to the parent box, in units of primitive tests
+            double parent_area = bbox.surface_area();
+            best_cost = parent_area > 0 ? 1 + best_cost / parent_area : infinity;
+        }
+
+        // Appends the subtree to the flat node array in depth-first order
+        void flatten(const build_node &n) {
+            int index = static_cast<int>(nodes.size());
+            nodes.push_back(node{n.bbox, n.first, n.count, n.axis});
+            if (!n.left)
+                return;
+
+            nodes[index].count = 0;
+            flatten(*n.left);
+            nodes[index].offset = static_cast<int>(nodes.size());
+            flatten(*n.right);
+        }
+};
+
+// Hittable wrapping a BVH over the objects of a hittable list
+class bvh_node : public hittable {
+    public:
+        // Builds the hierarchy over a snapshot of the list's objects
+        bvh_node(const hittable_list &list) : objects(list.objects) {
+            std::vector<aabb> boxes(objects.size());
+            for (size_t i = 0; i < objects.size(); i++)
+                boxes[i] = objects[i]->bounding_box();
+            tree.build(boxes);
+        }
+
+        // Finds the closest hit by traversing the hierarchy front to back
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
+            return tree.intersect(r, ray_t, [&](int index, real &closest_so_far) {
+                if (!objects[index]->hit(r, interval(ray_t.min, closest_so_far), rec))
+                    return false;
+                closest_so_far = rec.t;
+                return true;
+            });
+        }
+
+        // Stops at the first object found in the way
+        bool occluded(const ray &r, interval ray_t) const override {
+            return tree.occluded(r, ray_t, [&](int index) { return objects[index]->occluded(r, ray_t); });
+        }
+
+        // Returns the box enclosing the whole hierarchy
+        aabb bounding_box() const override { return tree.bounding_box(); }
+
+    private:
+        std::vector<shared_ptr<hittable>> objects;
+        bvh_tree tree;
+};
+
+#endif
\ No newline at end of file
@@ -2,16 +2,140 @@
 #define CAMERA_H
 
 #include "utils.h"
+#include "accumulation_buffer.h"
 #include "color.h"
+#include "denoiser.h"
+#include "flat_scene.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_writer.h"
+#include "light.h"
 #include "material.h"
+#include "sampler.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Algorithm used to compute the color of each camera sample
+enum class integrator_type {
+    recursive,  // Traces one path at a time by recursion (ray_color)
+    wavefront,  // Traces batches of paths bounce by bounce, shading hits grouped by material
+    path        // Traces one path at a time in a loop, ending weak paths early with Russian roulette,
+                // and aims a ray at a light from every diffuse surface (see camera::sample_lights)
+};
+
+// Scene access of the integrators for any hittable: virtual hit and scatter calls
+struct hittable_scene {
+    const hittable &world;
+    const light_list &emitters;
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const { return world.hit(r, ray_t, rec); }
+    bool occluded(const ray &r, interval ray_t) const { return world.occluded(r, ray_t); }
+    material_type type(const hit_record &rec) const { return rec.mat->type(); }
+    bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &gen) const {
+        return rec.mat->scatter(r_in, rec, attenuation, scattered, gen);
+    }
+    color emitted(const hit_record &rec) const { return rec.mat->emitted(rec); }
+    color lambertian_albedo(const hit_record &rec) const { return static_cast<const lambertian *>(rec.mat)->get_albedo(); }
+    const light_list &lights() const { return emitters; }
+};
+
+// Set once a termination signal arrives (see camera::stop_on_signals), checked by render() between tiles
+inline std::atomic<bool> &render_stop_requested() {
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+// Wall time spent in one phase of a run
+struct phase_time {
+    std::string name;
+    double seconds;
+};
+
+// Counters gathered during the last render
+struct render_stats {
+    long long samples = 0;          // Camera samples traced by this run (resumed samples excluded)
+    long long rays = 0;             // Rays intersected with the scene, camera rays included
+    std::vector<phase_time> phases; // Wall time per phase, in the order the phases first ran
+    std::vector<int> pass_sizes;    // Samples per pixel of each pass, in order (see camera::next_pass_size)
+    ray_counters counters;          // Hot-path events, all zero unless built with RAYTRACER_STATS
+
+    // Average number of rays traced per camera sample
+    double average_path_length() const {
+        return samples > 0 ? static_cast<double>(rays) / samples : 0;
+    }
+
+    // Adds time to a phase, creating it on first use
+    void add_phase(const std::string &name, double seconds) {
+        for (auto &phase : phases) {
+            if (phase.name == name) {
+                phase.seconds += seconds;
+                return;
+            }
+        }
+        phases.push_back(phase_time{name, seconds});
+    }
+
+    // Writes the statistics as a JSON document
+    void write_json(std::ostream &out) const {
+        out << "{\n  \"samples\": " << samples << ",\n  \"rays\": " << rays
+            << ",\n  \"average_path_length\": " << average_path_length() << ",\n  \"phases\": {";
+        for (size_t i = 0; i < phases.size(); i++)
+            out << (i > 0 ? ", " : "") << '"' << phases[i].name << "\": " << phases[i].seconds;
+        out << "},\n  \"pass_sizes\": [";
+        for (size_t i = 0; i < pass_sizes.size(); i++)
+            out << (i > 0 ? ", " : "") << pass_sizes[i];
+        out << "],\n  \"counters_enabled\": " << (stats_enabled ? "true" : "false") << ",\n  \"counters\": ";
+        counters.write_json(out);
+        out << "\n}\n";
+    }
+};
+
+// Pixels [x0, x1) x [y0, y1) of an image
+struct pixel_rect {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    pixel_rect() {} // Default constructor (empty rectangle)
+
+    pixel_rect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) {}
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    bool empty() const { return x1 <= x0 || y1 <= y0; }
+};
 
 class camera {
     public:
         double aspect_ratio = 1.0;            // Ratio of image width over height
         int image_width = 100;                // Rendered image width in pixel count
-        int samples_per_pixel = 10;           // Count of random samples for each pixel
+        int samples_per_pixel = 10;           // Count of random samples for each pixel (the maximum in adaptive mode)
+        int num_threads = 0;                  // Worker threads used for rendering (0 = all hardware threads)
+        int tile_size = 16;                   // Edge length in pixels of the square tiles handed to each thread
         int max_depth = 10;                   // Max number of ray bounces into scene
+        uint64_t seed = 0;                    // Key of the random streams, renders with equal seeds are identical
+        integrator_type integrator = integrator_type::recursive; // Algorithm used to trace the samples
+        int wavefront_batch_size = 65536;     // Max paths in flight per tile with the wavefront integrator
+        int rr_min_depth = 3;                 // Bounces before Russian roulette may end a path (path integrator)
+        sampler_type sampling = sampler_type::independent; // Sequence of the pixel, lens and scatter dimensions (see sampler.h)
+        int pattern_samples = 0;              // Samples per pixel a stratified pattern is laid out for (0 = samples_per_pixel)
+        bool sample_lights = true;            // Path integrator: also aim a ray at a light from diffuse surfaces, weighed by MIS
+        light_list lights;                    // Lights of a hittable scene to aim at (a flat_scene finds its own)
+        double sky_brightness = 1;            // Scale of the sky's light, 0 for a scene lit by its lights alone
 
         double vfov = 90;                     // Vertical view angel (field of view)
         point3 lookfrom = point3(0, 0, -1);   // Point camera is looking from
@@ -21,32 +145,369 @@ class camera {
         double defocus_angle = 0;             // Variation angle of rays through each pixel
         double focus_dist = 10;               // Distance from camera lookfrom point to plane of perfect focus
 
-        // Renders scene as seen by the camera
-        void render(const hittable &world) {
+        image_format output_format = image_format::ppm; // Format of the image written to `output`
+        std::ostream *output = &std::cout;    // Stream receiving the finished image (nullptr = only kept in `frame`)
+        bool show_progress = true;            // Report progress and a summary on std::clog
+
+        int samples_per_pass = 16;            // Samples added to every pixel per pass over the image
+        std::string checkpoint_path;          // Snapshot file of the accumulation buffer ("" = no snapshots)
+        double checkpoint_interval = 0;       // Seconds between scheduled snapshots (0 = only when stopped by a signal)
+        bool resume = false;                  // Continue from the snapshot at checkpoint_path when it matches
+        uint64_t scene_hash = 0;              // Identifies the scene in snapshots (see hittable_list::fingerprint)
+
+        bool progressive = false;             // Passes of 1, 1, 2, 4... samples, doubling the image's samples each time
+        double time_limit = 0;                // Seconds after which render() stops sampling and writes its image (0 = none)
+        double noise_target = 0;              // Stop once the mean error of the pixels, as adaptive_threshold, is below it (0 = none)
+        std::string preview_path;             // File or named pipe receiving the image after every pass ("" = none)
+
+        bool adaptive = false;                // Stop sampling a pixel once its estimated error is below adaptive_threshold
+        int adaptive_min_samples = 16;        // Samples every pixel takes before its error estimate is trusted
+        double adaptive_threshold = 0.01;     // Target standard error of a pixel after gamma correction (1/255 ~ 0.004)
+        std::string sample_map_path;          // File for the per-pixel sample counts as a gray image ("" = none)
+        std::string cost_map_path;            // File for a heatmap of the render time spent per pixel ("" = none)
+
+        bool denoise = false;                 // Filter the image with `denoiser`, guided by albedo and normal buffers
+        int aov_samples = 4;                  // Rays per pixel for those buffers when they are not gathered while rendering
+        denoiser filter;                      // Settings of the denoiser
+
+        const std::atomic<bool> *cancel = nullptr; // Stops render() between tiles once set, like a signal but without a snapshot
+        pixel_rect render_window;             // Part of the image to render, all buffers cover only it (empty = whole image)
+        int first_sample = 0;                 // Index of the first sample of every pixel, later samples are taken up to samples_per_pixel
+
+        accumulation_buffer accum;            // Per-pixel radiance sums and sample counts
+        framebuffer frame;                    // Linear HDR image produced by render()
+        framebuffer albedo_aov;               // Albedo of the surface seen through each pixel, when denoising
+        framebuffer normal_aov;               // Its normal, facing the camera
+        render_stats stats;                   // Filled in by render()
+
+        // Makes SIGTERM and SIGINT stop a running render() after saving a snapshot instead of killing the process
+        static void stop_on_signals() {
+            std::signal(SIGTERM, handle_stop_signal);
+            std::signal(SIGINT, handle_stop_signal);
+        }
+
+        /*
+         * Makes writes to a pipe whose reader went away fail with EPIPE instead of killing the
+         * process. Set once and never put back, so no other thread sees the disposition change.
+         */
+        static void ignore_broken_pipes() {
+            static const bool ignored = std::signal(SIGPIPE, SIG_IGN) != SIG_ERR;
+            (void)ignored;
+        }
+
+        /*
+         * Renders scene as seen by the camera and writes the image to `output`.
+         * The image is built in passes that each add up to `samples_per_pass` samples to every pixel
+         * that has not converged yet, so the accumulation buffer is consistent between passes:
+         * that is when snapshots and previews are taken. Rendering ends once every pixel is done,
+         * or early, with the image so far, at time_limit or noise_target.
+         * Returns false, without writing an image, if the render was stopped by a signal or `cancel`.
+         */
+        bool render(const hittable &world) {
+            return render_scene(hittable_scene{world, lights});
+        }
+
+        // Renders a flattened scene, the same way but without virtual calls per bounce
+        bool render(const flat_scene &world) {
+            return render_scene(world);
+        }
+
+        /*
+         * Fills albedo_aov and normal_aov for the render window by tracing aov_samples samples per
+         * pixel. render() gathers them from every sample it takes instead, and only falls back to
+         * this when samples were resumed from a snapshot; it is public for images whose samples
+         * are accumulated elsewhere.
+         */
+        void render_aovs(const hittable &world) {
+            thread_pool pool(num_threads);
             initialize();
+            trace_aovs(hittable_scene{world, lights}, pool);
+        }
 
-            std::cout << "P3\n"
-                    << image_width << ' ' << image_height << "\n255\n";
+        void render_aovs(const flat_scene &world) {
+            thread_pool pool(num_threads);
+            initialize();
+            trace_aovs(world, pool);
+        }
 
-            // Iterate over each pixel in the image from top to bottom
-            for (int j = 0; j < image_height; ++j) {
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; ++i) {
-                    color pixel_color(0, 0, 0);
+        /*
+         * For tiles scheduled outside the camera (see render_server): begin_tiles sets the camera
+         * up and clears the accumulation buffer of the render window, once for all of them, then
+         * render_window_tile renders a tile of it to the end on the calling thread, pass after pass
+         * until its pixels are done, adaptive sampling looking at the tile alone. Threads can render
+         * tiles that do not overlap at the same time. Time limits, noise targets, previews,
+         * snapshots, cost maps and the denoiser's surfaces are left to render().
+         */
+        void begin_tiles() {
+            initialize();
+            accum = accumulation_buffer(window_width, window_height);
+            converged.assign(static_cast<size_t>(window_width) * window_height, 0);
+            pixel_seconds.clear();
+            surface_sums.clear();
+        }
 
-                    // Sample each pixel multiple times for anti-aliasing
-                    for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                        ray r = get_ray(i, j); // Generate a ray for the current sample
-                        pixel_color += ray_color(r, max_depth, world); // Accumulate color
-                    }
-                    write_color(std::cout, pixel_color, samples_per_pixel); // Output color
-                }
+        /*
+         * Renders `tile`, in window coordinates, into the accumulation buffer. Adds the samples
+         * taken and rays traced to `samples` and `rays`. Returns false, the tile partly rendered,
+         * if stopped by a signal or `cancel`.
+         */
+        bool render_window_tile(const hittable &world, const pixel_rect &tile, long long &samples, long long &rays) {
+            return render_tile_to_end(hittable_scene{world, lights}, tile, samples, rays);
+        }
+
+        bool render_window_tile(const flat_scene &world, const pixel_rect &tile, long long &samples, long long &rays) {
+            return render_tile_to_end(world, tile, samples, rays);
+        }
+
+        // Height of the whole image in pixels, from image_width and aspect_ratio
+        int get_image_height() const {
+            return std::max(static_cast<int>(image_width / aspect_ratio), 1);
+        }
+
+        /*
+         * Hash of every setting that changes the value of a sample (but not the sample count, nor the
+         * part of the image rendered): buffers with equal hashes hold samples of the same image.
+         * A stratified pattern is laid out for its size, so that size counts as well.
+         */
+        uint64_t camera_hash() const {
+            int height = get_image_height();
+            uint64_t h = hash_bytes(fnv_offset_basis, &image_width, sizeof(image_width));
+            h = hash_bytes(h, &height, sizeof(height));
+            h = hash_bytes(h, &max_depth, sizeof(max_depth));
+            h = hash_bytes(h, &seed, sizeof(seed));
+            h = hash_bytes(h, &integrator, sizeof(integrator));
+            h = hash_bytes(h, &rr_min_depth, sizeof(rr_min_depth));
+            h = hash_bytes(h, &sampling, sizeof(sampling));
+            if (sampling == sampler_type::stratified) {
+                int pattern = pattern_size();
+                h = hash_bytes(h, &pattern, sizeof(pattern));
             }
+            h = hash_bytes(h, &sample_lights, sizeof(sample_lights));
+            h = hash_bytes(h, &sky_brightness, sizeof(sky_brightness));
+            h = hash_bytes(h, &vfov, sizeof(vfov));
+            h = hash_bytes(h, lookfrom.e, sizeof(lookfrom.e));
+            h = hash_bytes(h, lookat.e, sizeof(lookat.e));
+            h = hash_bytes(h, vup.e, sizeof(vup.e));
+            h = hash_bytes(h, &defocus_angle, sizeof(defocus_angle));
+            return hash_bytes(h, &focus_dist, sizeof(focus_dist));
+        }
+
+        /*
+         * Mean estimated error of the pixels of the accumulation buffer, what noise_target is
+         * compared with between passes; valid once a render has set the camera up.
+         */
+        double image_error() const {
+            double sum = 0;
+            for (int j = 0; j < window_height; ++j)
+                for (int i = 0; i < window_width; ++i)
+                    sum += pixel_error(i, j);
+            return sum / (static_cast<double>(window_width) * window_height);
+        }
 
-            std::clog << "\rDone.                 \n";
+        /*
+         * Resolves the accumulation buffer into `frame`, denoised if asked for and the albedo and
+         * normal buffers match it, and writes it to `output`, along with the sample and cost maps
+         * that were asked for. render() ends with it; it is public for images whose samples were
+         * accumulated elsewhere (see render_coordinator).
+         */
+        void write_output() {
+            resolve_frame();
+            write_frame();
         }
 
     private:
+        // Samples per pixel of the stratified pattern
+        int pattern_size() const {
+            return pattern_samples > 0 ? pattern_samples : samples_per_pixel;
+        }
+
+        // Resolves the accumulation buffer into `frame` and denoises it when asked to
+        void resolve_frame() {
+            accum.resolve(frame);
+            if (!denoise || albedo_aov.width() != frame.width() || albedo_aov.height() != frame.height())
+                return;
+
+            std::vector<float> variance(static_cast<size_t>(frame.width()) * frame.height());
+            for (int j = 0; j < frame.height(); ++j)
+                for (int i = 0; i < frame.width(); ++i)
+                    variance[static_cast<size_t>(j) * frame.width() + i] = static_cast<float>(
+                        std::min(accum.standard_error(i, j) * accum.standard_error(i, j), 1e30));
+            thread_pool pool(num_threads);
+            filter.filter(frame, variance, albedo_aov, normal_aov, pool);
+        }
+
+        // Writes `frame` to `output`, and the sample and cost maps
+        void write_frame() {
+            if (output)
+                write_image(*output, frame, output_format);
+            if (!sample_map_path.empty()) {
+                framebuffer map;
+                accum.sample_map(map, samples_per_pixel);
+                std::ofstream out(sample_map_path, std::ios::binary);
+                write_image(out, map, output_format);
+            }
+            if (!cost_map_path.empty() && pixel_seconds.size() == static_cast<size_t>(accum.width()) * accum.height())
+                write_cost_map();
+        }
+
+        // Body of both render overloads; `world` is a hittable_scene or a flat_scene
+        template <typename scene_type>
+        bool render_scene(const scene_type &world) {
+            // Time is charged to the current phase whenever a new one starts
+            stats = render_stats();
+            auto phase_start = std::chrono::steady_clock::now();
+            auto end_phase = [&](const char *name) {
+                auto now = std::chrono::steady_clock::now();
+                stats.add_phase(name, std::chrono::duration<double>(now - phase_start).count());
+                phase_start = now;
+            };
+
+            initialize();
+            deadline = phase_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(time_limit));
+            converged.assign(static_cast<size_t>(window_width) * window_height, 0);
+            pixel_seconds.assign(cost_map_path.empty() ? 0 : static_cast<size_t>(window_width) * window_height, 0.0f);
+            surface_sums.assign(denoise ? static_cast<size_t>(window_width) * window_height : 0, surface_sum());
+
+            // Start from scratch, or from the snapshot of an earlier run of the same scene and camera
+            accum = accumulation_buffer(window_width, window_height);
+            if (resume && !checkpoint_path.empty()) {
+                if (accum.load(checkpoint_path, scene_hash, camera_hash()))
+                    std::clog << "Resumed from " << checkpoint_path << " with " << accum.total_samples() << " samples\n";
+                else
+                    std::clog << "No matching snapshot in " << checkpoint_path << ", starting from scratch\n";
+            }
+
+            // Split the window into tiles, scanline order within each tile row
+            int tiles_x = (window_width + tile_size - 1) / tile_size;
+            int tiles_y = (window_height + tile_size - 1) / tile_size;
+            int tile_count = tiles_x * tiles_y;
+
+            std::atomic<long long> rays_traced(0);
+            std::atomic<long long> samples_traced(0);
+            std::mutex progress_mutex;
+            auto last_checkpoint = std::chrono::steady_clock::now();
+            bool stopped = false;
+            double trace_seconds = 0;
+
+            thread_pool pool(num_threads);
+            thread_counts.assign(pool.size(), ray_counters());
+            if (show_progress)
+                std::clog << "Rendering " << tile_count << " tiles on " << pool.size() << " threads\n";
+            end_phase("setup");
+
+            for (int pass = 1; !stopped; ++pass) {
+                long long active_pixels = update_converged(0, 0, window_width, window_height);
+                if (active_pixels == 0)
+                    break;
+                double error = noise_target > 0 ? image_error() : infinity;
+                if (error <= noise_target || out_of_time()) {
+                    if (show_progress)
+                        std::clog << "\r" << (out_of_time() ? "Time limit" : "Noise target") << " reached after "
+                                  << (pass - 1) << " passes                              \n";
+                    break;
+                }
+                int pass_size = next_pass_size(active_pixels, error,
+                                               samples_traced > 0 ? trace_seconds / samples_traced : 0);
+                stats.pass_sizes.push_back(pass_size);
+
+                std::atomic<int> tiles_done(0);
+
+                // Every pixel is written by exactly one tile, so tiles can update the buffer concurrently
+                pool.parallel_for(tile_count, [&](int tile, int thread) {
+                    if (stop_requested() || out_of_time())
+                        return;
+                    counter_scope counting(thread_counts[thread]);
+
+                    int x0 = (tile % tiles_x) * tile_size;
+                    int y0 = (tile / tiles_x) * tile_size;
+                    long long samples = 0;
+                    rays_traced += render_tile(world, x0, y0, std::min(x0 + tile_size, window_width),
+                                               std::min(y0 + tile_size, window_height), pass_size, samples);
+                    samples_traced += samples;
+
+                    int done = ++tiles_done;
+                    if (!show_progress)
+                        return;
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    std::clog << "\rPass " << pass << " (" << active_pixels << " pixels), tiles remaining: "
+                              << (tile_count - done) << "   " << std::flush;
+                });
+
+                stopped = stop_requested();
+                trace_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - phase_start).count();
+                end_phase("trace");
+                if (!stopped && !preview_path.empty()) {
+                    write_preview();
+                    end_phase("preview");
+                }
+                auto now = std::chrono::steady_clock::now();
+                bool checkpoint_due = checkpoint_interval > 0
+                    && std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval;
+                if ((stopped && !cancelled()) || checkpoint_due) {
+                    save_checkpoint();
+                    last_checkpoint = now;
+                    end_phase("checkpoint");
+                }
+            }
+
+            stats.samples = samples_traced;
+            stats.rays = rays_traced;
+            stats.counters = ray_counters();
+            for (const auto &counts : thread_counts)
+                stats.counters.add(counts);
+
+            if (stopped) {
+                if (!cancelled() && !checkpoint_path.empty())
+                    std::clog << "\rStopped, " << accum.total_samples() << " samples kept in the snapshot.\n";
+                else if (!cancelled())
+                    std::clog << "\rStopped.                                                  \n";
+                return false;
+            }
+
+            // Denoise and output the finished image in scanline order
+            if (denoise && !resolve_aovs()) {
+                stats.rays += trace_aovs(world, pool);
+                end_phase("aov");
+            }
+            resolve_frame();
+            if (denoise)
+                end_phase("denoise");
+            write_frame();
+            end_phase("output");
+
+            if (show_progress) {
+                std::clog << "\rDone.                                                  \n";
+                std::clog << "Average samples per pixel: "
+                          << static_cast<double>(accum.total_samples()) / (window_width * window_height) << '\n';
+                std::clog << "Average path length: " << stats.average_path_length() << " rays per sample\n";
+            }
+            return true;
+        }
+
+        // Body of both render_window_tile overloads
+        template <typename scene_type>
+        bool render_tile_to_end(const scene_type &world, const pixel_rect &tile, long long &samples, long long &rays) {
+            int x0 = std::max(tile.x0, 0), y0 = std::max(tile.y0, 0);
+            int x1 = std::min(tile.x1, window_width), y1 = std::min(tile.y1, window_height);
+            if (x0 >= x1 || y0 >= y1)
+                return true;
+            int pass_size = std::max(samples_per_pass, 1);
+
+            // Passes over the tile, inner tile by inner tile, so a cancel is seen as soon as in render()
+            while (update_converged(x0, y0, x1, y1) > 0) {
+                for (int y = y0; y < y1; y += tile_size) {
+                    for (int x = x0; x < x1; x += tile_size) {
+                        if (stop_requested())
+                            return false;
+                        rays += render_tile(world, x, y, std::min(x + tile_size, x1), std::min(y + tile_size, y1),
+                                            pass_size, samples);
+                    }
+                }
+            }
+            return true;
+        }
+
         int image_height;        // Rendered image height
         point3 center;           // Camera center
         point3 pixel00_loc;      // Location of pixel 0, 0
@@ -55,11 +516,307 @@ class camera {
         vec3 u, v, w;            // Camera frame basis vectors
         vec3 defocus_disk_u;     // Defocus disk horizontal radius
         vec3 defocus_disk_v;     // Defocus disk vertical radius
+        sampler sequence;        // Source of the first dimensions of every bounce, per `sampling`
+        int window_x, window_y;  // Image position of the window's top left pixel
+        int window_width;        // Size of the window, and of the buffers indexed by pixel
+        int window_height;
+        std::vector<char> converged; // Per pixel: no samples in the current pass
+        std::chrono::steady_clock::time_point deadline; // End of the time limit
+        std::vector<float> pixel_seconds; // Per pixel: render time, when a cost map was requested
+        std::vector<ray_counters> thread_counts; // Per pool thread: event counts of this render (see stats.h)
+
+        // Albedo and normal of the surface a sample sees, collected along its path (see `scatter`)
+        struct first_surface {
+            color tint = color(1, 1, 1);    // Product of the attenuations of the mirrors and glass passed so far
+            color albedo = color(0, 0, 0);
+            vec3 normal = vec3(0, 0, 0);
+            bool found = false;
+
+            /*
+             * Records a scatter of the path until a surface other than a mirror or glass is hit:
+             * the denoiser filters the lighting of the surface seen behind those, so they are
+             * looked through and only tint the albedo.
+             */
+            void scatter(material_type type, bool scatters, const color &attenuation, const vec3 &hit_normal) {
+                if (found)
+                    return;
+                if (scatters && (type == material_type::metal || type == material_type::dielectric)) {
+                    tint = tint * attenuation;
+                    return;
+                }
+                albedo = scatters ? tint * attenuation : color(0, 0, 0);
+                normal = hit_normal;
+                found = true;
+            }
+
+            // Records the path reaching a light, whose emission stands for the albedo
+            void emit(const color &emission, const vec3 &hit_normal) {
+                if (!found && luminance(emission) > 0) {
+                    albedo = tint * emission;
+                    normal = hit_normal;
+                    found = true;
+                }
+            }
+
+            // Records the path escaping to the sky, whose color stands for the albedo
+            void escape(const color &sky) {
+                if (!found) {
+                    albedo = tint * sky;
+                    found = true;
+                }
+            }
+        };
+
+        // Per pixel sums of the first surfaces of the samples taken, when denoising
+        struct surface_sum {
+            color albedo = color(0, 0, 0);
+            vec3 normal = vec3(0, 0, 0);
+            int samples = 0;
+
+            void add(const first_surface &surface) {
+                albedo += surface.albedo;
+                normal += surface.normal;
+                samples++;
+            }
+        };
+        std::vector<surface_sum> surface_sums;
+
+        static void handle_stop_signal(int) {
+            render_stop_requested() = true;
+        }
+
+        bool cancelled() const { return cancel && *cancel; }
+        bool stop_requested() const { return render_stop_requested() || cancelled(); }
+
+        /*
+         * Decides which pixels of [x0,x1) x [y0,y1) take no more samples and returns the number of the others.
+         * A pixel is done after samples_per_pixel samples, or in adaptive mode once the estimated
+         * error of it and its 8 neighbors is below adaptive_threshold. Looking at the neighbors keeps
+         * sampling pixels whose first samples happened to agree (e.g. all black in a soft shadow).
+         * Only neighbors inside the region count, so a window, or a tile of it, can be rendered on its own.
+         * Pixels are addressed by their window position, here and in the functions below.
+         */
+        long long update_converged(int x0, int y0, int x1, int y1) {
+            int width = x1 - x0;
+            std::vector<double> error(static_cast<size_t>(width) * (y1 - y0));
+            for (int j = y0; j < y1; ++j)
+                for (int i = x0; i < x1; ++i)
+                    error[static_cast<size_t>(j - y0) * width + (i - x0)] = pixel_error(i, j);
+
+            long long active_pixels = 0;
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    bool done = first_sample + accum.samples(i, j) >= samples_per_pixel;
+                    if (!done && adaptive) {
+                        double neighborhood_error = 0;
+                        for (int y = std::max(j - 1, y0); y <= std::min(j + 1, y1 - 1); ++y)
+                            for (int x = std::max(i - 1, x0); x <= std::min(i + 1, x1 - 1); ++x)
+                                neighborhood_error = std::max(neighborhood_error, error[static_cast<size_t>(y - y0) * width + (x - x0)]);
+                        done = neighborhood_error <= adaptive_threshold;
+                    }
+                    converged[static_cast<size_t>(j) * window_width + i] = done;
+                    active_pixels += !done;
+                }
+            }
+            return active_pixels;
+        }
+
+        /*
+         * Standard error of the mean of a pixel after gamma correction, where a luminance error dL
+         * becomes dL / (2 sqrt(L)), so dark pixels need less absolute noise. Infinite until the
+         * pixel has adaptive_min_samples samples.
+         */
+        double pixel_error(int i, int j) const {
+            if (accum.samples(i, j) < adaptive_min_samples)
+                return infinity;
+            return accum.standard_error(i, j) / (2 * sqrt(std::max(accum.mean_luminance(i, j), 1e-4)));
+        }
+
+        bool out_of_time() const { return time_limit > 0 && std::chrono::steady_clock::now() >= deadline; }
+
+        /*
+         * Samples per pixel of the next pass: samples_per_pass, or in progressive mode as many as
+         * the pixels have on average, so the first image comes after a single sample and the
+         * count doubles with every pass. A pass is then cut to what the noise target still needs,
+         * the error falling with the square root of the sample count, and to what the time left
+         * allows at the speed of the passes so far (`seconds_per_sample`, 0 before the first).
+         */
+        int next_pass_size(long long active_pixels, double error, double seconds_per_sample) const {
+            double average = static_cast<double>(accum.total_samples()) / (static_cast<double>(window_width) * window_height);
+            double size = progressive ? std::max(average, 1.0) : samples_per_pass;
+            if (noise_target > 0 && error < infinity)
+                size = std::min(size, std::ceil(average * (error * error / (noise_target * noise_target) - 1)));
+            if (time_limit > 0 && seconds_per_sample > 0) {
+                double left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count();
+                size = std::min(size, std::floor(left / (seconds_per_sample * active_pixels)));
+            }
+            return static_cast<int>(std::max(1.0, std::min(size, 1e9)));
+        }
+
+        /*
+         * Writes the image so far to preview_path. A regular file is replaced through a temporary
+         * file, so a viewer never reads half an image; a named pipe is written in place, and left
+         * out while nobody has it open rather than holding up the render.
+         */
+        void write_preview() const {
+            framebuffer image;
+            accum.resolve(image);
+            struct stat info;
+            if (::stat(preview_path.c_str(), &info) == 0 && S_ISFIFO(info.st_mode)) {
+                int fd = ::open(preview_path.c_str(), O_WRONLY | O_NONBLOCK);
+                if (fd < 0)
+                    return;
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                std::ostringstream out;
+                write_image(out, image, output_format);
+                const std::string bytes = out.str();
+
+                // A reader that goes away must not take the render down with it: EPIPE drops the preview
+                ignore_broken_pipes();
+                for (size_t done = 0; done < bytes.size();) {
+                    ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    done += static_cast<size_t>(n);
+                }
+                ::close(fd);
+                return;
+            }
+
+            std::string temp_path = preview_path + ".tmp";
+            {
+                std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+                write_image(out, image, output_format);
+                if (!out) {
+                    std::clog << "\rCould not write preview " << temp_path << "                \n";
+                    return;
+                }
+            }
+            std::rename(temp_path.c_str(), preview_path.c_str());
+        }
+
+        /*
+         * Fills albedo_aov and normal_aov from the surfaces gathered by this render's samples.
+         * Returns false, leaving them alone, if a pixel took no samples (e.g. all of its samples
+         * were resumed from a snapshot).
+         */
+        bool resolve_aovs() {
+            for (const auto &sum : surface_sums)
+                if (sum.samples == 0)
+                    return false;
+            albedo_aov = framebuffer(window_width, window_height);
+            normal_aov = framebuffer(window_width, window_height);
+            for (int j = 0; j < window_height; ++j) {
+                for (int i = 0; i < window_width; ++i) {
+                    const surface_sum &sum = surface_sums[static_cast<size_t>(j) * window_width + i];
+                    albedo_aov.set(i, j, sum.albedo / static_cast<real>(sum.samples));
+                    normal_aov.set(i, j, sum.normal / static_cast<real>(sum.samples));
+                }
+            }
+            return true;
+        }
+
+        /*
+         * Fills albedo_aov and normal_aov from the first surfaces of the first aov_samples samples
+         * of every pixel, tracing each path only as far as its first surface. Returns the number
+         * of rays traced.
+         */
+        template <typename scene_type>
+        long long trace_aovs(const scene_type &world, thread_pool &pool) {
+            albedo_aov = framebuffer(window_width, window_height);
+            normal_aov = framebuffer(window_width, window_height);
+            int samples = std::max(aov_samples, 1);
+            std::atomic<long long> rays_traced(0);
+            thread_counts.resize(std::max(thread_counts.size(), static_cast<size_t>(pool.size())));
+            pool.parallel_for(window_height, [&](int j, int thread) {
+                counter_scope counting(thread_counts[thread]);
+                long long rays = 0;
+                for (int i = 0; i < window_width; ++i) {
+                    int image_i = window_x + i, image_j = window_y + j;
+                    auto pixel_index = static_cast<uint32_t>(image_j * image_width + image_i);
+                    surface_sum sum;
+                    for (int sample = 0; sample < samples; ++sample) {
+                        rng gen(seed, pixel_index, static_cast<uint32_t>(sample), &sequence);
+                        ray r = get_ray(image_i, image_j, gen);
+                        first_surface surface;
+                        for (int bounce = 1; bounce <= max_depth && !surface.found; ++bounce) {
+                            hit_record rec;
+                            ++rays;
+                            if (!world.hit(r, interval(0.0001, infinity), rec)) {
+                                surface.escape(background(r));
+                                break;
+                            }
+                            if (emits(world, rec))
+                                surface.emit(world.emitted(rec), rec.normal);
+                            ray scattered;
+                            color attenuation;
+                            gen.set_bounce(static_cast<uint32_t>(bounce));
+                            bool scatters = world.scatter(r, rec, attenuation, scattered, gen);
+                            surface.scatter(world.type(rec), scatters, attenuation, rec.normal);
+                            r = scattered;
+                        }
+                        sum.add(surface);
+                    }
+                    albedo_aov.set(i, j, sum.albedo / static_cast<real>(samples));
+                    normal_aov.set(i, j, sum.normal / static_cast<real>(samples));
+                }
+                rays_traced += rays;
+            });
+            return rays_traced;
+        }
+
+        // Samples [first, last) of the pixel at column i, row j are traced in a pass of `pass_size` samples
+        void pass_samples(int i, int j, int pass_size, int &first, int &last) const {
+            first = first_sample + accum.samples(i, j);
+            last = converged[static_cast<size_t>(j) * window_width + i] ? first : std::min(first + pass_size, samples_per_pixel);
+        }
+
+        /*
+         * Writes the per-pixel render times as a heatmap going from black through red and yellow
+         * to white. The scale tops out at the 99th percentile, so a few very slow pixels do not
+         * wash out the rest of the image.
+         */
+        void write_cost_map() const {
+            std::vector<float> sorted(pixel_seconds);
+            auto top = sorted.begin() + static_cast<std::ptrdiff_t>(sorted.size() * 99 / 100);
+            std::nth_element(sorted.begin(), top, sorted.end());
+            auto scale = 1.0 / std::max(static_cast<double>(*top), 1e-12);
+
+            framebuffer map(window_width, window_height);
+            for (int j = 0; j < window_height; ++j) {
+                for (int i = 0; i < window_width; ++i) {
+                    auto t = std::min(1.0, scale * pixel_seconds[static_cast<size_t>(j) * window_width + i]);
+                    map.set(i, j, color(std::min(1.0, 3 * t), std::max(0.0, std::min(1.0, 3 * t - 1)),
+                                        std::max(0.0, 3 * t - 2)));
+                }
+            }
+
+            std::ofstream out(cost_map_path, std::ios::binary);
+            write_image(out, map, output_format);
+        }
+
+        // Writes the accumulation buffer to checkpoint_path, if snapshots are enabled
+        void save_checkpoint() const {
+            if (checkpoint_path.empty())
+                return;
+            if (accum.save(checkpoint_path, scene_hash, camera_hash()))
+                std::clog << "\rSnapshot saved to " << checkpoint_path << "                \n";
+            else
+                std::clog << "\rCould not write snapshot " << checkpoint_path << "                \n";
+        }
 
         // Initializes camera parameters based on current settings
         void initialize() {
-            image_height = static_cast<int>(image_width / aspect_ratio);
-            image_height = (image_height < 1) ? 1 : image_height;
+            image_height = get_image_height();
+
+            // Clip the render window to the image
+            pixel_rect window = render_window.empty() ? pixel_rect(0, 0, image_width, image_height) : render_window;
+            window_x = std::max(window.x0, 0);
+            window_y = std::max(window.y0, 0);
+            window_width = std::max(std::min(window.x1, image_width) - window_x, 0);
+            window_height = std::max(std::min(window.y1, image_height) - window_y, 0);
 
             center = lookfrom;
 
@@ -90,57 +847,480 @@ class camera {
             auto defocus_radius = focus_dist * tan(degrees_to_radians(defocus_angle / 2));
             defocus_disk_u = u * defocus_radius;
             defocus_disk_v = v * defocus_radius;
+
+            sequence = sampler(sampling, seed, pattern_size(), image_width);
+        }
+
+        /*
+         * Adds a pass of `pass_size` samples to the pixels in [x0,x1) x [y0,y1) of the accumulation buffer.
+         * Returns the number of rays traced and stores the number of samples taken in `samples`.
+         */
+        template <typename scene_type>
+        long long render_tile(const scene_type &world, int x0, int y0, int x1, int y1, int pass_size, long long &samples) {
+            if (integrator == integrator_type::wavefront)
+                return render_tile_wavefront(world, x0, y0, x1, y1, pass_size, samples);
+
+            long long rays = 0;
+            bool timed = !pixel_seconds.empty();
+            bool gather_surfaces = !surface_sums.empty();
+
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    auto pixel_start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                    color pixel_color(0, 0, 0);
+                    running_stats pixel_luminance;
+                    int pass_first, pass_last;
+                    pass_samples(i, j, pass_size, pass_first, pass_last);
+
+                    // Sample each pixel multiple times for anti-aliasing
+                    int image_i = window_x + i, image_j = window_y + j;
+                    auto pixel_index = static_cast<uint32_t>(image_j * image_width + image_i);
+                    for (int sample = pass_first; sample < pass_last; ++sample) {
+                        rng gen(seed, pixel_index, static_cast<uint32_t>(sample), &sequence); // Random stream of this sample
+                        ray r = get_ray(image_i, image_j, gen); // Generate a ray for the current sample
+                        first_surface surface;
+                        first_surface *gather = gather_surfaces ? &surface : nullptr;
+                        color sample_color = integrator == integrator_type::path
+                            ? path_color(r, world, gen, rays, gather)
+                            : ray_color(r, max_depth, world, gen, rays, gather);
+                        pixel_color += sample_color; // Accumulate color
+                        pixel_luminance.push(luminance(sample_color));
+                        if (gather)
+                            surface_sums[static_cast<size_t>(j) * window_width + i].add(surface);
+                    }
+                    if (pixel_luminance.count > 0) {
+                        accum.add(i, j, pixel_color, pixel_luminance);
+                        samples += pixel_luminance.count;
+                    }
+                    if (timed) {
+                        pixel_seconds[static_cast<size_t>(j) * window_width + i] += static_cast<float>(
+                            std::chrono::duration<double>(std::chrono::steady_clock::now() - pixel_start).count());
+                    }
+                }
+            }
+
+            return rays;
         }
 
         // Gets a randomly-sampled camera ray for the pixel at location i,j, originating from the camera defocus disk
-        ray get_ray(int i, int j) const {
+        ray get_ray(int i, int j, rng &gen) const {
             auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-            auto pixel_sample = pixel_center + pixel_sample_square();
+            auto pixel_sample = pixel_center + pixel_sample_square(gen);
 
-            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+            auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample(gen);
             auto ray_direction = pixel_sample - ray_origin;
 
             return ray(ray_origin, ray_direction);
         }
 
         // Returns a random point in the square surrounding a pixel at the origin
-        vec3 pixel_sample_square() const {
-            auto px = -0.5 + random_double();
-            auto py = -0.5 + random_double();
+        vec3 pixel_sample_square(rng &gen) const {
+            auto px = -0.5 + random_double(gen);
+            auto py = -0.5 + random_double(gen);
             return (px * pixel_delta_u) + (py * pixel_delta_v);
         }
 
         // Returns a random point in the camera defocus disk
-        point3 defocus_disk_sample() const {
-            auto p = random_in_unit_disk();
+        point3 defocus_disk_sample(rng &gen) const {
+            auto p = random_in_unit_disk(gen);
             return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
         }
 
-        // Calculates the color of ray by recursively tracing it through the scene.
-        color ray_color(const ray &r, int depth, const hittable &world) const {
+        // Calculates the color of ray by recursively tracing it through the scene, recording its first surface in `surface` if given
+        template <typename scene_type>
+        color ray_color(const ray &r, int depth, const scene_type &world, rng &gen, long long &rays,
+                        first_surface *surface = nullptr) const {
             hit_record rec;
 
             // Base case: if we've exceeded the ray bounce limit, no more light is gathered and black is returned
-            if (depth <= 0)
+            if (depth <= 0) {
+                STAT_PATH_END(depth_limit, max_depth);
                 return color(0, 0, 0);
+            }
+
+            ++rays;
+            if (depth == max_depth)
+                STAT_INC(primary_rays);
+            else
+                STAT_INC(secondary_rays);
 
             // Try to hit something in the scene with ray
             if (world.hit(r, interval(0.0001, infinity), rec)) {
                 ray scattered;
                 color attenuation;
 
+                // Each bounce draws from its own dimensions of the sample's random stream
+                gen.set_bounce(static_cast<uint32_t>(max_depth - depth + 1));
+
                 // If the material of the hit object scatters the ray,
                 // recursively calculate the color contributed by the scattered ray
-                if (rec.mat->scatter(r, rec, attenuation, scattered))
-                    return attenuation * ray_color(scattered, depth - 1, world);
+                color emitted(0, 0, 0);
+                if (emits(world, rec)) {
+                    emitted = world.emitted(rec);
+                    if (surface)
+                        surface->emit(emitted, rec.normal);
+                }
+                STAT_INC(scatter_calls[static_cast<int>(world.type(rec))]);
+                bool scatters = world.scatter(r, rec, attenuation, scattered, gen);
+                if (surface) {
+                    surface->scatter(world.type(rec), scatters, attenuation, rec.normal);
+                    if (surface->found)
+                        surface = nullptr;
+                }
+                if (scatters)
+                    return emitted + attenuation * ray_color(scattered, depth - 1, world, gen, rays, surface);
 
-                return color(0, 0, 0);
+                STAT_PATH_END(absorbed, max_depth - depth + 1);
+                return emitted;
             }
 
+            STAT_PATH_END(escaped, max_depth - depth + 1);
+            if (surface)
+                surface->escape(background(r));
+            return background(r);
+        }
+
+        /*
+         * Calculates the color of ray by following its path in a loop.
+         * The path carries its throughput (the product of the attenuations so far). From bounce
+         * `rr_min_depth` on, Russian roulette ends the path with a probability that grows as the
+         * throughput falls; surviving paths are divided by their survival probability, so the
+         * expected color is the same as with ray_color. The first surface is recorded in `surface`
+         * if given.
+         * With `sample_lights`, every diffuse surface also sends a shadow ray toward a point on one
+         * of the scene's lights (next-event estimation). A light is then found by two strategies,
+         * by the shadow ray and by the scattered ray hitting it, and each is weighted by the power
+         * heuristic (Veach 1997), so small lights converge fast and large ones are not noisier
+         * than without. Mirrors and glass cannot aim at a light, their paths only find them by
+         * scattering.
+         */
+        template <typename scene_type>
+        color path_color(ray r, const scene_type &world, rng &gen, long long &rays, first_surface *surface = nullptr) const {
+            color throughput(1, 1, 1);
+            color radiance(0, 0, 0);
+            const light_list &lights = world.lights();
+            bool next_event = sample_lights && !lights.empty();
+            double scatter_pdf = 0; // Density of the last scatter if a shadow ray was sent from it too, else 0
+
+            for (int bounce = 1; bounce <= max_depth; ++bounce) {
+                hit_record rec;
+                ++rays;
+                if (bounce == 1)
+                    STAT_INC(primary_rays);
+                else
+                    STAT_INC(secondary_rays);
+                if (!world.hit(r, interval(0.0001, infinity), rec)) {
+                    STAT_PATH_END(escaped, bounce);
+                    if (surface)
+                        surface->escape(background(r));
+                    return radiance + throughput * background(r);
+                }
+
+                if (emits(world, rec)) {
+                    color emitted = world.emitted(rec);
+                    if (surface)
+                        surface->emit(emitted, rec.normal);
+                    double light_pdf = scatter_pdf > 0 ? lights.pdf(r.origin(), rec.p) : 0;
+                    radiance += throughput * emitted * static_cast<real>(power_heuristic(scatter_pdf, light_pdf));
+                }
+
+                ray scattered;
+                color attenuation;
+                gen.set_bounce(static_cast<uint32_t>(bounce));
+                material_type type = world.type(rec);
+                STAT_INC(scatter_calls[static_cast<int>(type)]);
+                bool scatters = world.scatter(r, rec, attenuation, scattered, gen);
+                if (surface) {
+                    surface->scatter(type, scatters, attenuation, rec.normal);
+                    if (surface->found)
+                        surface = nullptr;
+                }
+                if (!scatters) {
+                    STAT_PATH_END(absorbed, bounce);
+                    return radiance;
+                }
+
+                scatter_pdf = 0;
+                if (next_event && type == material_type::lambertian) {
+                    radiance += throughput * sample_light(world, rec, gen, rays);
+                    scatter_pdf = fmax(dot(unit_vector(scattered.direction()), rec.normal), 0.0) / pi;
+                }
+
+                throughput = throughput * attenuation;
+                r = scattered;
+
+                if (bounce >= rr_min_depth) {
+                    auto survival = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+                    if (random_double(gen) >= survival) {
+                        STAT_PATH_END(roulette_kills, bounce);
+                        return radiance;
+                    }
+                    throughput /= survival;
+                }
+            }
+
+            STAT_PATH_END(depth_limit, max_depth);
+            return radiance;
+        }
+
+        /*
+         * Light reaching a lambertian surface directly from a point picked on one of the lights,
+         * weighted against finding the same point by scattering. Costs one shadow ray when the
+         * light is above the surface.
+         */
+        template <typename scene_type>
+        color sample_light(const scene_type &world, const hit_record &rec, rng &gen, long long &rays) const {
+            light_sample ls;
+            if (!world.lights().sample(rec.p, gen, ls))
+                return color(0, 0, 0);
+            double cosine = dot(ls.direction, rec.normal);
+            if (cosine <= 0)
+                return color(0, 0, 0);
+
+            ++rays;
+            STAT_INC(shadow_rays);
+            ray shadow = rec.spawn_ray(ls.direction);
+            if (world.occluded(shadow, interval(0.0001, ls.distance * (1 - 1e-3))))
+                return color(0, 0, 0);
+
+            double weight = power_heuristic(ls.pdf, cosine / pi) * cosine / (pi * ls.pdf);
+            return world.lambertian_albedo(rec) * ls.emission * static_cast<real>(weight);
+        }
+
+        // Weight of a sample drawn with density `pdf` when `other_pdf` could have drawn it too
+        static double power_heuristic(double pdf, double other_pdf) {
+            if (other_pdf <= 0)
+                return 1;
+            return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+        }
+
+        // Whether the material hit may give off light; saves asking the other classes
+        template <typename scene_type>
+        static bool emits(const scene_type &world, const hit_record &rec) {
+            material_type type = world.type(rec);
+            return type == material_type::light || type == material_type::other;
+        }
+
+        // Color of the sky seen along a ray that escapes the scene
+        color background(const ray &r) const {
             vec3 unit_direction = unit_vector(r.direction()); // Scale the ray direction to unit length
             auto a = 0.5 * (unit_direction.y() + 1.0); // Blend factor for linear interpolation
-            return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0); // Linear interpolation
-    }
+            return static_cast<real>(sky_brightness)
+                * ((1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0)); // Linear interpolation
+        }
+
+        /*
+         * Wavefront integrator
+         * Instead of following one path to the end, a whole batch of camera rays is generated and
+         * advanced one bounce at a time: every path in the queue is intersected, the hits are binned
+         * by material class and each bin is shaded in a tight loop with a non-virtual scatter call.
+         * Paths that scatter are compacted into the queue of the next bounce.
+         * The random streams are keyed exactly like in `ray_color`, so both integrators trace
+         * the same paths.
+         */
+
+        // State of one path in flight
+        struct path_state {
+            ray r;               // Ray to trace at the current bounce
+            color throughput;    // Product of the attenuations along the path so far
+            rng gen;             // Random stream of the sample
+            int sample;          // Index of the sample within the batch
+        };
+
+        // Hit waiting to be shaded
+        struct pending_hit {
+            int path;            // Index in the current path queue
+            hit_record rec;
+        };
+
+        /*
+         * Adds a pass of `pass_size` samples to a tile with the wavefront integrator, in batches of at most
+         * `wavefront_batch_size` paths. Pixels may start the pass at different sample counts.
+         * The pixels' paths are interleaved, so for the cost map the tile's time is shared out
+         * in proportion to the samples each pixel took.
+         */
+        template <typename scene_type>
+        long long render_tile_wavefront(const scene_type &world, int x0, int y0, int x1, int y1, int pass_size, long long &samples) {
+            auto tile_start = std::chrono::steady_clock::now();
+            int width = x1 - x0;
+            int pixel_count = width * (y1 - y0);
+            int samples_per_batch = std::max(1, std::min(pass_size, wavefront_batch_size / pixel_count));
+
+            // Samples [first_samples[p], last_samples[p]) of every pixel are traced in this pass
+            std::vector<int> first_samples(pixel_count), last_samples(pixel_count);
+            int max_pass_samples = 0;
+            for (int p = 0; p < pixel_count; ++p) {
+                pass_samples(x0 + p % width, y0 + p / width, pass_size, first_samples[p], last_samples[p]);
+                max_pass_samples = std::max(max_pass_samples, last_samples[p] - first_samples[p]);
+            }
+
+            std::vector<color> accumulated(pixel_count, color(0, 0, 0));
+            std::vector<running_stats> pixel_luminance(pixel_count);
+            std::vector<color> sample_colors;  // Radiance of every sample of the batch
+            std::vector<int> sample_pixels;    // Pixel of every sample of the batch
+            std::vector<first_surface> sample_surfaces; // First surface of every sample of the batch, when denoising
+            std::vector<first_surface> *surfaces = surface_sums.empty() ? nullptr : &sample_surfaces;
+            std::vector<path_state> paths, next_paths;
+            std::vector<pending_hit> bins[5]; // One bin per material_type
+            long long rays = 0;
+
+            for (int batch_first = 0; batch_first < max_pass_samples; batch_first += samples_per_batch) {
+                // Generate the camera rays of the batch
+                paths.clear();
+                sample_colors.clear();
+                sample_pixels.clear();
+                sample_surfaces.clear();
+                for (int p = 0; p < pixel_count; ++p) {
+                    int i = window_x + x0 + p % width;
+                    int j = window_y + y0 + p / width;
+                    auto pixel_index = static_cast<uint32_t>(j * image_width + i);
+                    int batch_begin = first_samples[p] + batch_first;
+                    int batch_end = std::min(batch_begin + samples_per_batch, last_samples[p]);
+                    for (int sample = batch_begin; sample < batch_end; ++sample) {
+                        path_state path;
+                        path.gen = rng(seed, pixel_index, static_cast<uint32_t>(sample), &sequence);
+                        path.r = get_ray(i, j, path.gen);
+                        path.throughput = color(1, 1, 1);
+                        path.sample = static_cast<int>(sample_colors.size());
+                        paths.push_back(path);
+                        sample_colors.push_back(color(0, 0, 0));
+                        sample_pixels.push_back(p);
+                        if (surfaces)
+                            sample_surfaces.push_back(first_surface());
+                    }
+                }
+
+                for (int bounce = 1; bounce <= max_depth && !paths.empty(); ++bounce) {
+                    // Intersect the whole queue; escaped paths pick up the sky, lights add their emission and hits go to their material's bin
+                    for (auto &bin : bins)
+                        bin.clear();
+                    rays += static_cast<long long>(paths.size());
+                    if (bounce == 1)
+                        STAT_ADD(primary_rays, static_cast<long long>(paths.size()));
+                    else
+                        STAT_ADD(secondary_rays, static_cast<long long>(paths.size()));
+                    for (int index = 0; index < static_cast<int>(paths.size()); ++index) {
+                        pending_hit hit;
+                        if (world.hit(paths[index].r, interval(0.0001, infinity), hit.rec)) {
+                            hit.path = index;
+                            if (emits(world, hit.rec)) {
+                                color emitted = world.emitted(hit.rec);
+                                sample_colors[paths[index].sample] += paths[index].throughput * emitted;
+                                if (surfaces)
+                                    sample_surfaces[paths[index].sample].emit(emitted, hit.rec.normal);
+                            }
+                            bins[static_cast<int>(world.type(hit.rec))].push_back(hit);
+                        } else {
+                            sample_colors[paths[index].sample] += paths[index].throughput * background(paths[index].r);
+                            if (surfaces)
+                                sample_surfaces[paths[index].sample].escape(background(paths[index].r));
+                            STAT_PATH_END(escaped, bounce);
+                        }
+                    }
+
+                    // Shade one material class at a time, survivors form the next queue
+                    next_paths.clear();
+                    shade_bin<lambertian>(world, bins[static_cast<int>(material_type::lambertian)], bounce, paths, next_paths, surfaces);
+                    shade_bin<metal>(world, bins[static_cast<int>(material_type::metal)], bounce, paths, next_paths, surfaces);
+                    shade_bin<dielectric>(world, bins[static_cast<int>(material_type::dielectric)], bounce, paths, next_paths, surfaces);
+                    shade_bin<diffuse_light>(world, bins[static_cast<int>(material_type::light)], bounce, paths, next_paths, surfaces);
+                    shade_bin<material>(world, bins[static_cast<int>(material_type::other)], bounce, paths, next_paths, surfaces);
+                    paths.swap(next_paths);
+                }
+                // Paths still alive after max_depth bounces gather no light, as in ray_color
+                if (stats_enabled)
+                    for (size_t index = 0; index < paths.size(); ++index)
+                        STAT_PATH_END(depth_limit, max_depth);
+
+                for (size_t index = 0; index < sample_colors.size(); ++index) {
+                    accumulated[sample_pixels[index]] += sample_colors[index];
+                    pixel_luminance[sample_pixels[index]].push(luminance(sample_colors[index]));
+                }
+                for (size_t index = 0; index < sample_surfaces.size(); ++index) {
+                    int p = sample_pixels[index];
+                    surface_sums[static_cast<size_t>(y0 + p / width) * window_width + x0 + p % width].add(sample_surfaces[index]);
+                }
+            }
+
+            long long tile_samples = 0;
+            for (int p = 0; p < pixel_count; ++p) {
+                if (pixel_luminance[p].count > 0) {
+                    accum.add(x0 + p % width, y0 + p / width, accumulated[p], pixel_luminance[p]);
+                    tile_samples += pixel_luminance[p].count;
+                }
+            }
+            samples += tile_samples;
+
+            if (!pixel_seconds.empty() && tile_samples > 0) {
+                auto seconds_per_sample = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - tile_start).count() / tile_samples;
+                for (int p = 0; p < pixel_count; ++p) {
+                    size_t index = static_cast<size_t>(y0 + p / width) * window_width + x0 + p % width;
+                    pixel_seconds[index] += static_cast<float>(seconds_per_sample * pixel_luminance[p].count);
+                }
+            }
+
+            return rays;
+        }
+
+        /*
+         * Scatters every hit of a bin whose materials are all of class `material_class`, recording
+         * first surfaces in `surfaces` (by sample) if given.
+         * Hits are binned by the exact class of their material (see material::type), so for a
+         * hittable_scene the qualified call bypasses the vtable for the concrete classes;
+         * `material` itself (the `other` bin, derived classes included) keeps virtual dispatch. A flat_scene
+         * dispatches through its material table, whose switch always takes the same branch here.
+         */
+        template <typename material_class, typename scene_type>
+        static void shade_bin(const scene_type &world, const std::vector<pending_hit> &bin, int bounce,
+                              std::vector<path_state> &paths, std::vector<path_state> &next_paths,
+                              std::vector<first_surface> *surfaces) {
+            for (const auto &hit : bin) {
+                path_state &path = paths[hit.path];
+
+                ray scattered;
+                color attenuation;
+                path.gen.set_bounce(static_cast<uint32_t>(bounce));
+                STAT_INC(scatter_calls[static_cast<int>(world.type(hit.rec))]);
+                bool scatters = bin_scatter<material_class>(world, path.r, hit.rec, attenuation, scattered, path.gen);
+                if (surfaces)
+                    (*surfaces)[path.sample].scatter(world.type(hit.rec), scatters, attenuation, hit.rec.normal);
+                if (!scatters) {
+                    STAT_PATH_END(absorbed, bounce);
+                    continue; // Absorbed
+                }
+
+                path.r = scattered;
+                path.throughput = path.throughput * attenuation;
+                next_paths.push_back(path);
+            }
+        }
+
+        template <typename material_class>
+        static bool bin_scatter(const hittable_scene &, const ray &r_in, const hit_record &rec,
+                                color &attenuation, ray &scattered, rng &gen) {
+            const auto &mat = static_cast<const material_class &>(*rec.mat);
+            return scatter_with(mat, r_in, rec, attenuation, scattered, gen);
+        }
+
+        template <typename material_class>
+        static bool bin_scatter(const flat_scene &world, const ray &r_in, const hit_record &rec,
+                                color &attenuation, ray &scattered, rng &gen) {
+            return world.scatter(r_in, rec, attenuation, scattered, gen);
+        }
+
+        // Non-virtual scatter for a concrete material class
+        template <typename material_class>
+        static bool scatter_with(const material_class &mat, const ray &r_in, const hit_record &rec,
+                                 color &attenuation, ray &scattered, rng &gen) {
+            return mat.material_class::scatter(r_in, rec, attenuation, scattered, gen);
+        }
+
+        // The base class has no implementation to call directly, dispatch virtually
+        static bool scatter_with(const material &mat, const ray &r_in, const hit_record &rec,
+                                 color &attenuation, ray &scattered, rng &gen) {
+            return mat.scatter(r_in, rec, attenuation, scattered, gen);
+        }
 };
 
 #endif
\ No newline at end of file
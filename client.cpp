@@ -0,0 +1,150 @@
+#include "utils.h"
+#include "render_server.h"
+
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends one request to the server
+static bool send_request(int fd, request_type type, uint32_t id, int priority, image_format format,
+                         const std::string &payload) {
+    server_request request{static_cast<uint32_t>(type), id, priority, static_cast<uint32_t>(format), payload.size()};
+    return write_all(fd, &request, sizeof(request)) && write_all(fd, payload.data(), payload.size());
+}
+
+int main(int argc, char **argv) {
+    /*
+     * Test client of a render server started with `raytracer --serve --socket <path>`:
+     *   --socket <path>        socket of the server
+     *   --scene <file>         scene file to render
+     *   --camera "<setting>"   overrides a camera setting of the file, e.g. --camera "image_width 320";
+     *                          may be repeated
+     *   --priority <n>         priority of the jobs (higher first, 0 by default)
+     *   --format <name>        ppm (default), pfm or png
+     *   --count <n>            send the job n times at once and wait for every answer
+     *   --cancel-after <s>     cancel the jobs not answered after s seconds
+     * The image of the last job answered is written to stdout, the time of every job to stderr.
+     * Exits with 1 if any job failed or was cancelled.
+     */
+    std::string socket_path, scene_path, statements;
+    int priority = 0, count = 1;
+    double cancel_after = -1;
+    image_format format = image_format::ppm;
+    for (int arg = 1; arg < argc; arg++) {
+        if (std::strcmp(argv[arg], "--socket") == 0 && arg + 1 < argc)
+            socket_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--scene") == 0 && arg + 1 < argc)
+            scene_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--camera") == 0 && arg + 1 < argc)
+            statements += std::string("camera ") + argv[++arg] + '\n';
+        else if (std::strcmp(argv[arg], "--priority") == 0 && arg + 1 < argc)
+            priority = std::atoi(argv[++arg]);
+        else if (std::strcmp(argv[arg], "--count") == 0 && arg + 1 < argc)
+            count = std::max(1, std::atoi(argv[++arg]));
+        else if (std::strcmp(argv[arg], "--cancel-after") == 0 && arg + 1 < argc)
+            cancel_after = std::atof(argv[++arg]);
+        else if (std::strcmp(argv[arg], "--format") == 0 && arg + 1 < argc) {
+            std::string name = argv[++arg];
+            if (name == "ppm")
+                format = image_format::ppm;
+            else if (name == "pfm")
+                format = image_format::pfm;
+            else if (name == "png")
+                format = image_format::png;
+            else {
+                std::cerr << "Unknown format " << name << '\n';
+                return 2;
+            }
+        } else {
+            socket_path.clear();
+            break;
+        }
+    }
+    if (socket_path.empty() || scene_path.empty()) {
+        std::cerr << "Usage: " << argv[0] << " --socket <path> --scene <file> [--camera \"<setting> <values>\"]..."
+                  << " [--priority <n>] [--format ppm|pfm|png] [--count <n>] [--cancel-after <seconds>] > image\n";
+        return 2;
+    }
+
+    // The server may run in another directory
+    char resolved[PATH_MAX];
+    if (::realpath(scene_path.c_str(), resolved))
+        scene_path = resolved;
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << socket_path << '\n';
+        return 1;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        std::cerr << "Cannot connect to " << socket_path << ": " << std::strerror(errno) << '\n';
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int id = 1; id <= count; id++) {
+        if (!send_request(fd, request_type::render, static_cast<uint32_t>(id), priority, format,
+                          scene_path + '\n' + statements)) {
+            std::cerr << "Server closed the connection\n";
+            return 1;
+        }
+    }
+
+    int answered = 0, failures = 0;
+    bool cancel_sent = false;
+    std::string image;
+    while (answered < count) {
+        // Wait for the next answer, cancelling everything once the time is up
+        if (cancel_after >= 0 && !cancel_sent) {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            pollfd p{fd, POLLIN, 0};
+            if (::poll(&p, 1, static_cast<int>(std::max(0.0, cancel_after - elapsed) * 1000)) == 0) {
+                for (int id = 1; id <= count; id++)
+                    send_request(fd, request_type::cancel, static_cast<uint32_t>(id), 0, format, std::string());
+                cancel_sent = true;
+                continue;
+            }
+        }
+
+        server_reply reply;
+        if (!read_all(fd, &reply, sizeof(reply))) {
+            std::cerr << "Server closed the connection\n";
+            return 1;
+        }
+        std::string payload(static_cast<size_t>(reply.bytes), '\0');
+        if (!read_all(fd, &payload[0], payload.size())) {
+            std::cerr << "Server closed the connection\n";
+            return 1;
+        }
+        answered++;
+
+        std::cerr << "Job " << reply.id << ": ";
+        if (reply.status == static_cast<uint32_t>(reply_status::done)) {
+            std::cerr << "done in " << reply.seconds << " s, " << reply.samples << " samples, " << reply.rays << " rays\n";
+            image.swap(payload);
+        } else if (reply.status == static_cast<uint32_t>(reply_status::cancelled)) {
+            std::cerr << "cancelled after " << reply.seconds << " s\n";
+            failures++;
+        } else {
+            std::cerr << "failed: " << payload << '\n';
+            failures++;
+        }
+    }
+    ::close(fd);
+
+    std::cout.write(image.data(), static_cast<std::streamsize>(image.size()));
+    return failures == 0 && std::cout ? 0 : 1;
+}
\ No newline at end of file
@@ -2,37 +2,17 @@
 #define COLOR_H
 
 #include "vec3.h"
-#include <iostream>
 
 using color = vec3;
 
+// Returns the luminance of a linear color (Rec. 709 weights)
+inline double luminance(const color &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 // Converts a linear color component to its gamma-corrected form
 inline double linear_to_gamma(double linear_component) {
     return sqrt(linear_component);
 }
 
-// Writes color to output stream
-void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
-
-    // Divide the color by the number of samples
-    auto scale = 1.0 / samples_per_pixel;
-    r *= scale;
-    g *= scale;
-    b *= scale;
-
-    // Apply the linear to gamma transform
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
-    // Write the translated [0,255] value of each color component
-    static const interval intensity(0.000, 0.999);
-    out << static_cast<int>(256 * intensity.clamp(r)) << ' '
-        << static_cast<int>(256 * intensity.clamp(g)) << ' '
-        << static_cast<int>(256 * intensity.clamp(b)) << '\n';
-}
-
 #endif
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef DEMO_SCENE_H
+#define DEMO_SCENE_H
+
+#include "utils.h"
+#include "arena.h"
+#include "camera.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+/*
+ * The scene rendered by main.cpp: a ground sphere, a grid of small random spheres and three
+ * large ones. The benchmarks render it as well, so both share this definition.
+ */
+
+// Builds the scene, drawing the random sphere placement and materials from `gen`; objects go in `arena` if given
+inline hittable_list demo_scene(rng &gen, scene_arena *arena = nullptr) {
+    hittable_list world; // Create a list to hold all hittable objects
+
+    // Create and add a large sphere as the ground
+    auto ground_material = make_in<lambertian>(arena, color(0.5, 0.5, 0.5));
+    world.add(make_in<sphere>(arena, point3(0, -1000, 0), 1000, ground_material));
+
+    // Generate smaller spheres with random positions and materials
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double(gen);
+            point3 center(a + 0.9 * random_double(gen), 0.2, b + 0.9 * random_double(gen));
+
+            // Only add sphere if it's sufficiently far from (4, 0.2, 0)
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // Diffuse material with random color
+                    auto albedo = color::random(gen) * color::random(gen);
+                    sphere_material = make_in<lambertian>(arena, albedo);
+                    world.add(make_in<sphere>(arena, center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // Metal material with random color and fuzziness
+                    auto albedo = color::random(gen, 0.5, 1);
+                    auto fuzz = random_double(gen, 0, 0.5);
+                    sphere_material = make_in<metal>(arena, albedo, fuzz);
+                    world.add(make_in<sphere>(arena, center, 0.2, sphere_material));
+                } else {
+                    // Glass material
+                    sphere_material = make_in<dielectric>(arena, 1.5);
+                    world.add(make_in<sphere>(arena, center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    // Add three larger spheres to the scene
+    auto material1 = make_in<dielectric>(arena, 1.5);
+    world.add(make_in<sphere>(arena, point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = make_in<lambertian>(arena, color(0.4, 0.2, 0.1));
+    world.add(make_in<sphere>(arena, point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = make_in<metal>(arena, color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_in<sphere>(arena, point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+// Points the camera at the scene (view only: resolution and sampling are left to the caller)
+inline void demo_view(camera &cam) {
+    cam.aspect_ratio = 16.0 / 9.0;
+
+    cam.vfov = 20;                          // Vertical field of view in degrees
+    cam.lookfrom = point3(13, 2, 3);        // Camera position
+    cam.lookat = point3(0, 0, 0);           // Look at center of the scene
+    cam.vup = vec3(0, 1, 0);                // "Up" direction
+
+    cam.defocus_angle = 0.6;                // Depth of field setting
+    cam.focus_dist = 10.0;                  // Focus distance
+}
+
+#endif
\ No newline at end of file
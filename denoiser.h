@@ -0,0 +1,205 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "utils.h"
+#include "color.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/*
+ * Removes the noise of a rendered image, guided by two auxiliary buffers describing the first
+ * surface seen through every pixel: its albedo and its normal.
+ * The image is divided by the albedo first, so only the lighting is filtered and colors and
+ * textures stay sharp, and multiplied by it again at the end.
+ * The filter is the edge-avoiding a-trous wavelet transform (Dammertz et al. 2010): `iterations`
+ * passes of a 5x5 B-spline kernel whose taps are 1, 2, 4... pixels apart, so the footprint
+ * doubles with every pass at the same cost. Every tap is weighted down by how much its pixel
+ * differs from the center pixel in
+ *  - luminance, measured in standard errors of the center's luminance (as in SVGF, Schied et al.
+ *    2017), so noisy pixels are smoothed more than converged ones; the variance is filtered
+ *    along with the image,
+ *  - normal and albedo, so the edges of objects and materials are kept.
+ * Rows are filtered in parallel. Pixels are stored as separate float planes and every tap is
+ * applied to a whole row in a branch-free loop, which the compiler vectorizes.
+ */
+class denoiser {
+    public:
+        int iterations = 5;             // Filter passes, the last one spans 4 * 2^(iterations-1) pixels
+        float luminance_sigma = 2;      // Luminance difference, in standard errors, at which a tap's weight falls by e
+        float normal_sigma = 0.5f;      // The same for the distance between normals
+        float albedo_sigma = 0.3f;      // The same for the distance between albedos
+
+        /*
+         * Filters `image` in place. `variance` holds the variance of every pixel's mean luminance
+         * (row by row), `albedo` and `normal` the guides; all have the size of `image`.
+         */
+        void filter(framebuffer &image, const std::vector<float> &variance, const framebuffer &albedo,
+                    const framebuffer &normal, thread_pool &pool) const {
+            int w = image.width(), h = image.height();
+            size_t count = static_cast<size_t>(w) * h;
+            if (count == 0)
+                return;
+
+            const float albedo_epsilon = 0.01f;
+            const float max_variance = 1e4f;    // Stands in for the infinite variance of a pixel with one sample
+
+            // Split into planes, dividing the color by the albedo (plus a little, for black surfaces)
+            planes current(count), next(count);
+            guides guide(count);
+            for (size_t p = 0; p < count; p++) {
+                const float *c = image.data() + 3 * p;
+                const float *a = albedo.data() + 3 * p;
+                const float *n = normal.data() + 3 * p;
+                for (int k = 0; k < 3; k++) {
+                    guide.albedo[k][p] = a[k];
+                    guide.normal[k][p] = n[k];
+                    current.color[k][p] = c[k] / (a[k] + albedo_epsilon);
+                }
+                float a_luminance = static_cast<float>(luminance(color(a[0], a[1], a[2]))) + albedo_epsilon;
+                current.variance[p] = std::min(variance[p], max_variance) / (a_luminance * a_luminance);
+            }
+
+            std::vector<float> inverse_sigma(count);
+            for (int iteration = 0; iteration < iterations; iteration++) {
+                int step = 1 << iteration;
+                pool.parallel_for(h, [&](int y, int) { luminance_scale(current, w, h, y, inverse_sigma); });
+                pool.parallel_for(h, [&](int y, int) { filter_row(current, guide, inverse_sigma, w, h, y, step, next); });
+                std::swap(current, next);
+            }
+
+            for (size_t p = 0; p < count; p++) {
+                float *c = image.data() + 3 * p;
+                for (int k = 0; k < 3; k++)
+                    c[k] = current.color[k][p] * (guide.albedo[k][p] + albedo_epsilon);
+            }
+        }
+
+    private:
+        // Filtered values, one plane per component
+        struct planes {
+            std::vector<float> color[3];
+            std::vector<float> variance;
+
+            explicit planes(size_t count) : variance(count) {
+                for (auto &plane : color)
+                    plane.resize(count);
+            }
+        };
+
+        // Guide values, one plane per component
+        struct guides {
+            std::vector<float> albedo[3];
+            std::vector<float> normal[3];
+
+            explicit guides(size_t count) {
+                for (int k = 0; k < 3; k++) {
+                    albedo[k].resize(count);
+                    normal[k].resize(count);
+                }
+            }
+        };
+
+        // exp(-x) for x >= 0 to within a few percent, as (1 - x/64)^64; branch-free so loops around it vectorize
+        static float falloff(float x) {
+            float t = 1.0f - x * (1.0f / 64);
+            t = t > 0.0f ? t : 0.0f;
+            t *= t;
+            t *= t;
+            t *= t;
+            t *= t;
+            t *= t;
+            return t * t;
+        }
+
+        /*
+         * Stores 1 / (luminance_sigma * standard error) for the pixels of row y. The variance is
+         * blurred over 3x3 pixels first, since estimates from few samples are noisy themselves.
+         */
+        void luminance_scale(const planes &in, int w, int h, int y, std::vector<float> &inverse_sigma) const {
+            static const float kernel[3] = {0.25f, 0.5f, 0.25f};
+            for (int x = 0; x < w; x++) {
+                float sum = 0, weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    int qy = y + dy;
+                    if (qy < 0 || qy >= h)
+                        continue;
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = x + dx;
+                        if (qx < 0 || qx >= w)
+                            continue;
+                        float k = kernel[dy + 1] * kernel[dx + 1];
+                        sum += k * in.variance[static_cast<size_t>(qy) * w + qx];
+                        weight += k;
+                    }
+                }
+                inverse_sigma[static_cast<size_t>(y) * w + x] = 1.0f / (luminance_sigma * std::sqrt(sum / weight) + 1e-4f);
+            }
+        }
+
+        /*
+         * One a-trous pass over row y with taps `step` pixels apart, from `in` into `out`. The row
+         * is done in spans whose sums live on the stack, where the compiler can see that they
+         * overlap none of the planes.
+         */
+        void filter_row(const planes &in, const guides &guide, const std::vector<float> &inverse_sigma, int w, int h,
+                        int y, int step, planes &out) const {
+            static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+            const int span = 64;
+            float normal_scale = 1.0f / (normal_sigma * normal_sigma);
+            float albedo_scale = 1.0f / (albedo_sigma * albedo_sigma);
+            size_t row = static_cast<size_t>(y) * w;
+            const float *r = in.color[0].data(), *g = in.color[1].data(), *b = in.color[2].data();
+            const float *variance = in.variance.data(), *scale = inverse_sigma.data() + row;
+            const float *ar = guide.albedo[0].data(), *ag = guide.albedo[1].data(), *ab = guide.albedo[2].data();
+            const float *nx = guide.normal[0].data(), *ny = guide.normal[1].data(), *nz = guide.normal[2].data();
+
+            for (int x0 = 0; x0 < w; x0 += span) {
+                int x1 = std::min(x0 + span, w);
+                float sum_r[span] = {}, sum_g[span] = {}, sum_b[span] = {}, sum_variance[span] = {}, sum_weight[span] = {};
+
+                for (int ty = 0; ty < 5; ty++) {
+                    int qy = y + (ty - 2) * step;
+                    if (qy < 0 || qy >= h)
+                        continue;
+                    for (int tx = 0; tx < 5; tx++) {
+                        // Taps falling outside the image are left out, the weights are normalized anyway
+                        int dx = (tx - 2) * step;
+                        int x_begin = std::max(x0, -dx), x_end = std::min(x1, w - dx);
+                        float k = kernel[ty] * kernel[tx];
+                        size_t q_offset = static_cast<size_t>(qy) * w + dx;
+                        for (int x = x_begin; x < x_end; x++) {
+                            size_t p = row + x, q = q_offset + x;
+                            float lp = 0.2126f * r[p] + 0.7152f * g[p] + 0.0722f * b[p];
+                            float lq = 0.2126f * r[q] + 0.7152f * g[q] + 0.0722f * b[q];
+                            float dnx = nx[p] - nx[q], dny = ny[p] - ny[q], dnz = nz[p] - nz[q];
+                            float dar = ar[p] - ar[q], dag = ag[p] - ag[q], dab = ab[p] - ab[q];
+                            float distance = std::fabs(lp - lq) * scale[x]
+                                + (dnx * dnx + dny * dny + dnz * dnz) * normal_scale
+                                + (dar * dar + dag * dag + dab * dab) * albedo_scale;
+                            float weight = k * falloff(distance);
+                            sum_r[x - x0] += weight * r[q];
+                            sum_g[x - x0] += weight * g[q];
+                            sum_b[x - x0] += weight * b[q];
+                            sum_variance[x - x0] += weight * weight * variance[q];
+                            sum_weight[x - x0] += weight;
+                        }
+                    }
+                }
+
+                // The center tap always has a weight, so the sums are never zero
+                for (int x = x0; x < x1; x++) {
+                    float inverse = 1.0f / sum_weight[x - x0];
+                    out.color[0][row + x] = sum_r[x - x0] * inverse;
+                    out.color[1][row + x] = sum_g[x - x0] * inverse;
+                    out.color[2][row + x] = sum_b[x - x0] * inverse;
+                    out.variance[row + x] = sum_variance[x - x0] * inverse * inverse;
+                }
+            }
+        }
+};
+
+#endif
\ No newline at end of file
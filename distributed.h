@@ -0,0 +1,456 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "utils.h"
+#include "accumulation_buffer.h"
+#include "camera.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Rendering one image with several processes, possibly on several machines.
+ *
+ * A coordinator cuts the image into jobs (a tile, and optionally a range of its samples) and hands
+ * them to worker processes, one at a time each, over the workers' stdin and stdout. A worker is the
+ * renderer itself started with the same scene and camera settings: it renders every job it is sent
+ * with its own threads and answers with the job's partial accumulation buffer, which the
+ * coordinator merges into the image. Samples are seeded by pixel and sample index only, so a job
+ * gives the same samples whichever worker renders it, and without adaptive sampling the merged
+ * image is identical to a single-process render.
+ *
+ * Workers are started with fork and exec, so a worker command can also reach another machine,
+ * e.g. `ssh host raytracer --worker --scene file`. A worker that exits or breaks the protocol is
+ * started again and its job is handed out again; once nothing is left to hand out, jobs running
+ * much longer than usual are given to idle workers as well and the first result is kept.
+ *
+ * Messages are raw structs in native byte order, like the snapshot files:
+ *   coordinator -> worker: render_job, repeated; the worker exits when its stdin is closed
+ *   worker -> coordinator: job_result followed by `bytes` bytes of accumulation buffer snapshot
+ */
+
+// Part of the image for a worker: samples [first_sample, last_sample) of the pixels [x0, x1) x [y0, y1)
+struct render_job {
+    uint32_t id;
+    int32_t x0, y0, x1, y1;
+    int32_t first_sample, last_sample;
+};
+
+// Header of a worker's answer to a render_job
+struct job_result {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t bytes;         // Size of the snapshot that follows
+    int64_t samples;        // Samples taken and rays traced for the job
+    int64_t rays;
+};
+
+// Writes all of `data`; false once the other end is gone
+inline bool write_all(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = ::write(fd, p, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        p += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// Reads exactly `size` bytes; false at the end of the stream or on an error
+inline bool read_all(int fd, void *data, size_t size) {
+    char *p = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t got = ::read(fd, p, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+/*
+ * Worker side: renders the jobs read from `in_fd` with `cam` until the stream ends, answering each
+ * on `out_fd`. `cam` must be set up as the coordinator's camera; `world` is anything camera::render
+ * takes. Returns false if a render was stopped by a signal or the coordinator went away.
+ */
+template <typename scene_type>
+bool serve_render_jobs(camera &cam, const scene_type &world, int in_fd = 0, int out_fd = 1) {
+    cam.output = nullptr;           // Results go back over out_fd, not as images
+    cam.show_progress = false;
+    cam.checkpoint_path.clear();
+    cam.resume = false;
+    cam.sample_map_path.clear();
+    cam.cost_map_path.clear();
+    cam.denoise = false;            // The coordinator denoises the whole image
+    if (cam.pattern_samples == 0)
+        cam.pattern_samples = cam.samples_per_pixel; // Jobs cover parts of one stratified pattern, not patterns of their own
+
+    render_job job;
+    while (read_all(in_fd, &job, sizeof(job))) {
+        cam.render_window = pixel_rect(job.x0, job.y0, job.x1, job.y1);
+        cam.first_sample = job.first_sample;
+        cam.samples_per_pixel = job.last_sample;
+        if (!cam.render(world))
+            return false;
+
+        std::ostringstream snapshot;
+        cam.accum.write(snapshot, cam.scene_hash, cam.camera_hash());
+        std::string bytes = snapshot.str();
+        job_result result{job.id, 0, bytes.size(), cam.stats.samples, cam.stats.rays};
+        if (!write_all(out_fd, &result, sizeof(result)) || !write_all(out_fd, bytes.data(), bytes.size()))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Coordinator side: renders a camera's image with worker processes and writes it like
+ * camera::render. Checkpoints and the cost map are not available in this mode. The image is
+ * denoised if the camera asks for it and its albedo and normal buffers were filled beforehand
+ * (see camera::render_aovs).
+ * Errors that more workers cannot fix (no worker can be started, workers keep failing, a worker
+ * renders a different scene or camera) are thrown as std::runtime_error.
+ */
+class render_coordinator {
+    public:
+        std::vector<std::vector<std::string>> worker_commands; // Program and arguments of each worker, run with execvp
+        int job_size = 64;              // Edge length in pixels of the square tile of a job
+        int sample_chunks = 1;          // Jobs per tile, each a range of its samples (forced to 1 in adaptive mode)
+        double straggler_factor = 4;    // Run a job again once it takes this many times the median job time
+        double job_timeout = 0;         // Seconds before a worker stuck on a job is killed (0 = never)
+        int max_restarts = 8;           // Failed workers started again before the render gives up
+        bool show_progress = true;      // Report progress on std::clog
+
+        render_stats stats;             // Filled in by render(); samples and rays of duplicate jobs are left out
+
+        // Renders the image of `cam` and writes it to cam.output; false if stopped by a signal
+        bool render(camera &cam) {
+            stats = render_stats();
+            auto phase_start = std::chrono::steady_clock::now();
+            auto end_phase = [&](const char *name) {
+                auto now = std::chrono::steady_clock::now();
+                stats.add_phase(name, std::chrono::duration<double>(now - phase_start).count());
+                phase_start = now;
+            };
+
+            if (worker_commands.empty())
+                throw std::runtime_error("render_coordinator: no worker commands");
+            make_jobs(cam);
+            expected_camera_hash = cam.camera_hash();
+            expected_scene_hash = cam.scene_hash;
+            cam.accum = accumulation_buffer(cam.image_width, cam.get_image_height());
+
+            // A worker that dies must not take the coordinator with it: writing to its pipe fails with EPIPE
+            camera::ignore_broken_pipes();
+            workers.assign(worker_commands.size(), worker_process());
+            restarts = 0;
+            bool finished = false;
+            try {
+                for (size_t w = 0; w < workers.size(); w++)
+                    start(w);
+                end_phase("setup");
+                if (show_progress)
+                    std::clog << "Rendering " << jobs.size() << " jobs on " << workers.size() << " workers\n";
+                finished = run(cam);
+            } catch (...) {
+                stop_workers();
+                throw;
+            }
+            stop_workers();
+            end_phase("trace");
+
+            if (!finished) {
+                cam.stats = stats;
+                std::clog << "\rStopped.                                        \n";
+                return false;
+            }
+            cam.write_output();
+            end_phase("output");
+            cam.stats = stats;
+            if (show_progress)
+                std::clog << "\rDone.                                           \n";
+            return true;
+        }
+
+    private:
+        // State of a job
+        struct job_state {
+            render_job job;
+            bool done = false;
+            int running = 0;            // Workers rendering it
+        };
+
+        // A worker process and the job it is rendering
+        struct worker_process {
+            pid_t pid = -1;             // -1: not running
+            int to_worker = -1;         // Its stdin
+            int from_worker = -1;       // Its stdout
+            int job = -1;               // Index in `jobs`, -1 when idle
+            std::chrono::steady_clock::time_point job_start;
+            std::vector<char> received; // Bytes of the answer so far
+        };
+
+        std::vector<job_state> jobs;
+        std::deque<int> pending;        // Jobs not handed out yet, or whose worker failed
+        std::vector<worker_process> workers;
+        std::vector<double> job_seconds; // Time taken by every finished job
+        int restarts = 0;
+        uint64_t expected_scene_hash = 0, expected_camera_hash = 0;
+
+        // Cuts the image into jobs, tile rows from the top
+        void make_jobs(const camera &cam) {
+            int width = cam.image_width, height = cam.get_image_height();
+            int chunks = cam.adaptive ? 1 : std::max(1, std::min(sample_chunks, cam.samples_per_pixel));
+            jobs.clear();
+            pending.clear();
+            job_seconds.clear();
+            for (int y = 0; y < height; y += job_size) {
+                for (int x = 0; x < width; x += job_size) {
+                    for (int chunk = 0; chunk < chunks; chunk++) {
+                        job_state state;
+                        state.job.id = static_cast<uint32_t>(jobs.size());
+                        state.job.x0 = x;
+                        state.job.y0 = y;
+                        state.job.x1 = std::min(x + job_size, width);
+                        state.job.y1 = std::min(y + job_size, height);
+                        state.job.first_sample = cam.samples_per_pixel * chunk / chunks;
+                        state.job.last_sample = cam.samples_per_pixel * (chunk + 1) / chunks;
+                        pending.push_back(static_cast<int>(jobs.size()));
+                        jobs.push_back(state);
+                    }
+                }
+            }
+        }
+
+        // Hands out jobs and merges the answers until every job is done; false if stopped by a signal
+        bool run(camera &cam) {
+            size_t jobs_left = jobs.size(), jobs_shown = 0;
+            while (jobs_left > 0) {
+                if (render_stop_requested())
+                    return false;
+
+                for (size_t w = 0; w < workers.size(); w++) {
+                    if (workers[w].pid >= 0 && workers[w].job < 0)
+                        assign(w);
+                }
+
+                std::vector<pollfd> fds;
+                std::vector<size_t> polled;
+                for (size_t w = 0; w < workers.size(); w++) {
+                    if (workers[w].pid >= 0 && workers[w].job >= 0) {
+                        fds.push_back(pollfd{workers[w].from_worker, POLLIN, 0});
+                        polled.push_back(w);
+                    }
+                }
+                if (fds.empty())
+                    throw std::runtime_error("render_coordinator: no worker left to render after "
+                                             + std::to_string(restarts) + " restarts");
+                if (::poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+                    throw std::runtime_error(std::string("render_coordinator: poll failed: ") + std::strerror(errno));
+
+                for (size_t f = 0; f < fds.size(); f++) {
+                    size_t w = polled[f];
+                    if (fds[f].revents != 0 && !receive(w, cam, jobs_left))
+                        fail(w, "exited");
+                    else if (job_timeout > 0 && elapsed(workers[w]) > job_timeout)
+                        fail(w, "timed out");
+                }
+
+                if (show_progress && jobs_left != jobs_shown) {
+                    std::clog << "\rJobs remaining: " << jobs_left << "   " << std::flush;
+                    jobs_shown = jobs_left;
+                }
+            }
+            return true;
+        }
+
+        /*
+         * Gives worker `w` the next pending job. Once there is none, it takes over the oldest
+         * job that is running alone and for longer than straggler_factor times the median job time.
+         */
+        void assign(size_t w) {
+            int next = -1;
+            while (!pending.empty() && next < 0) {
+                next = pending.front();
+                pending.pop_front();
+                if (jobs[next].done)
+                    next = -1;
+            }
+            if (next < 0 && !job_seconds.empty()) {
+                std::vector<double> sorted(job_seconds);
+                std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+                double limit = straggler_factor * sorted[sorted.size() / 2];
+                double longest = limit;
+                for (const auto &other : workers) {
+                    if (other.pid >= 0 && other.job >= 0 && jobs[other.job].running == 1 && elapsed(other) > longest) {
+                        next = other.job;
+                        longest = elapsed(other);
+                    }
+                }
+            }
+            if (next < 0)
+                return;
+
+            worker_process &worker = workers[w];
+            worker.job = next;
+            worker.job_start = std::chrono::steady_clock::now();
+            worker.received.clear();
+            jobs[next].running++;
+            if (!write_all(worker.to_worker, &jobs[next].job, sizeof(render_job)))
+                fail(w, "exited");
+        }
+
+        /*
+         * Reads what worker `w` has sent and, once its answer is complete, merges it (unless
+         * another worker finished the job first). Returns false if the worker is gone.
+         */
+        bool receive(size_t w, camera &cam, size_t &jobs_left) {
+            worker_process &worker = workers[w];
+            char buffer[1 << 16];
+            ssize_t got = ::read(worker.from_worker, buffer, sizeof(buffer));
+            if (got < 0 && errno == EINTR)
+                return true;
+            if (got <= 0)
+                return false;
+            worker.received.insert(worker.received.end(), buffer, buffer + got);
+
+            job_result result;
+            if (worker.received.size() < sizeof(result))
+                return true;
+            std::memcpy(&result, worker.received.data(), sizeof(result));
+            if (result.id != jobs[worker.job].job.id)
+                return false;
+            if (worker.received.size() < sizeof(result) + result.bytes)
+                return true;
+            if (worker.received.size() > sizeof(result) + result.bytes)
+                return false;   // Answered more than it was asked
+
+            job_state &state = jobs[worker.job];
+            state.running--;
+            job_seconds.push_back(elapsed(worker));
+            if (!state.done) {
+                const render_job &job = state.job;
+                accumulation_buffer part(job.x1 - job.x0, job.y1 - job.y0);
+                std::istringstream snapshot(std::string(worker.received.begin() + sizeof(result), worker.received.end()));
+                if (!part.read(snapshot, expected_scene_hash, expected_camera_hash))
+                    throw std::runtime_error("render_coordinator: worker " + std::to_string(w)
+                                             + " rendered a different scene or camera");
+                cam.accum.merge(part, job.x0, job.y0);
+                state.done = true;
+                stats.samples += result.samples;
+                stats.rays += result.rays;
+                jobs_left--;
+            }
+            worker.job = -1;
+            worker.received.clear();
+            return true;
+        }
+
+        static double elapsed(const worker_process &worker) {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - worker.job_start).count();
+        }
+
+        // Starts worker `w`, its stdin and stdout connected to pipes
+        void start(size_t w) {
+            const std::vector<std::string> &command = worker_commands[w];
+            std::vector<char *> argv;
+            for (const auto &arg : command)
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            argv.push_back(nullptr);
+
+            // Close-on-exec everywhere, so no worker holds another one's pipes open
+            int to_worker[2], from_worker[2];
+            if (::pipe(to_worker) != 0)
+                throw std::runtime_error(std::string("render_coordinator: pipe failed: ") + std::strerror(errno));
+            if (::pipe(from_worker) != 0) {
+                ::close(to_worker[0]);
+                ::close(to_worker[1]);
+                throw std::runtime_error(std::string("render_coordinator: pipe failed: ") + std::strerror(errno));
+            }
+            for (int fd : {to_worker[0], to_worker[1], from_worker[0], from_worker[1]})
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+            pid_t pid = ::fork();
+            if (pid == 0) {
+                std::signal(SIGPIPE, SIG_DFL);  // Ignoring it would carry over into the worker through exec
+                ::dup2(to_worker[0], 0);
+                ::dup2(from_worker[1], 1);
+                ::execvp(argv[0], argv.data());
+                ::_exit(127);
+            }
+            ::close(to_worker[0]);
+            ::close(from_worker[1]);
+            if (pid < 0) {
+                ::close(to_worker[1]);
+                ::close(from_worker[0]);
+                throw std::runtime_error(std::string("render_coordinator: fork failed: ") + std::strerror(errno));
+            }
+
+            worker_process &worker = workers[w];
+            worker = worker_process();
+            worker.pid = pid;
+            worker.to_worker = to_worker[1];
+            worker.from_worker = from_worker[0];
+        }
+
+        // Ends worker `w` and hands its job out again; starts a new worker while restarts are left
+        void fail(size_t w, const char *reason) {
+            worker_process &worker = workers[w];
+            if (show_progress)
+                std::clog << "\rWorker " << w << " (pid " << worker.pid << ") " << reason << '\n';
+            if (worker.job >= 0) {
+                job_state &state = jobs[worker.job];
+                state.running--;
+                if (!state.done && state.running == 0)
+                    pending.push_front(worker.job);
+            }
+            end(worker, true);
+            if (restarts < max_restarts) {
+                restarts++;
+                start(w);
+            }
+        }
+
+        // Closes the pipes of a worker and reaps it, killing it first if `kill` or if it is busy
+        static void end(worker_process &worker, bool kill) {
+            if (worker.pid < 0)
+                return;
+            if (kill || worker.job >= 0)
+                ::kill(worker.pid, SIGKILL);
+            ::close(worker.to_worker);      // An idle worker exits at the end of its input
+            ::close(worker.from_worker);
+            while (::waitpid(worker.pid, nullptr, 0) < 0 && errno == EINTR) {
+            }
+            worker = worker_process();
+        }
+
+        void stop_workers() {
+            for (auto &worker : workers)
+                end(worker, false);
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,180 @@
+#ifndef FLAT_SCENE_H
+#define FLAT_SCENE_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "light.h"
+#include "material.h"
+#include "sphere_batch.h"
+
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+/*
+ * Materials stored by value, one contiguous array per class, and addressed by a 32-bit index.
+ * `scatter` picks the array with a switch on the class tag and makes a qualified (non-virtual)
+ * call, so shading a hit needs no vtable lookup. Classes defined outside material.h are kept
+ * by pointer and dispatched virtually.
+ */
+class material_table {
+    public:
+        material_table() {} // Default constructor
+
+        // Copies every material of `list`, material i of the list getting index i
+        explicit material_table(const std::vector<shared_ptr<material>> &list) {
+            for (const auto &mat : list)
+                add(mat);
+        }
+
+        // Adds a copy of the material and returns its index
+        uint32_t add(const shared_ptr<material> &mat) {
+            entry e;
+            const std::type_info &dynamic_type = typeid(*mat);
+            if (dynamic_type == typeid(lambertian)) {
+                e.type = material_type::lambertian;
+                e.index = static_cast<uint32_t>(lambertians.size());
+                lambertians.push_back(static_cast<const lambertian &>(*mat));
+            } else if (dynamic_type == typeid(metal)) {
+                e.type = material_type::metal;
+                e.index = static_cast<uint32_t>(metals.size());
+                metals.push_back(static_cast<const metal &>(*mat));
+            } else if (dynamic_type == typeid(dielectric)) {
+                e.type = material_type::dielectric;
+                e.index = static_cast<uint32_t>(dielectrics.size());
+                dielectrics.push_back(static_cast<const dielectric &>(*mat));
+            } else if (dynamic_type == typeid(diffuse_light)) {
+                e.type = material_type::light;
+                e.index = static_cast<uint32_t>(lights.size());
+                lights.push_back(static_cast<const diffuse_light &>(*mat));
+            } else {
+                e.type = material_type::other;
+                e.index = static_cast<uint32_t>(others.size());
+                others.push_back(mat);
+            }
+
+            entries.push_back(e);
+            return static_cast<uint32_t>(entries.size() - 1);
+        }
+
+        // Number of materials in the table
+        int size() const { return static_cast<int>(entries.size()); }
+
+        // Class of material `id`
+        material_type type(uint32_t id) const { return entries[id].type; }
+
+        // Scatters a ray off material `id`, see material::scatter
+        bool scatter(uint32_t id, const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered,
+                     rng &gen) const {
+            const entry &e = entries[id];
+            switch (e.type) {
+                case material_type::lambertian:
+                    return lambertians[e.index].lambertian::scatter(r_in, rec, attenuation, scattered, gen);
+                case material_type::metal:
+                    return metals[e.index].metal::scatter(r_in, rec, attenuation, scattered, gen);
+                case material_type::dielectric:
+                    return dielectrics[e.index].dielectric::scatter(r_in, rec, attenuation, scattered, gen);
+                case material_type::light:
+                    return false;
+                default:
+                    return others[e.index]->scatter(r_in, rec, attenuation, scattered, gen);
+            }
+        }
+
+        // Light given off by material `id`, see material::emitted
+        color emitted(uint32_t id, const hit_record &rec) const {
+            const entry &e = entries[id];
+            switch (e.type) {
+                case material_type::light:
+                    return lights[e.index].diffuse_light::emitted(rec);
+                case material_type::other:
+                    return others[e.index]->emitted(rec);
+                default:
+                    return color(0, 0, 0);
+            }
+        }
+
+        // Albedo of material `id`, which must be a lambertian
+        color lambertian_albedo(uint32_t id) const { return lambertians[entries[id].index].get_albedo(); }
+
+    private:
+        // Class tag and position in that class's array
+        struct entry {
+            material_type type;
+            uint32_t index;
+        };
+
+        std::vector<entry> entries;
+        std::vector<lambertian> lambertians;
+        std::vector<metal> metals;
+        std::vector<dielectric> dielectrics;
+        std::vector<diffuse_light> lights;
+        std::vector<shared_ptr<material>> others;
+};
+
+/*
+ * Scene flattened for rendering: the spheres in a sphere_batch with a BVH (arrays of
+ * coordinates and radii, 32-bit material indices) and the materials in a material_table.
+ * Intersection calls the final sphere_batch directly and shading goes through the table,
+ * so a bounce makes no virtual call and touches no reference count.
+ * The hittable and material classes stay the front-end: a scene is built as a hittable_list
+ * of spheres, or loaded into a sphere_batch, and then flattened. Render it with
+ * camera::render(const flat_scene &).
+ */
+class flat_scene {
+    public:
+        // Flattens a list of spheres (any other kind of object is rejected by sphere_batch)
+        explicit flat_scene(const hittable_list &list) : flat_scene(make_shared<sphere_batch>(list)) {}
+
+        // Renders an existing batch, building its BVH if it has none yet
+        explicit flat_scene(shared_ptr<sphere_batch> batch)
+            : spheres(batch), materials(batch->get_materials()), emitters(*batch) {
+            if (!spheres->has_bvh())
+                spheres->build_bvh();
+        }
+
+        // Finds the nearest hit; rec.material_id indexes the material table
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const {
+            return spheres->hit(r, ray_t, rec);
+        }
+
+        // True if anything is hit inside ray_t, see hittable::occluded
+        bool occluded(const ray &r, interval ray_t) const {
+            return spheres->occluded(r, ray_t);
+        }
+
+        // Class of the material hit
+        material_type type(const hit_record &rec) const { return materials.type(rec.material_id); }
+
+        // Light given off at the hit
+        color emitted(const hit_record &rec) const { return materials.emitted(rec.material_id, rec); }
+
+        // Albedo at a hit on a lambertian material
+        color lambertian_albedo(const hit_record &rec) const { return materials.lambertian_albedo(rec.material_id); }
+
+        // Scatters a ray off the material hit
+        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &gen) const {
+            return materials.scatter(rec.material_id, r_in, rec, attenuation, scattered, gen);
+        }
+
+        // Box enclosing the whole scene
+        aabb bounding_box() const { return spheres->bounding_box(); }
+
+        // The spheres of the scene
+        const sphere_batch &batch() const { return *spheres; }
+
+        // The emitting spheres, sampled directly by the path integrator
+        const light_list &lights() const { return emitters; }
+
+        // Finds the lights again after spheres of the batch were moved
+        void update_lights() { emitters = light_list(*spheres); }
+
+    private:
+        shared_ptr<sphere_batch> spheres;
+        material_table materials;
+        light_list emitters;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "color.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+ * In-memory HDR image: linear RGB radiance stored as 32-bit floats, interleaved,
+ * rows from top to bottom. The camera renders into it; the writers in image_writer.h
+ * turn it into files afterwards.
+ */
+class framebuffer {
+    public:
+        framebuffer() {} // Default constructor (empty image)
+
+        framebuffer(int width, int height) // Creates a black image of the given size
+            : w(width), h(height), pixels(static_cast<size_t>(width) * height * 3, 0.0f) {}
+
+        int width() const { return w; }
+        int height() const { return h; }
+
+        // Raw access to the interleaved RGB floats
+        float *data() { return pixels.data(); }
+        const float *data() const { return pixels.data(); }
+
+        // Returns the color of the pixel at column x, row y
+        color get(int x, int y) const {
+            const float *p = &pixels[index(x, y)];
+            return color(p[0], p[1], p[2]);
+        }
+
+        // Sets the color of the pixel at column x, row y
+        void set(int x, int y, const color &c) {
+            float *p = &pixels[index(x, y)];
+            p[0] = static_cast<float>(c.x());
+            p[1] = static_cast<float>(c.y());
+            p[2] = static_cast<float>(c.z());
+        }
+
+        /*
+         * Converts rows [first_row, first_row + row_count) to 8-bit gamma-corrected RGB.
+         * Gamma, clamping and quantization happen in one branch-free loop over the float
+         * components that the compiler can vectorize.
+         */
+        void to_rgb8(int first_row, int row_count, uint8_t *out) const {
+            const float *in = &pixels[index(0, first_row)];
+            size_t count = static_cast<size_t>(w) * row_count * 3;
+            quantize(in, count, out);
+        }
+
+        // Gamma-corrects and quantizes `count` linear floats to bytes (same mapping as linear_to_gamma)
+        static void quantize(const float *in, size_t count, uint8_t *out) {
+            for (size_t i = 0; i < count; i++) {
+                float v = in[i];
+                v = v > 0.0f ? v : 0.0f;        // Also maps NaN to black
+                v = v < 1.0f ? v : 1.0f;
+                v = std::sqrt(v);
+                v = 256.0f * (v < 0.999f ? v : 0.999f);
+                out[i] = static_cast<uint8_t>(v);
+            }
+        }
+
+        /*
+         * Root mean square difference of two images of the same size as they are displayed, after
+         * gamma correction and clamping, over all components (0 = identical, 1 = black vs white).
+         */
+        static double display_rmse(const framebuffer &a, const framebuffer &b) {
+            double sum = 0;
+            for (size_t i = 0; i < a.pixels.size(); i++) {
+                double d = display_value(a.pixels[i]) - display_value(b.pixels[i]);
+                sum += d * d;
+            }
+            return a.pixels.empty() ? 0 : std::sqrt(sum / a.pixels.size());
+        }
+
+    private:
+        int w = 0, h = 0;
+        std::vector<float> pixels;
+
+        static double display_value(float v) {
+            return std::sqrt(v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f);
+        }
+
+        size_t index(int x, int y) const {
+            return (static_cast<size_t>(y) * w + x) * 3;
+        }
+};
+
+#endif
\ No newline at end of file
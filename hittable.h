@@ -2,6 +2,7 @@
 #define HITTABLE_H
 
 #include "utils.h"
+#include "aabb.h"
 
 class material;
 
@@ -9,9 +10,11 @@ class hit_record {
     public:
         point3 p;                   // The point at which the ray hits the object
         vec3 normal;                // The normal vector at the hit point
-        shared_ptr<material> mat;   // Pointer to the material of the object hit
-        double t;                   // The parameter t from the ray equation that gives the hit point
+        const material *mat;        // Material of the object hit, owned by the object
+        uint32_t material_id;       // Index of the material in the scene's material table (flat_scene only)
+        real t;                     // The parameter t from the ray equation that gives the hit point
         bool front_face;            // True if the ray hits the front face of the object
+        real error = 0;             // Bound on the rounding error of each coordinate of p
 
         /*
          *  Sets the hit record's normal vector and `front_face` flag
@@ -23,6 +26,16 @@ class hit_record {
             // Adjust normal to always point against ray direction
             normal = front_face ? outward_normal : -outward_normal;
         }
+
+        /*
+         * Returns a ray leaving the hit point in `direction`. Its origin is pushed off the surface,
+         * to the side the ray leaves on, by more than the error of p, so the ray cannot hit the
+         * surface it starts on again however large the scene's coordinates are.
+         */
+        ray spawn_ray(const vec3 &direction) const {
+            real offset = error * (std::fabs(normal.x()) + std::fabs(normal.y()) + std::fabs(normal.z()));
+            return ray(dot(direction, normal) < 0 ? p - offset * normal : p + offset * normal, direction);
+        }
 };
 
 // Abstract base class for hittable objects
@@ -34,6 +47,19 @@ class hittable {
 
         // Pure virtual method for determining if an object-ray intersection happens within the interval
         virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
+
+        /*
+         * True if the ray hits anything within the interval (any hit, not the nearest): shadow
+         * rays only need to know whether the way to a light is blocked. Objects override it to
+         * stop at the first intersection found and skip filling a hit record.
+         */
+        virtual bool occluded(const ray &r, interval ray_t) const {
+            hit_record rec;
+            return hit(r, ray_t, rec);
+        }
+
+        // Pure virtual method returning the axis-aligned box enclosing the whole object
+        virtual aabb bounding_box() const = 0;
 };
 
 #endif
\ No newline at end of file
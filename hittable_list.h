@@ -2,6 +2,7 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.h"
+#include "stats.h"
 #include <memory>
 #include <vector>
 
@@ -10,7 +11,7 @@ using std::shared_ptr;
 
 class hittable_list : public hittable {
     public:
-        // Container for holding shared pointers to hittable objects
+        // Container for holding shared pointers to hittable objects; non-owning ones (see `unowned`) are allowed
         std::vector<shared_ptr<hittable>> objects;
 
         // Default constructor
@@ -20,15 +21,25 @@ class hittable_list : public hittable {
         hittable_list(shared_ptr<hittable> object) { add(object); }
 
         // Clears list
-        void clear() { objects.clear(); }
+        void clear() {
+            objects.clear();
+            bbox = aabb();
+        }
 
-        // Adds new object to list
+        // Adds new object to list and grows the bounding box to enclose it
         void add(shared_ptr<hittable> object) {
             objects.push_back(object);
+            bbox = aabb(bbox, object->bounding_box());
+        }
+
+        // Adds an object owned elsewhere, e.g. by a scene_arena; the list does not keep it alive
+        void add(hittable *object) {
+            add(unowned(object));
         }
 
         // Checks if a ray hits any object in the list
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
             hit_record temp_rec;
             bool hit_anything = false;
             auto closest_so_far = ray_t.max;
@@ -43,6 +54,31 @@ class hittable_list : public hittable {
 
             return hit_anything;
         }
+
+        // Checks if a ray hits any object in the list, stopping at the first one
+        bool occluded(const ray &r, interval ray_t) const override {
+            for (const auto &object : objects)
+                if (object->occluded(r, ray_t))
+                    return true;
+            return false;
+        }
+
+        // Returns the box enclosing every object in the list
+        aabb bounding_box() const override { return bbox; }
+
+        // Hash of the objects' bounding boxes, identifies the geometry of a scene (materials are not covered)
+        uint64_t fingerprint() const {
+            uint64_t hash = fnv_offset_basis;
+            for (const auto &object : objects) {
+                aabb box = object->bounding_box();
+                double bounds[6] = {box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max};
+                hash = hash_bytes(hash, bounds, sizeof(bounds));
+            }
+            return hash;
+        }
+
+    private:
+        aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,400 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Supported output file formats
+enum class image_format {
+    ppm,    // Binary 8-bit PPM (P6), gamma corrected
+    pfm,    // Portable float map, linear HDR radiance
+    png     // 8-bit RGB PNG, gamma corrected
+};
+
+/*
+ * Minimal DEFLATE compressor (RFC 1951) using the fixed Huffman code and greedy LZ77 matching
+ * with a single-entry hash table. Input can be fed in pieces: every call emits one block and keeps
+ * the last 32 KiB as match history, so callers can compress a stream without holding all of it.
+ */
+class deflate_encoder {
+    public:
+        deflate_encoder() : head(hash_size, -1) {}
+
+        // Compresses the next piece of input; `final` marks the last piece and flushes the stream
+        void compress(const uint8_t *data, size_t size, bool final) {
+            window.insert(window.end(), data, data + size);
+            long long end = window_start + static_cast<long long>(window.size());
+
+            // Keep a full match length of lookahead unless this is the end of the stream
+            long long limit = final ? end : end - max_match;
+
+            put_bits(final ? 1 : 0, 1);
+            put_bits(1, 2); // Block compressed with the fixed Huffman code
+
+            while (pos < limit) {
+                size_t i = static_cast<size_t>(pos - window_start);
+                int best_length = 0;
+                long long best_distance = 0;
+
+                if (end - pos >= min_match) {
+                    uint32_t h = hash(&window[i]);
+                    long long candidate = head[h];
+                    head[h] = pos;
+
+                    if (candidate >= window_start && pos - candidate <= max_distance) {
+                        size_t j = static_cast<size_t>(candidate - window_start);
+                        int max_length = static_cast<int>(std::min<long long>(max_match, end - pos));
+                        int length = 0;
+                        while (length < max_length && window[i + length] == window[j + length])
+                            length++;
+                        if (length >= min_match) {
+                            best_length = length;
+                            best_distance = pos - candidate;
+                        }
+                    }
+                }
+
+                if (best_length == 0) {
+                    put_literal(window[i]);
+                    pos++;
+                    continue;
+                }
+
+                put_match(best_length, static_cast<int>(best_distance));
+
+                // Index the positions covered by the match so later data can refer to them
+                for (long long p = pos + 1; p < pos + best_length && end - p >= min_match; p++)
+                    head[hash(&window[static_cast<size_t>(p - window_start)])] = p;
+                pos += best_length;
+            }
+
+            put_literal(256); // End of block
+
+            if (final && bit_count > 0)
+                put_bits(0, 8 - bit_count); // Pad to a byte boundary
+
+            // Drop history that can no longer be referenced
+            long long keep_from = std::max(window_start, std::min(pos, end) - max_distance);
+            window.erase(window.begin(), window.begin() + static_cast<size_t>(keep_from - window_start));
+            window_start = keep_from;
+        }
+
+        // Compressed bytes produced so far and not yet taken by the caller
+        std::vector<uint8_t> &output() { return out; }
+
+    private:
+        static const int hash_bits = 15;
+        static const int hash_size = 1 << hash_bits;
+        static const int min_match = 3;
+        static const int max_match = 258;
+        static const int max_distance = 32768;
+
+        std::vector<uint8_t> window;      // Match history followed by input not encoded yet
+        long long window_start = 0;       // Stream position of window[0]
+        long long pos = 0;                // Stream position of the next byte to encode
+        std::vector<long long> head;      // Most recent stream position of each 3-byte hash
+
+        std::vector<uint8_t> out;
+        uint64_t bit_buffer = 0;
+        int bit_count = 0;
+
+        static uint32_t hash(const uint8_t *p) {
+            uint32_t v = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+            return (v * 2654435761u) >> (32 - hash_bits);
+        }
+
+        // Appends `count` bits of `value`, least significant bit first
+        void put_bits(uint32_t value, int count) {
+            bit_buffer |= static_cast<uint64_t>(value) << bit_count;
+            bit_count += count;
+            while (bit_count >= 8) {
+                out.push_back(static_cast<uint8_t>(bit_buffer));
+                bit_buffer >>= 8;
+                bit_count -= 8;
+            }
+        }
+
+        // Appends a Huffman code, which DEFLATE stores most significant bit first
+        void put_code(uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int b = 0; b < length; b++)
+                reversed |= ((code >> b) & 1) << (length - 1 - b);
+            put_bits(reversed, length);
+        }
+
+        // Appends a literal/length symbol with its fixed Huffman code
+        void put_literal(int symbol) {
+            if (symbol <= 143)
+                put_code(0x30 + symbol, 8);
+            else if (symbol <= 255)
+                put_code(0x190 + symbol - 144, 9);
+            else if (symbol <= 279)
+                put_code(symbol - 256, 7);
+            else
+                put_code(0xC0 + symbol - 280, 8);
+        }
+
+        // Appends a (length, distance) back reference
+        void put_match(int length, int distance) {
+            static const int length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                                35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+            static const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                                 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+            static const int distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                                  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                                  8193, 12289, 16385, 24577};
+            static const int distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                                   7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+            int l = 28;
+            while (length_base[l] > length)
+                l--;
+            put_literal(257 + l);
+            put_bits(length - length_base[l], length_extra[l]);
+
+            int d = 29;
+            while (distance_base[d] > distance)
+                d--;
+            put_code(d, 5);
+            put_bits(distance - distance_base[d], distance_extra[d]);
+        }
+};
+
+/*
+ * PNG encoder for 8-bit RGB images that accepts rows incrementally.
+ * Every batch of rows is filtered, compressed and written out as its own IDAT chunk,
+ * so only the rows of the current batch are ever held in memory.
+ */
+class png_stream_writer {
+    public:
+        // Writes the PNG signature and header
+        png_stream_writer(std::ostream &out, int width, int height) : out(out), width(width) {
+            static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+            out.write(reinterpret_cast<const char *>(signature), 8);
+
+            uint8_t header[13];
+            put_u32(header, static_cast<uint32_t>(width));
+            put_u32(header + 4, static_cast<uint32_t>(height));
+            header[8] = 8;   // Bit depth
+            header[9] = 2;   // Color type: RGB
+            header[10] = 0;  // Compression method
+            header[11] = 0;  // Filter method
+            header[12] = 0;  // No interlacing
+            write_chunk("IHDR", header, sizeof(header));
+
+            // zlib stream header: deflate with a 32 KiB window, no preset dictionary
+            encoder.output().push_back(0x78);
+            encoder.output().push_back(0x01);
+        }
+
+        // Appends `row_count` rows of packed 8-bit RGB pixels
+        void write_rows(const uint8_t *rgb, int row_count) {
+            size_t row_bytes = static_cast<size_t>(width) * 3;
+            filtered.resize((row_bytes + 1) * row_count);
+
+            // "Sub" filter: store each byte as the difference to the same channel of the pixel on its left
+            for (int y = 0; y < row_count; y++) {
+                const uint8_t *row = rgb + y * row_bytes;
+                uint8_t *dst = &filtered[y * (row_bytes + 1)];
+                dst[0] = 1;
+                for (size_t i = 0; i < row_bytes; i++)
+                    dst[1 + i] = static_cast<uint8_t>(row[i] - (i >= 3 ? row[i - 3] : 0));
+            }
+
+            adler = adler32(adler, filtered.data(), filtered.size());
+            encoder.compress(filtered.data(), filtered.size(), false);
+            flush_idat();
+        }
+
+        // Terminates the compressed stream and writes the end chunk
+        void finish() {
+            encoder.compress(nullptr, 0, true);
+            uint8_t checksum[4];
+            put_u32(checksum, adler);
+            encoder.output().insert(encoder.output().end(), checksum, checksum + 4);
+            flush_idat();
+            write_chunk("IEND", nullptr, 0);
+            out.flush();
+        }
+
+    private:
+        std::ostream &out;
+        int width;
+        deflate_encoder encoder;
+        std::vector<uint8_t> filtered;  // Filtered scanlines of the current batch
+        uint32_t adler = 1;             // Adler-32 of the uncompressed zlib payload
+
+        // Writes the pending compressed bytes as an IDAT chunk
+        void flush_idat() {
+            auto &data = encoder.output();
+            if (data.empty())
+                return;
+            write_chunk("IDAT", data.data(), data.size());
+            data.clear();
+        }
+
+        void write_chunk(const char *type, const uint8_t *data, size_t size) {
+            uint8_t length[4];
+            put_u32(length, static_cast<uint32_t>(size));
+            out.write(reinterpret_cast<const char *>(length), 4);
+            out.write(type, 4);
+            if (size > 0)
+                out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+
+            uint32_t crc = crc32(0xFFFFFFFFu, reinterpret_cast<const uint8_t *>(type), 4);
+            crc = crc32(crc, data, size) ^ 0xFFFFFFFFu;
+            uint8_t crc_bytes[4];
+            put_u32(crc_bytes, crc);
+            out.write(reinterpret_cast<const char *>(crc_bytes), 4);
+        }
+
+        // Stores a 32-bit value big-endian
+        static void put_u32(uint8_t *p, uint32_t v) {
+            p[0] = static_cast<uint8_t>(v >> 24);
+            p[1] = static_cast<uint8_t>(v >> 16);
+            p[2] = static_cast<uint8_t>(v >> 8);
+            p[3] = static_cast<uint8_t>(v);
+        }
+
+        static std::array<uint32_t, 256> make_crc_table() {
+            std::array<uint32_t, 256> table;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                table[n] = c;
+            }
+            return table;
+        }
+
+        static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+            static const std::array<uint32_t, 256> table = make_crc_table();
+            for (size_t i = 0; i < size; i++)
+                crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            return crc;
+        }
+
+        static uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size) {
+            uint32_t a = adler & 0xFFFF, b = adler >> 16;
+            while (size > 0) {
+                size_t chunk = std::min<size_t>(size, 5552); // Largest run that cannot overflow before the modulo
+                for (size_t i = 0; i < chunk; i++) {
+                    a += data[i];
+                    b += a;
+                }
+                a %= 65521;
+                b %= 65521;
+                data += chunk;
+                size -= chunk;
+            }
+            return (b << 16) | a;
+        }
+};
+
+// Writes the image as binary PPM (P6) with one bulk write
+inline void write_ppm(std::ostream &out, const framebuffer &image) {
+    std::vector<uint8_t> bytes(static_cast<size_t>(image.width()) * image.height() * 3);
+    image.to_rgb8(0, image.height(), bytes.data());
+
+    out << "P6\n" << image.width() << ' ' << image.height() << "\n255\n";
+    out.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    out.flush();
+}
+
+// Writes the linear radiance as a little-endian PFM (rows stored bottom to top, as the format requires)
+inline void write_pfm(std::ostream &out, const framebuffer &image) {
+    size_t row_floats = static_cast<size_t>(image.width()) * 3;
+    std::vector<float> flipped(row_floats * image.height());
+    for (int y = 0; y < image.height(); y++)
+        std::memcpy(&flipped[(image.height() - 1 - y) * row_floats], image.data() + y * row_floats,
+                    row_floats * sizeof(float));
+
+    out << "PF\n" << image.width() << ' ' << image.height() << "\n-1.0\n";
+    out.write(reinterpret_cast<const char *>(flipped.data()),
+              static_cast<std::streamsize>(flipped.size() * sizeof(float)));
+    out.flush();
+}
+
+// Writes the image as an 8-bit RGB PNG
+inline void write_png(std::ostream &out, const framebuffer &image) {
+    std::vector<uint8_t> bytes(static_cast<size_t>(image.width()) * image.height() * 3);
+    image.to_rgb8(0, image.height(), bytes.data());
+
+    png_stream_writer png(out, image.width(), image.height());
+    png.write_rows(bytes.data(), image.height());
+    png.finish();
+}
+
+/*
+ * Writes an image in any image_format from bands of rows handed over one after another, so an
+ * image of any size can be written with a single band in memory. PPM and PNG store their rows
+ * top to bottom and PFM bottom to top: PFM bands must come bottom band first (see
+ * rows_bottom_up), the rows inside a band are put in file order here.
+ */
+class image_stream_writer {
+    public:
+        // Writes the header of a `width` x `height` image
+        image_stream_writer(std::ostream &out, int width, int height, image_format format)
+            : out(out), width(width), format(format) {
+            if (format == image_format::png)
+                png.reset(new png_stream_writer(out, width, height));
+            else if (format == image_format::ppm)
+                out << "P6\n" << width << ' ' << height << "\n255\n";
+            else
+                out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+        }
+
+        // True if the bands of `format` are written from the bottom of the image up
+        static bool rows_bottom_up(image_format format) { return format == image_format::pfm; }
+
+        // Appends the rows of `band`, `width` pixels of linear radiance wide
+        void write_band(const framebuffer &band) {
+            if (format == image_format::pfm) {
+                size_t row_floats = static_cast<size_t>(width) * 3;
+                for (int y = band.height() - 1; y >= 0; y--)
+                    out.write(reinterpret_cast<const char *>(band.data() + y * row_floats),
+                              static_cast<std::streamsize>(row_floats * sizeof(float)));
+                return;
+            }
+            bytes.resize(static_cast<size_t>(width) * band.height() * 3);
+            band.to_rgb8(0, band.height(), bytes.data());
+            if (png)
+                png->write_rows(bytes.data(), band.height());
+            else
+                out.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        }
+
+        // Ends the file once every row was written
+        void finish() {
+            if (png)
+                png->finish();
+            else
+                out.flush();
+        }
+
+    private:
+        std::ostream &out;
+        int width;
+        image_format format;
+        std::unique_ptr<png_stream_writer> png;
+        std::vector<uint8_t> bytes;     // 8-bit rows of the current band
+};
+
+// Writes the image in the requested format
+inline void write_image(std::ostream &out, const framebuffer &image, image_format format) {
+    switch (format) {
+        case image_format::ppm: write_ppm(out, image); break;
+        case image_format::pfm: write_pfm(out, image); break;
+        case image_format::png: write_png(out, image); break;
+    }
+}
+
+#endif
\ No newline at end of file
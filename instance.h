@@ -0,0 +1,186 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "utils.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "stats.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Moves a hit found on an object-space ray back to world space: `to_world` places the object and
+ * `to_object` is its inverse. Normals go through the inverse transpose, so they stay perpendicular
+ * to the surface under non-uniform scaling and keep facing against the ray. The point's error
+ * bound grows by the rounding of the transform and of the inversion.
+ */
+inline void hit_to_world(const affine_transform &to_world, const affine_transform &to_object, hit_record &rec) {
+    const point3 p = rec.p;
+    real error = 0;
+    for (int i = 0; i < 3; i++) {
+        real linear = 0, magnitude = std::fabs(to_world.m[i][3]);
+        for (int j = 0; j < 3; j++) {
+            linear += std::fabs(to_world.m[i][j]);
+            magnitude += std::fabs(to_world.m[i][j] * p[j]);
+        }
+        error = std::max(error, (1 + rounding_error_bound(5)) * linear * rec.error + rounding_error_bound(5) * magnitude);
+    }
+
+    rec.p = to_world.point(p);
+    rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+    rec.error = error;
+}
+
+// An object placed in the scene by an affine transform, e.g. one of many copies of a shared mesh
+class instance : public hittable {
+    public:
+        // Places `object` (kept shared, not copied) by `to_world`; throws if the transform is singular
+        instance(shared_ptr<hittable> object, const affine_transform &to_world)
+            : object(object), to_world(to_world), to_object(to_world.inverse()),
+              bbox(to_world.box(object->bounding_box())) {}
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
+            if (!object->hit(to_object.apply(r), ray_t, rec))
+                return false;
+            hit_to_world(to_world, to_object, rec);
+            return true;
+        }
+
+        // Distances along the ray are the same in object space, so ray_t carries over
+        bool occluded(const ray &r, interval ray_t) const override {
+            return object->occluded(to_object.apply(r), ray_t);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        shared_ptr<hittable> object;
+        affine_transform to_world, to_object;
+        aabb bbox;
+};
+
+/*
+ * Two-level acceleration structure for scenes made of many copies of a few objects.
+ * The bottom level is the prototypes: shared objects with their own acceleration structure
+ * (a triangle_mesh, a bvh_node over a list, ...). The top level is a BVH over the instances,
+ * each of which is only a prototype index and a world-to-object transform, stored in BVH
+ * leaf order; a hit transforms the ray into the instance's object space and asks its prototype.
+ * Memory therefore grows with the number of instances by a transform, an index and a share of
+ * the top-level tree each, whatever the size of the prototypes.
+ */
+class instance_group : public hittable {
+    public:
+        instance_group() {} // Default constructor
+
+        // Adds a prototype and returns its index for `add`
+        int add_prototype(shared_ptr<hittable> object) {
+            prototypes.push_back(object);
+            prototype_boxes.push_back(object->bounding_box());
+            return static_cast<int>(prototypes.size() - 1);
+        }
+
+        // Places a copy of prototype `prototype` by `to_world`; throws if the transform is singular
+        void add(int prototype, const affine_transform &to_world) {
+            if (prototype < 0 || prototype >= static_cast<int>(prototypes.size()))
+                throw std::out_of_range("instance_group: no prototype " + std::to_string(prototype));
+            to_object.push_back(to_world.inverse());
+            prototype_ids.push_back(static_cast<uint32_t>(prototype));
+            bbox = aabb(bbox, to_world.box(prototype_boxes[prototype]));
+            tree = bvh_tree();
+        }
+
+        int size() const { return static_cast<int>(prototype_ids.size()); }
+
+        // True once build_bvh has run (and no instance was added since)
+        bool has_bvh() const { return !tree.empty(); }
+
+        /*
+         * Builds the top-level BVH and reorders the instances into leaf order.
+         * Without it `hit` tests every instance.
+         */
+        void build_bvh() {
+            std::vector<aabb> boxes(prototype_ids.size());
+            for (size_t i = 0; i < boxes.size(); i++)
+                boxes[i] = to_object[i].inverse().box(prototype_boxes[prototype_ids[i]]);
+            tree.build(boxes, 2);
+            boxes = std::vector<aabb>();
+
+            permute(to_object, tree.indices);
+            permute(prototype_ids, tree.indices);
+            for (size_t i = 0; i < tree.indices.size(); i++)
+                tree.indices[i] = static_cast<int>(i);
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
+            int closest_instance = -1;
+            auto hit_instances = [&](int first, int count, real &closest_so_far) {
+                bool hit_anything = false;
+                for (int i = first; i < first + count; i++) {
+                    if (prototypes[prototype_ids[i]]->hit(to_object[i].apply(r), interval(ray_t.min, closest_so_far), rec)) {
+                        closest_so_far = rec.t;
+                        closest_instance = i;
+                        hit_anything = true;
+                    }
+                }
+                return hit_anything;
+            };
+
+            if (tree.empty()) {
+                real closest = ray_t.max;
+                hit_instances(0, size(), closest);
+            } else {
+                tree.intersect_leaves(r, ray_t, hit_instances);
+            }
+            if (closest_instance < 0)
+                return false;
+
+            const affine_transform &inverse = to_object[closest_instance];
+            hit_to_world(inverse.inverse(), inverse, rec);
+            return true;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override {
+            auto occludes = [&](int i) { return prototypes[prototype_ids[i]]->occluded(to_object[i].apply(r), ray_t); };
+            if (tree.empty()) {
+                for (int i = 0; i < size(); i++)
+                    if (occludes(i))
+                        return true;
+                return false;
+            }
+            return tree.occluded(r, ray_t, occludes);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Heap memory held by the top level: transforms, prototype indices and BVH
+        size_t memory_bytes() const {
+            return to_object.capacity() * sizeof(affine_transform) + prototype_ids.capacity() * sizeof(uint32_t)
+                 + tree.nodes.capacity() * sizeof(bvh_tree::node) + tree.indices.capacity() * sizeof(int);
+        }
+
+    private:
+        std::vector<shared_ptr<hittable>> prototypes;
+        std::vector<aabb> prototype_boxes;
+        std::vector<affine_transform> to_object;    // Per instance: world to object space
+        std::vector<uint32_t> prototype_ids;        // Per instance: index into `prototypes`
+        bvh_tree tree;
+        aabb bbox;
+
+        // Reorders `values` so that values[i] becomes old values[order[i]]
+        template <typename T>
+        static void permute(std::vector<T> &values, const std::vector<int> &order) {
+            std::vector<T> reordered(values.size());
+            for (size_t i = 0; i < order.size(); i++)
+                reordered[i] = values[order[i]];
+            values.swap(reordered);
+        }
+};
+
+#endif
\ No newline at end of file
@@ -5,24 +5,39 @@
 
 class interval {
     public:
-        double min, max;
+        real min, max;
 
         interval() : min(+infinity), max(-infinity) {} // Default constructor
 
-        interval(double _min, double _max) : min(_min), max(_max) {} // Parametrized constructor
+        interval(real _min, real _max) : min(_min), max(_max) {} // Parametrized constructor
+
+        // Creates the tightest interval enclosing both given intervals
+        interval(const interval &a, const interval &b)
+            : min(a.min <= b.min ? a.min : b.min), max(a.max >= b.max ? a.max : b.max) {}
+
+        // Returns the length of the interval
+        real size() const {
+            return max - min;
+        }
+
+        // Returns a copy of the interval padded by `delta` in total
+        interval expand(real delta) const {
+            auto padding = delta / 2;
+            return interval(min - padding, max + padding);
+        }
 
         // Checks if the interval contains a given value (inclusive of the bounds)
-        bool contains(double x) const {
+        bool contains(real x) const {
             return min <= x && x <= max;
         }
 
         // Checks if the interval surrounds a given value (exclusive of the bounds)
-        bool surrounds(double x) const {
+        bool surrounds(real x) const {
             return min < x && x < max;
         }
 
         // Clamps a given value to be within the interval's bounds
-        double clamp(double x) const {
+        real clamp(real x) const {
             if (x < min)
                 return min;
             if (x > max)
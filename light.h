@@ -0,0 +1,161 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Direction toward a light picked by light_list::sample
+struct light_sample {
+    vec3 direction;     // Unit vector from the shaded point toward the light
+    real distance;      // Distance to the light's surface along `direction`
+    color emission;     // Radiance the light sends back along it
+    double pdf;         // Probability density of the direction, per unit solid angle
+};
+
+/*
+ * The emitting spheres of a scene, for next-event estimation: a path at a diffuse surface picks
+ * one light, with a probability proportional to its power, and a direction uniformly inside
+ * the cone the sphere subtends from the surface (Shirley et al. 1996), so only the side of the
+ * light that can be seen is ever aimed at. `pdf` gives the density of that strategy for a light
+ * found by scattering instead, which the integrator needs to weigh the two strategies (multiple
+ * importance sampling).
+ */
+class light_list {
+    public:
+        light_list() {} // Default constructor
+
+        /*
+         * Lights of the spheres of `list` with a diffuse_light material (other objects are not
+         * searched). Only the exact class counts (see material::type): a derived one may emit
+         * something other than get_emission(), and its hits are shaded through emitted().
+         */
+        explicit light_list(const hittable_list &list) {
+            for (const auto &object : list.objects) {
+                auto s = std::dynamic_pointer_cast<sphere>(object);
+                if (!s || s->get_material()->type() != material_type::light)
+                    continue;
+                add(s->get_center(), s->get_radius(), static_cast<const diffuse_light &>(*s->get_material()).get_emission());
+            }
+        }
+
+        // Lights of the spheres of `batch` with a diffuse_light material, the exact class as well
+        explicit light_list(const sphere_batch &batch) {
+            const auto &materials = batch.get_materials();
+            std::vector<const diffuse_light *> emitters(materials.size());
+            bool any = false;
+            for (size_t id = 0; id < materials.size(); id++) {
+                if (materials[id]->type() == material_type::light)
+                    emitters[id] = static_cast<const diffuse_light *>(materials[id].get());
+                any = any || emitters[id];
+            }
+            for (int n = 0; any && n < batch.size(); n++) {
+                if (const diffuse_light *light = emitters[batch.get_material_id(n)])
+                    add(batch.get_center(n), batch.get_radius(n), light->get_emission());
+            }
+        }
+
+        // Adds a spherical light; lights without power are left out
+        void add(const point3 &center, real radius, const color &emission) {
+            double power = luminance(emission) * radius * radius;
+            if (!(power > 0))
+                return;
+            lights.push_back(sphere_light{center, radius, emission});
+            total_power += power;
+            cumulative_power.push_back(total_power);
+        }
+
+        bool empty() const { return lights.empty(); }
+        int size() const { return static_cast<int>(lights.size()); }
+
+        /*
+         * Picks a light and a direction toward it from `p`, drawing two dimensions of `gen` for
+         * the direction and then one for the light. Returns false when there is no light or `p`
+         * is inside the one picked.
+         */
+        bool sample(const point3 &p, rng &gen, light_sample &s) const {
+            if (lights.empty())
+                return false;
+            double u = random_double(gen), v = random_double(gen);
+            double pick = random_double(gen) * total_power;
+            int i = static_cast<int>(std::upper_bound(cumulative_power.begin(), cumulative_power.end(), pick)
+                                     - cumulative_power.begin());
+            i = std::min(i, size() - 1);
+            const sphere_light &light = lights[i];
+
+            vec3 to_center = light.center - p;
+            double distance_squared = to_center.length_squared();
+            double radius_squared = static_cast<double>(light.radius) * light.radius;
+            if (distance_squared <= radius_squared)
+                return false;
+
+            // Uniform in the cone, by cos(theta) from 1 down to cos(theta_max)
+            double cone = cone_size(distance_squared, radius_squared);
+            double cos_theta = 1 - u * cone;
+            double sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+            double phi = 2 * pi * v;
+            double distance = std::sqrt(distance_squared);
+            vec3 w = to_center / static_cast<real>(distance);
+            vec3 a = std::fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+            vec3 x_axis = unit_vector(cross(w, a));
+            vec3 y_axis = cross(w, x_axis);
+            s.direction = static_cast<real>(sin_theta * std::cos(phi)) * x_axis
+                        + static_cast<real>(sin_theta * std::sin(phi)) * y_axis + static_cast<real>(cos_theta) * w;
+
+            // Near intersection with the sphere; the discriminant is only negative by rounding at the rim
+            double discriminant = radius_squared - distance_squared * sin_theta * sin_theta;
+            s.distance = static_cast<real>(distance * cos_theta - std::sqrt(std::max(0.0, discriminant)));
+            s.emission = light.emission;
+            s.pdf = probability(i) / (2 * pi * cone);
+            return true;
+        }
+
+        /*
+         * Density, per unit solid angle, with which `sample` picks the direction from `p` to
+         * `light_point`, a point on the visible side of one of the lights; 0 if it is on none.
+         */
+        double pdf(const point3 &p, const point3 &light_point) const {
+            for (int i = 0; i < size(); i++) {
+                const sphere_light &light = lights[i];
+                double radius_squared = static_cast<double>(light.radius) * light.radius;
+                double off_surface = (light_point - light.center).length_squared() - radius_squared;
+                if (std::fabs(off_surface) > 1e-3 * radius_squared)
+                    continue;
+                double distance_squared = (light.center - p).length_squared();
+                if (distance_squared <= radius_squared)
+                    return 0;
+                return probability(i) / (2 * pi * cone_size(distance_squared, radius_squared));
+            }
+            return 0;
+        }
+
+    private:
+        struct sphere_light {
+            point3 center;
+            real radius;
+            color emission;
+        };
+
+        std::vector<sphere_light> lights;
+        std::vector<double> cumulative_power;   // Power of the lights up to and including each one
+        double total_power = 0;
+
+        double probability(int i) const {
+            return (cumulative_power[i] - (i > 0 ? cumulative_power[i - 1] : 0)) / total_power;
+        }
+
+        // 1 - cos(theta_max) of the cone a sphere subtends, without cancellation for distant lights
+        static double cone_size(double distance_squared, double radius_squared) {
+            double ratio = radius_squared / distance_squared;
+            return ratio / (1 + std::sqrt(1 - ratio));
+        }
+};
+
+#endif
\ No newline at end of file
@@ -1,73 +1,310 @@
 #include "utils.h"
+#include "animation.h"
+#include "arena.h"
 #include "camera.h"
-#include "color.h"
-#include "hittable_list.h"
-#include "material.h"
-#include "sphere.h"
-
-int main() {
-    hittable_list world; // Create a list to hold all hittable objects
-
-    // Create and add a large sphere as the ground
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    // Generate smaller spheres with random positions and materials
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-            // Only add sphere if it's sufficiently far from (4, 0.2, 0)
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // Diffuse material with random color
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // Metal material with random color and fuzziness
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // Glass material
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
+#include "demo_scene.h"
+#include "distributed.h"
+#include "flat_scene.h"
+#include "obj_file.h"
+#include "render_server.h"
+#include "scene_cache.h"
+#include "scene_file.h"
+#include "stream_renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Looks at `box` from the front, slightly above and to the side, so the whole box is in view
+static void frame_box(camera &cam, const aabb &box) {
+    point3 center(box.x.min + box.x.size() / 2, box.y.min + box.y.size() / 2, box.z.min + box.z.size() / 2);
+    double radius = 0.5 * std::sqrt(box.x.size() * box.x.size() + box.y.size() * box.y.size()
+                                    + box.z.size() * box.z.size());
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.vfov = 40;
+    cam.lookat = center;
+    cam.lookfrom = center + 3 * radius * unit_vector(vec3(0.5, 0.4, 1));
+    cam.vup = vec3(0, 1, 0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = 3 * radius;
+}
+
+int main(int argc, char **argv) {
+    /*
+     * Command line:
+     *   --scene <file>       render a scene file (cached next to it as <file>.cache) instead of the demo scene
+     *   --save-scene <file>  write the demo scene as a scene file and exit
+     *   --mesh <file>        preview an OBJ mesh (small image, few samples) instead of the demo scene
+     *   --resume             continue from the last checkpoint (with --sequence: skip frames already written)
+     *   --stats <file>       write render statistics as JSON
+     *   --cost-map <file>    write a heatmap of the time spent per pixel
+     *   --workers <count>    render with this many local worker processes (see distributed.h)
+     *   --worker-command <c> also render with a worker started by the shell command c, e.g. over ssh
+     *   --worker             render the jobs sent on stdin and answer on stdout, as a worker
+     *   --sequence <pattern> render every frame of the scene file's animation, to files named by
+     *                        the pattern with its run of '#' replaced by the frame number
+     *   --denoise            take at most 32 samples per pixel and remove the noise with denoiser.h
+     *   --sampler <name>     take pixel, lens and scatter dimensions from the independent (default),
+     *                        stratified, sobol or blue-noise sequence (see sampler.h)
+     *   --no-light-sampling  find lights only by scattering into them, without shadow rays (see light.h)
+     *   --serve              keep running and render the jobs sent on stdin, answering on stdout
+     *                        (see render_server.h); the other options set the defaults of every job
+     *   --socket <path>      with --serve: take jobs from any number of clients on a Unix domain socket
+     *   --time <seconds>     render progressively, passes of 1, 1, 2, 4... samples per pixel, for this
+     *                        long instead of to a sample count, then write the image so far
+     *   --noise <error>      render progressively until the mean pixel error (gamma space) is below this
+     *   --preview <file>     write the image after every pass to this file or named pipe (progressive)
+     *   --stream             render in bands written out in order as they are done, holding only a
+     *                        few bands in memory, for images too large for it (see stream_renderer.h)
+     */
+    std::string scene_path, save_scene_path, mesh_path, stats_path, cost_map_path, sequence_pattern, socket_path;
+    bool resume = false, worker = false, denoise = false, sample_lights = true, serve = false, stream = false;
+    sampler_type sampling = sampler_type::independent;
+    int local_workers = 0;
+    std::vector<std::string> worker_args = {argv[0]};     // Same scene and settings, minus the worker options
+    std::vector<std::string> remote_commands;
+    double time_limit = 0, noise_target = 0;
+    std::string preview_path;
+    for (int arg = 1; arg < argc; arg++) {
+        if (std::strcmp(argv[arg], "--workers") == 0 && arg + 1 < argc) {
+            local_workers = std::atoi(argv[++arg]);
+            continue;
+        }
+        if (std::strcmp(argv[arg], "--worker-command") == 0 && arg + 1 < argc) {
+            remote_commands.push_back(argv[++arg]);
+            continue;
+        }
+        // Only the process writing the image stops early or shows previews, not its workers
+        if (std::strcmp(argv[arg], "--time") == 0 && arg + 1 < argc) {
+            time_limit = std::atof(argv[++arg]);
+            continue;
+        }
+        if (std::strcmp(argv[arg], "--noise") == 0 && arg + 1 < argc) {
+            noise_target = std::atof(argv[++arg]);
+            continue;
+        }
+        if (std::strcmp(argv[arg], "--preview") == 0 && arg + 1 < argc) {
+            preview_path = argv[++arg];
+            continue;
+        }
+
+        int option = arg;   // Every other option is passed on to local workers
+        if (std::strcmp(argv[arg], "--resume") == 0)
+            resume = true;
+        else if (std::strcmp(argv[arg], "--worker") == 0)
+            worker = true;
+        else if (std::strcmp(argv[arg], "--denoise") == 0)
+            denoise = true;
+        else if (std::strcmp(argv[arg], "--no-light-sampling") == 0)
+            sample_lights = false;
+        else if (std::strcmp(argv[arg], "--serve") == 0)
+            serve = true;
+        else if (std::strcmp(argv[arg], "--stream") == 0)
+            stream = true;
+        else if (std::strcmp(argv[arg], "--socket") == 0 && arg + 1 < argc)
+            socket_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--scene") == 0 && arg + 1 < argc)
+            scene_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--save-scene") == 0 && arg + 1 < argc)
+            save_scene_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--mesh") == 0 && arg + 1 < argc)
+            mesh_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--stats") == 0 && arg + 1 < argc)
+            stats_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--cost-map") == 0 && arg + 1 < argc)
+            cost_map_path = argv[++arg];
+        else if (std::strcmp(argv[arg], "--sequence") == 0 && arg + 1 < argc)
+            sequence_pattern = argv[++arg];
+        else if (std::strcmp(argv[arg], "--sampler") == 0 && arg + 1 < argc) {
+            if (!parse_sampler_type(argv[++arg], sampling)) {
+                std::cerr << "Unknown sampler " << argv[arg] << '\n';
+                return 1;
             }
         }
+        worker_args.insert(worker_args.end(), argv + option, argv + arg + 1);
     }
 
-    // Add three larger spheres to the scene
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    // Only camera::render runs the progressive passes; bands and worker jobs render to the sample count
+    if ((time_limit > 0 || noise_target > 0 || !preview_path.empty())
+        && (stream || local_workers > 0 || !remote_commands.empty())) {
+        std::cerr << "--time, --noise and --preview cannot be combined with --stream, --workers or --worker-command\n";
+        return 1;
+    }
 
-    // Configure the camera
+    // Configure the camera; a scene file can override the resolution, sample count and view
     camera cam;
 
-    cam.aspect_ratio = 16.0 / 9.0;
     cam.image_width = 1200;
     cam.samples_per_pixel = 500;            // High sample count for better antialiasing
+    cam.adaptive = true;                    // Stop sampling pixels early once they are noise-free
+    cam.num_threads = 0;                    // Render on all hardware threads
     cam.max_depth = 50;                     // Max ray bounce depth
+    cam.integrator = integrator_type::path; // Iterative paths with Russian roulette
+    cam.sampling = sampling;
+    cam.sample_lights = sample_lights;
 
-    cam.vfov = 20;                          // Vertical field of view in degrees
-    cam.lookfrom = point3(13, 2, 3);        // Camera position
-    cam.lookat = point3(0, 0, 0);           // Look at center of the scene
-    cam.vup = vec3(0, 1, 0);                // "Up" direction
+    // A server loads the scenes its jobs name and keeps them for the next jobs
+    if (serve) {
+        cam.denoise = denoise;
+        camera::stop_on_signals();
+        render_server server(cam);
+        try {
+            if (socket_path.empty())
+                return server.serve_stream() ? 0 : 1;
+            server.serve_socket(socket_path);
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+        return 0;
+    }
 
-    cam.defocus_angle = 0.6;                // Depth of field setting
-    cam.focus_dist = 10.0;                  // Focus distance
+    // Build the scene: a batch of spheres with a bounding volume hierarchy, or a triangle mesh
+    scene_arena arena;                      // Owns the demo scene's objects, freed together at exit
+    shared_ptr<sphere_batch> spheres;
+    hittable_list mesh_world;
+    animation anim;                         // Keyframes of the scene file, if any
+    uint64_t scene_hash = 0;
+    auto scene_start = std::chrono::steady_clock::now();
+    if (!mesh_path.empty()) {
+        try {
+            auto geometry = load_obj(mesh_path);
+            mesh_world.add(make_shared<triangle_mesh>(geometry, make_shared<lambertian>(color(0.7, 0.7, 0.7))));
+            std::clog << "Loaded " << geometry->triangle_count() << " triangles, "
+                      << geometry->memory_bytes() / (1 << 20) << " MiB\n";
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+        frame_box(cam, mesh_world.bounding_box());
+        cam.image_width = 480;              // Preview: small image, few samples, short paths
+        cam.samples_per_pixel = 16;
+        cam.max_depth = 8;
+        scene_hash = mesh_world.fingerprint();
+    } else if (scene_path.empty()) {
+        hittable_list list = demo_scene(default_rng(), &arena);
+        demo_view(cam);                     // Camera position and lens of the demo scene
 
-    // Render the scene
-    cam.render(world);
+        if (!save_scene_path.empty()) {
+            std::ofstream out(save_scene_path);
+            save_scene(out, list, cam);
+            return out ? 0 : 1;
+        }
+
+        scene_hash = list.fingerprint();    // Identifies the scene for checkpoints
+        spheres = make_shared<sphere_batch>(list);
+        spheres->build_bvh();
+    } else {
+        try {
+            bool from_cache = false;
+            spheres = load_scene_cached(scene_path, cam, scene_hash, from_cache, &anim);
+            std::clog << (from_cache ? "Loaded scene cache " : "Built scene cache ") << scene_path << ".cache\n";
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    }
+    std::unique_ptr<flat_scene> world;      // Materials by index, no virtual calls while tracing
+    if (spheres)
+        world.reset(new flat_scene(spheres));
+    auto scene_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - scene_start).count();
+
+    // Snapshot the accumulated samples every 5 minutes and on SIGTERM/SIGINT; "--resume" continues from it
+    cam.checkpoint_path = "render.ckpt";
+    cam.checkpoint_interval = 300;
+    cam.scene_hash = scene_hash;
+    cam.resume = resume;
+    cam.cost_map_path = cost_map_path;
+
+    // Progressive: the sample count only caps a render that stops at a time or noise level
+    if (time_limit > 0 || noise_target > 0 || !preview_path.empty()) {
+        cam.progressive = true;
+        cam.time_limit = time_limit;
+        cam.noise_target = noise_target;
+        cam.preview_path = preview_path;
+        if (time_limit > 0 || noise_target > 0)
+            cam.samples_per_pixel = 1 << 20;
+        if (noise_target > 0)
+            cam.adaptive_threshold = std::min(cam.adaptive_threshold, noise_target);
+    }
+    if (denoise) {
+        cam.denoise = true;
+        cam.samples_per_pixel = std::min(cam.samples_per_pixel, 32);
+    }
+    camera::stop_on_signals();
+
+    // A worker renders what it is sent until its coordinator closes its input
+    if (worker)
+        return (world ? serve_render_jobs(cam, *world) : serve_render_jobs(cam, mesh_world)) ? 0 : 1;
+
+    // Render the scene, with worker processes if any were asked for; an interrupted render writes no image
+    if (!sequence_pattern.empty()) {
+        if (!spheres) {
+            std::cerr << "--sequence needs a scene of spheres\n";
+            return 1;
+        }
+        sequence_renderer sequence;
+        sequence.output_pattern = sequence_pattern;
+        sequence.skip_existing = resume;
+        try {
+            bool finished = sequence.render(cam, spheres, anim);
+            cam.stats = sequence.stats;
+            if (!finished)
+                return 1;
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+        std::clog << "BVH refitted " << sequence.refits << " times, rebuilt " << sequence.rebuilds << " times\n";
+    } else if (stream) {
+        if (cam.denoise) {
+            std::cerr << "--stream cannot denoise, the denoiser needs the whole image\n";
+            return 1;
+        }
+        stream_renderer streamer;
+        streamer.num_threads = cam.num_threads;
+        try {
+            bool finished = world ? streamer.render(cam, *world, std::cout) : streamer.render(cam, mesh_world, std::cout);
+            cam.stats = streamer.stats;
+            if (!finished)
+                return 1;
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    } else if (local_workers > 0 || !remote_commands.empty()) {
+        render_coordinator coordinator;
+        worker_args.push_back("--worker");
+        for (int w = 0; w < local_workers; w++)
+            coordinator.worker_commands.push_back(worker_args);
+        for (const auto &command : remote_commands)
+            coordinator.worker_commands.push_back({"/bin/sh", "-c", command});
+        if (cam.denoise && world)
+            cam.render_aovs(*world);
+        else if (cam.denoise)
+            cam.render_aovs(mesh_world);
+        try {
+            if (!coordinator.render(cam))
+                return 1;
+        } catch (const std::runtime_error &error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    } else if (!(world ? cam.render(*world) : cam.render(mesh_world))) {
+        return 1;
+    }
+
+    if (!stats_path.empty()) {
+        cam.stats.phases.insert(cam.stats.phases.begin(), phase_time{"scene", scene_seconds});
+        std::ofstream out(stats_path);
+        cam.stats.write_json(out);
+    }
+    return 0;
 }
\ No newline at end of file
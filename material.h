@@ -5,16 +5,31 @@
 #include "color.h"
 #include "hittable.h"
 
+#include <typeinfo>
+
 class hit_record;
 
+// Material classes, lets integrators group hits by material before shading them
+enum class material_type { lambertian, metal, dielectric, light, other };
+
 // Abstract base class for materials
 class material {
     public:
         virtual ~material() = default; // Virtual destructor for safe polymorphic deletion
 
-        // Pure virtual method for scattering rays off the material
+        /*
+         * Returns the class of the material, by its exact type: materials defined outside this
+         * file report `other`, classes derived from the ones below included, as they may scatter
+         * differently (integrators call the scatter of a class other than `other` directly).
+         */
+        material_type type() const;
+
+        // Pure virtual method for scattering rays off the material, drawing random numbers from `gen`
         virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const = 0;
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &gen) const = 0;
+
+        // Light given off at the hit point toward the ray that hit it (none by default)
+        virtual color emitted(const hit_record &) const { return color(0, 0, 0); }
 };
 
 // Lambertian material (perfect matte surface)
@@ -22,16 +37,18 @@ class lambertian : public material {
     public:
         lambertian(const color &a) : albedo(a) {}
 
+        color get_albedo() const { return albedo; }
+
         // Scatters rays in random directions with no reflection
-        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
+        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &gen)
         const override {
-            auto scatter_direction = rec.normal + random_unit_vector();
+            auto scatter_direction = rec.normal + random_unit_vector(gen);
 
             // Catch degenerate scatter direction
             if (scatter_direction.near_zero())
                 scatter_direction = rec.normal;
 
-            scattered = ray(rec.p, scatter_direction);
+            scattered = rec.spawn_ray(scatter_direction);
             attenuation = albedo; // Attenuate ray with albedo color
             return true;
         }
@@ -44,59 +61,94 @@ class lambertian : public material {
 // Metal material (reflective)
 class metal : public material {
     public:
-        metal(const color &a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        metal(const color &a, real f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+
+        color get_albedo() const { return albedo; }
+        real get_fuzz() const { return fuzz; }
 
         // Reflects rays with possible fuzziness
-        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
+        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &gen)
         const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal); // Perfect reflection
-            scattered = ray(rec.p, reflected + fuzz * random_unit_vector()); // Add fuzz
+            scattered = rec.spawn_ray(reflected + fuzz * random_unit_vector(gen)); // Add fuzz
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0); // Scatter if the dot product is positive
         }
 
     private:
         color albedo;
-        double fuzz;
+        real fuzz;
 };
 
 // Dielectric material (transparent)
 class dielectric : public material {
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        dielectric(real index_of_refraction) : ir(index_of_refraction) {}
+
+        real get_index_of_refraction() const { return ir; }
 
         // Handles refraction and reflection based on the index of refraction
-        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
+        bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &gen)
         const override {
             attenuation = color(1.0, 1.0, 1.0); // Full transmission with no attenuation
-            double refraction_ratio = rec.front_face ? (1.0 / ir) : ir; // Adjust refraction ratio
+            real refraction_ratio = rec.front_face ? (1 / ir) : ir; // Adjust refraction ratio
 
             vec3 unit_direction = unit_vector(r_in.direction()); 
-            double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-            double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+            real cos_theta = std::fmin(dot(-unit_direction, rec.normal), real(1));
+            real sin_theta = sqrt(1 - cos_theta * cos_theta);
 
             bool cannot_refract = refraction_ratio * sin_theta > 1.0; // Total internal reflection check
             vec3 direction;
 
             // Choose reflection or refraction based on Schlick's approximation
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(gen))
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-            scattered = ray(rec.p, direction);
+            scattered = rec.spawn_ray(direction);
             return true;
         }
 
     private:
-        double ir; // Index of refraction
+        real ir; // Index of refraction
 
         // Schlick's approximation for reflectance
-        static double reflectance(double cosine, double ref_idx) {
+        static real reflectance(real cosine, real ref_idx) {
             auto r0 = (1 - ref_idx) / (1 + ref_idx);
             r0 = r0 * r0;
             return r0 + (1 - r0) * pow((1 - cosine), 5);
         }
 };
 
+// Light source: emits a color from the front of its surface and scatters nothing
+class diffuse_light : public material {
+    public:
+        diffuse_light(const color &emission) : emission(emission) {}
+
+        color get_emission() const { return emission; }
+
+        bool scatter(const ray &, const hit_record &, color &, ray &, rng &) const override { return false; }
+
+        color emitted(const hit_record &rec) const override {
+            return rec.front_face ? emission : color(0, 0, 0);
+        }
+
+    private:
+        color emission; // Radiance leaving the surface
+};
+
+inline material_type material::type() const {
+    const std::type_info &dynamic_type = typeid(*this);
+    if (dynamic_type == typeid(lambertian))
+        return material_type::lambertian;
+    if (dynamic_type == typeid(metal))
+        return material_type::metal;
+    if (dynamic_type == typeid(dielectric))
+        return material_type::dielectric;
+    if (dynamic_type == typeid(diffuse_light))
+        return material_type::light;
+    return material_type::other;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,218 @@
+#ifndef OBJ_FILE_H
+#define OBJ_FILE_H
+
+#include "utils.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Wavefront OBJ geometry reader. `v` statements give vertex positions and `f` statements
+ * polygons, which are split into triangle fans. Face corners may be negative (counted back from
+ * the last vertex read) and may carry /texture/normal parts, which are ignored along with every
+ * other statement (vt, vn, o, g, s, usemtl, mtllib, ...).
+ *
+ * The file is streamed `block_size` bytes at a time. Each block is cut at line ends into a few
+ * pieces per thread, the pieces are parsed concurrently, then appended in file order, so the
+ * memory used beyond the mesh itself is one block of text and what it parses to.
+ * Errors are thrown as std::runtime_error carrying the file name and line number.
+ */
+class obj_reader {
+    public:
+        // Reads with `num_threads` threads (0 = all hardware threads)
+        explicit obj_reader(int num_threads = 0, size_t block_size = 16 << 20)
+            : pool(num_threads), block_size(block_size) {}
+
+        // Reads the OBJ file at `path` into vertex positions and triangle vertex indices
+        void read_file(const std::string &path, std::vector<point3> &positions, std::vector<uint32_t> &indices) {
+            std::ifstream in(path, std::ios::binary);
+            if (!in)
+                throw std::runtime_error(path + ": cannot open OBJ file");
+
+            name = path;
+            lines_before = 0;
+            std::vector<char> buffer;
+            size_t carried = 0;     // Start of a line left over from the previous block
+            for (;;) {
+                buffer.resize(carried + block_size + 2);
+                in.read(buffer.data() + carried, static_cast<std::streamsize>(block_size));
+                size_t size = carried + static_cast<size_t>(in.gcount());
+                bool last = !in;
+
+                // Parse up to the last complete line; the final block gets a line end appended
+                size_t usable = size;
+                if (last) {
+                    buffer[usable++] = '\n';
+                } else {
+                    while (usable > 0 && buffer[usable - 1] != '\n')
+                        usable--;
+                    if (usable == 0) {  // A line longer than the block: read on
+                        carried = size;
+                        continue;
+                    }
+                }
+
+                // Number parsing may skip blank lines: a terminator keeps it inside the parsed lines
+                char after_usable = buffer[usable];
+                buffer[usable] = '\0';
+                read_block(buffer.data(), buffer.data() + usable, positions, indices);
+                buffer[usable] = after_usable;
+                lines_before += std::count(buffer.data(), buffer.data() + usable, '\n');
+
+                if (last)
+                    break;
+                carried = size - usable;
+                std::memmove(buffer.data(), buffer.data() + usable, carried);
+            }
+
+            for (auto index : indices) {
+                if (index >= positions.size())
+                    throw std::runtime_error(name + ": face refers to vertex " + std::to_string(index + 1)
+                                             + " but the file has " + std::to_string(positions.size()));
+            }
+        }
+
+    private:
+        // Result of parsing one piece of a block
+        struct piece {
+            const char *begin, *end;
+            std::vector<point3> positions;
+            std::vector<int64_t> corners;   // Triangle corners, see `relative_corner`
+            const char *error_at = nullptr; // First error of the piece, if any
+            std::string error;
+        };
+
+        /*
+         * Corners are stored 0-based once known; a negative OBJ index can reach back into earlier
+         * pieces, so it is stored as `relative_corner` plus its index relative to the first vertex
+         * of its piece and resolved when the pieces are appended.
+         */
+        static const int64_t relative_corner = -(int64_t(1) << 48);
+
+        thread_pool pool;
+        size_t block_size;
+        std::string name;
+        long long lines_before = 0;     // Lines in the blocks read so far
+
+        void read_block(const char *begin, const char *end, std::vector<point3> &positions,
+                        std::vector<uint32_t> &indices) {
+            // Cut the block at line ends into pieces of about equal size
+            int piece_count = std::max(1, std::min(pool.size() * 4, static_cast<int>((end - begin) >> 16)));
+            std::vector<piece> pieces(piece_count);
+            const char *cut = begin;
+            for (int p = 0; p < piece_count; p++) {
+                const char *stop = p == piece_count - 1 ? end : begin + (end - begin) * (p + 1) / piece_count;
+                stop = std::max(stop, cut);
+                if (stop < end)
+                    stop = static_cast<const char *>(std::memchr(stop, '\n', end - stop)) + 1;
+                pieces[p].begin = cut;
+                pieces[p].end = stop;
+                cut = stop;
+            }
+
+            pool.parallel_for(piece_count, [&](int p, int) { parse(pieces[p]); });
+
+            for (auto &part : pieces) {
+                if (part.error_at)
+                    fail(begin, part.error_at, part.error);
+
+                int64_t base = static_cast<int64_t>(positions.size());
+                positions.insert(positions.end(), part.positions.begin(), part.positions.end());
+                for (auto corner : part.corners) {
+                    int64_t index = corner >= 0 ? corner : base + (corner - relative_corner);
+                    if (index < 0 || index > UINT32_MAX)
+                        throw std::runtime_error(name + ": face refers to a vertex before the first one");
+                    indices.push_back(static_cast<uint32_t>(index));
+                }
+                part = piece();     // Free the piece's arrays as soon as they are copied
+            }
+        }
+
+        // Parses whole lines [part.begin, part.end); stops at the first error
+        static void parse(piece &part) {
+            std::vector<int64_t> polygon;
+            const char *line = part.begin;
+            while (line < part.end) {
+                const char *line_end = static_cast<const char *>(std::memchr(line, '\n', part.end - line));
+                const char *c = skip_blanks(line);
+
+                if (c[0] == 'v' && is_blank(c[1])) {
+                    char *after;
+                    real xyz[3];
+                    c++;
+                    for (int axis = 0; axis < 3; axis++) {
+                        xyz[axis] = static_cast<real>(std::strtod(c, &after));
+                        if (after == c || after > line_end) {
+                            part.error_at = line;
+                            part.error = "vertex needs three coordinates";
+                            return;
+                        }
+                        c = after;
+                    }
+                    part.positions.push_back(point3(xyz[0], xyz[1], xyz[2]));
+                } else if (c[0] == 'f' && is_blank(c[1])) {
+                    polygon.clear();
+                    c = skip_blanks(c + 1);
+                    while (c < line_end && *c != '#') {
+                        char *after;
+                        long long index = std::strtoll(c, &after, 10);
+                        if (after == c || index == 0) {
+                            part.error_at = line;
+                            part.error = "bad face corner";
+                            return;
+                        }
+                        polygon.push_back(index > 0 ? index - 1
+                                                    : relative_corner + static_cast<int64_t>(part.positions.size()) + index);
+                        c = after;
+                        while (c < line_end && !is_blank(*c))   // Texture and normal indices
+                            c++;
+                        c = skip_blanks(c);
+                    }
+                    if (polygon.size() < 3) {
+                        part.error_at = line;
+                        part.error = "face needs at least three corners";
+                        return;
+                    }
+                    for (size_t k = 1; k + 1 < polygon.size(); k++) {
+                        part.corners.push_back(polygon[0]);
+                        part.corners.push_back(polygon[k]);
+                        part.corners.push_back(polygon[k + 1]);
+                    }
+                }
+
+                line = line_end + 1;
+            }
+        }
+
+        static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+        static const char *skip_blanks(const char *c) {
+            while (is_blank(*c))
+                c++;
+            return c;
+        }
+
+        [[noreturn]] void fail(const char *block_begin, const char *at, const std::string &message) const {
+            long long line = lines_before + std::count(block_begin, at, '\n') + 1;
+            throw std::runtime_error(name + ":" + std::to_string(line) + ": " + message);
+        }
+};
+
+// Loads the OBJ file at `path` as a mesh_geometry, reading on all hardware threads
+inline shared_ptr<mesh_geometry> load_obj(const std::string &path) {
+    std::vector<point3> positions;
+    std::vector<uint32_t> indices;
+    obj_reader reader;
+    reader.read_file(path, positions, indices);
+    return make_shared<mesh_geometry>(std::move(positions), std::move(indices));
+}
+
+#endif
\ No newline at end of file
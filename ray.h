@@ -3,27 +3,31 @@
 
 #include "vec3.h"
 
-class ray {
+// Ray templated on its scalar type like basic_vec3; the renderer uses `ray`, i.e. basic_ray<real>
+template <typename T>
+class basic_ray {
     public:
-        ray() {} // Default constructor
+        basic_ray() {} // Default constructor
 
-        ray(const point3 &origin, const vec3 &direction) : orig(origin), dir(direction) {} // Parametrized constructor
+        basic_ray(const basic_vec3<T> &origin, const basic_vec3<T> &direction) : orig(origin), dir(direction) {} // Parametrized constructor
 
-        point3 origin() const { return orig; } // Gets the ray's origin
-        vec3 direction() const { return dir; } // Gets the ray's direction
+        basic_vec3<T> origin() const { return orig; } // Gets the ray's origin
+        basic_vec3<T> direction() const { return dir; } // Gets the ray's direction
 
         /*
          * Computes and returns a point along the ray at parameter t.
          * The point is calculated as origin + t * dir, which scales the direction
          * vector by t and adds it to the origin, moving the point along the ray
          */
-        point3 at(double t) const {
+        basic_vec3<T> at(T t) const {
             return orig + t * dir;
         }
 
     private:
-        point3 orig;
-        vec3 dir;
+        basic_vec3<T> orig;
+        basic_vec3<T> dir;
     };
 
+using ray = basic_ray<real>;
+
 #endif
\ No newline at end of file
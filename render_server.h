@@ -0,0 +1,556 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "utils.h"
+#include "accumulation_buffer.h"
+#include "camera.h"
+#include "distributed.h"
+#include "flat_scene.h"
+#include "image_writer.h"
+#include "scene_cache.h"
+#include "scene_file.h"
+#include "sphere_batch.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Long-running renderer for many small jobs: a scene is loaded (through its scene cache) and
+ * flattened the first time a job names it, and kept with its BVH for the jobs after it, so a job
+ * costs only its tracing. Scenes are named by the path of their file and loaded again once the
+ * file changes.
+ *
+ * Jobs are cut into tiles, which the server's worker threads take one at a time from whichever
+ * job has the highest priority (the oldest one among equals), so jobs run side by side and an
+ * urgent one overtakes the others within a tile. A job can be cancelled; its tiles in flight stop
+ * at their next inner tile (see camera::cancel). Each job is answered with its image.
+ *
+ * The server reads requests from stdin and answers on stdout, or accepts any number of clients on
+ * a Unix domain socket. Messages are raw structs in native byte order, like those of
+ * distributed.h:
+ *   client -> server: server_request followed by `bytes` bytes of payload
+ *   server -> client: server_reply followed by `bytes` bytes of payload, once per render request
+ * The payload of a render request is the path of a scene file, a newline, then camera statements
+ * in scene file syntax (e.g. "camera image_width 320") that override the file's, so a job can move
+ * the camera or change the resolution and sample count. The reply carries the image in the
+ * requested format, or an error message. Built with RAYTRACER_STATS, the server sums the event
+ * counters (stats.h) of each job's tiles and logs them with the job.
+ */
+
+enum class request_type : uint32_t {
+    render = 1,     // Render a scene as job `id`
+    cancel = 2      // Stop job `id` of the same client, which is then answered as cancelled
+};
+
+enum class reply_status : uint32_t {
+    done = 0,       // The payload is the image
+    cancelled = 1,  // Empty payload
+    failed = 2      // The payload is an error message
+};
+
+// Header of a request to a render_server
+struct server_request {
+    uint32_t type;          // request_type
+    uint32_t id;            // Chosen by the client, names the job in its reply and in cancel requests
+    int32_t priority;       // Jobs of higher priority get their tiles rendered first
+    uint32_t format;        // image_format of the reply
+    uint64_t bytes;         // Size of the payload that follows
+};
+
+// Header of the answer to a render request
+struct server_reply {
+    uint32_t id;
+    uint32_t status;        // reply_status
+    uint64_t bytes;         // Size of the image or error message that follows
+    int64_t samples;        // Samples taken and rays traced for the job
+    int64_t rays;
+    double seconds;         // From the arrival of the request to its answer
+};
+
+class render_server {
+    public:
+        camera defaults;            // Settings of every job, before those of its scene file and its own
+        int num_threads = 0;        // Worker threads shared by all jobs (0 = all hardware threads)
+        int tile_size = 32;         // Edge length in pixels of the square tiles jobs are cut into
+        size_t max_scenes = 8;      // Scenes kept loaded; the one used least recently is dropped beyond that
+        bool show_progress = true;  // Log every job on std::clog
+
+        explicit render_server(const camera &defaults) : defaults(defaults) {}
+
+        ~render_server() { stop_workers(); }
+
+        render_server(const render_server &) = delete;
+        render_server &operator=(const render_server &) = delete;
+
+        /*
+         * Serves the requests read from `in_fd`, answering on `out_fd`, until the input ends and
+         * every job is answered. Returns false if stopped by a signal (see camera::stop_on_signals).
+         */
+        bool serve_stream(int in_fd = 0, int out_fd = 1) {
+            camera::ignore_broken_pipes();
+            start_workers();
+            auto client = std::make_shared<connection>(in_fd, out_fd, false);
+            read_requests(client);
+            wait_for_jobs(client.get());
+            stop_workers();
+            return !render_stop_requested();
+        }
+
+        /*
+         * Accepts clients on a Unix domain socket created at `path` (replacing any file there)
+         * until a termination signal arrives; jobs still running are then cancelled. Throws
+         * std::runtime_error if the socket cannot be set up.
+         */
+        void serve_socket(const std::string &path) {
+            sockaddr_un address;
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+                throw std::runtime_error("render_server: socket path too long: " + path);
+            std::strcpy(address.sun_path, path.c_str());
+
+            int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener < 0)
+                throw std::runtime_error(std::string("render_server: socket failed: ") + std::strerror(errno));
+            ::fcntl(listener, F_SETFD, FD_CLOEXEC);
+            ::unlink(path.c_str());
+            if (::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+                || ::listen(listener, 16) != 0) {
+                std::string error = std::strerror(errno);
+                ::close(listener);
+                throw std::runtime_error("render_server: cannot listen on " + path + ": " + error);
+            }
+            if (show_progress)
+                std::clog << "Listening on " << path << '\n';
+
+            camera::ignore_broken_pipes();
+            start_workers();
+            std::vector<client_thread> clients;
+            while (wait_readable(listener)) {
+                int fd = ::accept(listener, nullptr, nullptr);
+                if (fd < 0)
+                    continue;
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+                // Join the threads of clients that left before starting another one
+                for (auto c = clients.begin(); c != clients.end();) {
+                    if (*c->finished) {
+                        c->thread.join();
+                        c = clients.erase(c);
+                    } else {
+                        ++c;
+                    }
+                }
+                client_thread c;
+                c.finished = std::make_shared<std::atomic<bool>>(false);
+                auto client = std::make_shared<connection>(fd, fd, true);
+                auto finished = c.finished;
+                c.thread = std::thread([this, client, finished] {
+                    read_requests(client);
+                    *finished = true;
+                });
+                clients.push_back(std::move(c));
+            }
+
+            for (auto &c : clients)
+                c.thread.join();
+            wait_for_jobs(nullptr);
+            stop_workers();
+            ::close(listener);
+            ::unlink(path.c_str());
+        }
+
+    private:
+        // A client: requests arrive on in_fd, replies leave on out_fd
+        struct connection {
+            int in_fd, out_fd;
+            bool owns_fds;              // Both are one socket, closed with the connection
+            std::mutex write_mutex;     // Replies of different jobs must not interleave
+            bool broken = false;        // A reply could not be written, the client is gone
+
+            connection(int in_fd, int out_fd, bool owns_fds) : in_fd(in_fd), out_fd(out_fd), owns_fds(owns_fds) {}
+
+            ~connection() {
+                if (owns_fds)
+                    ::close(in_fd);
+            }
+        };
+
+        struct client_thread {
+            std::thread thread;
+            std::shared_ptr<std::atomic<bool>> finished;
+        };
+
+        // A loaded scene and the camera settings of its file
+        struct scene_entry {
+            scene_cache::source_key key;
+            uint64_t source_hash = 0;       // Of the file when loaded, if its key was racy
+            shared_ptr<sphere_batch> batch;
+            std::unique_ptr<flat_scene> world;
+            camera settings;
+            unsigned long long last_used = 0;
+        };
+
+        struct job {
+            uint32_t id = 0;
+            int priority = 0;
+            unsigned long long order = 0;   // Arrival, breaks ties between equal priorities
+            image_format format = image_format::ppm;
+            std::string scene_path;
+            std::shared_ptr<connection> client;
+            std::shared_ptr<const scene_entry> scene;
+            camera settings;                // Set up once for all its tiles, its buffer holds the whole image
+            std::vector<pixel_rect> tiles;
+            size_t next_tile = 0;           // Tiles before it were handed out
+            size_t tiles_done = 0;
+            int running = 0;                // Tiles being rendered
+            std::atomic<bool> cancelled{false};
+            long long samples = 0, rays = 0;
+            ray_counters counters;          // Events of its tiles
+            std::chrono::steady_clock::time_point arrival;
+        };
+
+        static const uint64_t max_payload = 1 << 20;
+
+        std::mutex mutex;                           // Guards everything below
+        std::condition_variable work_available;     // Signalled when tiles are added or the workers stop
+        std::condition_variable job_finished;       // Signalled when a job is removed
+        std::vector<std::shared_ptr<job>> jobs;     // Jobs not answered yet
+        unsigned long long arrivals = 0;
+        bool stopping = false;
+        std::vector<std::thread> workers;
+
+        std::mutex scenes_mutex;                    // Guards the scenes, not held while one loads
+        std::condition_variable scene_loaded;       // Signalled when a load ends
+        std::map<std::string, std::shared_ptr<scene_entry>> scenes;
+        std::set<std::string> loading;              // Paths of the scenes being loaded
+        unsigned long long scene_uses = 0;
+
+        void start_workers() {
+            stopping = false;
+            int count = num_threads > 0 ? num_threads : static_cast<int>(std::thread::hardware_concurrency());
+            for (int w = 0; w < std::max(count, 1); w++)
+                workers.emplace_back(&render_server::worker_loop, this);
+        }
+
+        void stop_workers() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            work_available.notify_all();
+            for (auto &worker : workers)
+                worker.join();
+            workers.clear();
+        }
+
+        // Waits until `fd` can be read; false once a termination signal arrived
+        static bool wait_readable(int fd) {
+            while (!render_stop_requested()) {
+                pollfd p{fd, POLLIN, 0};
+                if (::poll(&p, 1, 200) > 0)
+                    return true;
+            }
+            return false;
+        }
+
+        // Waits until every job of `client` (of every client if null) is answered
+        void wait_for_jobs(const connection *client) {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_finished.wait(lock, [&] {
+                for (const auto &j : jobs)
+                    if (!client || j->client.get() == client)
+                        return false;
+                return true;
+            });
+        }
+
+        // Handles the requests of `client` until its input ends, it breaks the protocol or a signal arrives
+        void read_requests(const std::shared_ptr<connection> &client) {
+            server_request request;
+            while (wait_readable(client->in_fd) && read_all(client->in_fd, &request, sizeof(request))) {
+                if (request.bytes > max_payload)
+                    break;
+                std::string payload(static_cast<size_t>(request.bytes), '\0');
+                if (!read_all(client->in_fd, &payload[0], payload.size()))
+                    break;
+
+                if (request.type == static_cast<uint32_t>(request_type::render))
+                    submit(client, request, payload);
+                else if (request.type == static_cast<uint32_t>(request_type::cancel))
+                    cancel(client.get(), &request.id);
+                else
+                    break;
+            }
+        }
+
+        // Queues a render request, or answers it with an error right away
+        void submit(const std::shared_ptr<connection> &client, const server_request &request, const std::string &payload) {
+            auto j = std::make_shared<job>();
+            j->id = request.id;
+            j->priority = request.priority;
+            j->client = client;
+            j->arrival = std::chrono::steady_clock::now();
+            try {
+                if (request.format > static_cast<uint32_t>(image_format::png))
+                    throw std::runtime_error("unknown image format " + std::to_string(request.format));
+                j->format = static_cast<image_format>(request.format);
+                size_t end_of_path = payload.find('\n');
+                j->scene_path = payload.substr(0, end_of_path);
+                j->scene = scene_named(j->scene_path);
+
+                // The request's camera statements go over the file's
+                j->settings = j->scene->settings;
+                hittable_list objects;
+                scene_reader reader(objects, j->settings);
+                std::istringstream statements(end_of_path == std::string::npos ? "" : payload.substr(end_of_path + 1));
+                reader.read(statements, "request " + std::to_string(request.id));
+                if (!objects.objects.empty())
+                    throw std::runtime_error("request " + std::to_string(request.id) + ": only camera statements can be given");
+                if (j->settings.image_width < 1 || j->settings.samples_per_pixel < 1)
+                    throw std::runtime_error("request " + std::to_string(request.id) + ": empty image");
+            } catch (const std::exception &error) {
+                reply(*j, reply_status::failed, error.what());
+                return;
+            }
+            make_tiles(*j);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            j->order = arrivals++;
+            jobs.push_back(j);
+            work_available.notify_all();
+        }
+
+        /*
+         * Cancels job `id` of `client`, or all of its jobs if `id` is null. Jobs no tile of which
+         * is being rendered are answered here, the others by the worker finishing their last tile.
+         */
+        void cancel(const connection *client, const uint32_t *id) {
+            std::vector<std::shared_ptr<job>> idle;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (const auto &j : jobs) {
+                    if (j->client.get() != client || (id && j->id != *id))
+                        continue;
+                    j->cancelled = true;
+                    if (j->running == 0)
+                        idle.push_back(j);
+                }
+                for (const auto &j : idle)
+                    remove(j);
+            }
+            for (const auto &j : idle)
+                finish(*j);
+        }
+
+        // Removes a job from the queue (with the mutex held)
+        void remove(const std::shared_ptr<job> &j) {
+            jobs.erase(std::find(jobs.begin(), jobs.end(), j));
+            job_finished.notify_all();
+        }
+
+        /*
+         * Looks up a loaded scene, loading it when it is new or its file changed since. The load
+         * runs without the lock, so jobs of other scenes are taken meanwhile; requests for the
+         * scene being loaded wait for it rather than load it again.
+         */
+        std::shared_ptr<const scene_entry> scene_named(const std::string &path) {
+            std::unique_lock<std::mutex> lock(scenes_mutex);
+            scene_loaded.wait(lock, [&] { return loading.count(path) == 0; });
+            scene_cache::source_key key;
+            if (!scene_cache::key_of(path, key))
+                throw std::runtime_error(path + ": cannot open scene file");
+            auto found = scenes.find(path);
+            if (found != scenes.end() && found->second->key == key
+                && (!found->second->key.racy() || scene_cache::content_hash(path) == found->second->source_hash)) {
+                found->second->key = key;   // Stops hashing once the file has been left alone long enough
+                found->second->last_used = ++scene_uses;
+                return found->second;
+            }
+            loading.insert(path);
+            lock.unlock();
+
+            std::shared_ptr<scene_entry> entry;
+            try {
+                entry = load_entry(path, key);
+            } catch (...) {
+                lock.lock();
+                loading.erase(path);
+                scene_loaded.notify_all();
+                throw;
+            }
+
+            lock.lock();
+            loading.erase(path);
+            scene_loaded.notify_all();
+            entry->last_used = ++scene_uses;
+            scenes[path] = entry;
+            while (scenes.size() > max_scenes) {
+                auto oldest = scenes.begin();
+                for (auto s = scenes.begin(); s != scenes.end(); ++s)
+                    if (s->second->last_used < oldest->second->last_used)
+                        oldest = s;
+                scenes.erase(oldest);   // Jobs still rendering it keep it alive
+            }
+            return entry;
+        }
+
+        // Loads the scene at `path`, whose file has `key`, through its scene cache and flattens it
+        std::shared_ptr<scene_entry> load_entry(const std::string &path, const scene_cache::source_key &key) const {
+            auto entry = std::make_shared<scene_entry>();
+            entry->key = key;
+            entry->source_hash = key.racy() ? scene_cache::content_hash(path) : 0;
+            entry->settings = defaults;
+            uint64_t scene_hash = 0;
+            bool from_cache = false;
+            entry->batch = load_scene_cached(path, entry->settings, scene_hash, from_cache);
+            entry->world.reset(new flat_scene(entry->batch));
+            entry->settings.scene_hash = scene_hash;
+            entry->settings.output = nullptr;
+            entry->settings.show_progress = false;
+            entry->settings.checkpoint_path.clear();
+            entry->settings.resume = false;
+            entry->settings.sample_map_path.clear();
+            entry->settings.cost_map_path.clear();
+            entry->settings.render_window = pixel_rect();
+            entry->settings.first_sample = 0;
+            if (show_progress)
+                std::clog << (from_cache ? "Loaded scene cache " : "Built scene cache ") << path << ".cache\n";
+            return entry;
+        }
+
+        // Cuts the image of a job into tiles, rows from the top, and sets its camera up for them
+        void make_tiles(job &j) const {
+            int width = j.settings.image_width, height = j.settings.get_image_height();
+            for (int y = 0; y < height; y += tile_size)
+                for (int x = 0; x < width; x += tile_size)
+                    j.tiles.push_back(pixel_rect(x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)));
+            j.settings.render_window = pixel_rect();
+            j.settings.cancel = &j.cancelled;
+            j.settings.begin_tiles();
+        }
+
+        // The job whose tile is next: the highest priority, then the earliest (with the mutex held)
+        std::shared_ptr<job> next_job() const {
+            std::shared_ptr<job> best;
+            for (const auto &j : jobs) {
+                if (j->cancelled || j->next_tile == j->tiles.size())
+                    continue;
+                if (!best || j->priority > best->priority || (j->priority == best->priority && j->order < best->order))
+                    best = j;
+            }
+            return best;
+        }
+
+        // Main loop of each worker thread: renders tiles until the workers stop
+        void worker_loop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                std::shared_ptr<job> j;
+                work_available.wait(lock, [&] { return stopping || (j = next_job()) != nullptr; });
+                if (stopping)
+                    return;
+                pixel_rect tile = j->tiles[j->next_tile++];
+                j->running++;
+                lock.unlock();
+
+                // Tiles of a job do not overlap, so they go straight into its buffer side by side
+                long long samples = 0, rays = 0;
+                ray_counters counts;
+                bool finished;
+                {
+                    counter_scope counting(counts);
+                    finished = j->settings.render_window_tile(*j->scene->world, tile, samples, rays);
+                }
+
+                lock.lock();
+                j->running--;
+                if (finished) {
+                    j->samples += samples;
+                    j->rays += rays;
+                    j->counters.add(counts);
+                    j->tiles_done++;
+                } else {
+                    j->cancelled = true;    // Stopped by a signal
+                }
+                if (j->running == 0 && (j->cancelled || j->tiles_done == j->tiles.size())) {
+                    remove(j);
+                    lock.unlock();
+                    finish(*j);
+                    lock.lock();
+                }
+            }
+        }
+
+        // Answers a job that is done or cancelled, and was removed from the queue
+        void finish(job &j) {
+            if (j.cancelled) {
+                reply(j, reply_status::cancelled, std::string());
+                return;
+            }
+            std::ostringstream image;
+            try {
+                camera &cam = j.settings;
+                cam.num_threads = 1;
+                if (cam.denoise)
+                    cam.render_aovs(*j.scene->world);
+                cam.output = &image;
+                cam.output_format = j.format;
+                cam.write_output();
+            } catch (const std::exception &error) {
+                reply(j, reply_status::failed, error.what());
+                return;
+            }
+            reply(j, reply_status::done, image.str());
+        }
+
+        // Sends the answer to a job; a client that cannot be written to has its other jobs cancelled
+        void reply(const job &j, reply_status status, const std::string &payload) {
+            server_reply header{j.id, static_cast<uint32_t>(status), payload.size(), j.samples, j.rays,
+                                std::chrono::duration<double>(std::chrono::steady_clock::now() - j.arrival).count()};
+            bool sent;
+            {
+                std::lock_guard<std::mutex> lock(j.client->write_mutex);
+                sent = !j.client->broken && write_all(j.client->out_fd, &header, sizeof(header))
+                    && write_all(j.client->out_fd, payload.data(), payload.size());
+                j.client->broken = !sent;
+            }
+            if (show_progress) {
+                static const char *names[] = {"done", "cancelled", "failed"};
+                std::clog << "Job " << j.id << " (" << j.scene_path << "): " << names[static_cast<int>(status)] << " in "
+                          << header.seconds << " s" << (status == reply_status::failed ? ": " + payload : std::string())
+                          << (sent ? "" : ", client gone") << '\n';
+                if (stats_enabled) {
+                    std::clog << "Job " << j.id << " counters: ";
+                    j.counters.write_json(std::clog);
+                    std::clog << '\n';
+                }
+            }
+            if (!sent)
+                cancel(j.client.get(), nullptr);
+        }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,99 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include "sampler.h"
+
+#include <cstdint>
+
+/*
+ * Counter-based random number generator (Philox4x32-10).
+ * Every value is a pure function of a 128-bit counter and a 64-bit key, there is no hidden
+ * sequential state. The counter is made of (pixel, sample, bounce, dimension), so the
+ * random numbers used by a path only depend on which path it is and never on the order
+ * in which pixels are rendered or on which thread renders them.
+ * Given a sampler other than the independent one, the first sampler::dimensions dimensions of
+ * every bounce come from its sequence instead, and the rest from the Philox stream.
+ */
+class rng {
+    public:
+        rng() : rng(0, 0, 0) {} // Default constructor
+
+        // Creates the stream for one sample of one pixel
+        rng(uint64_t seed, uint32_t pixel, uint32_t sample, const sampler *sequence = nullptr)
+            : key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)},
+              pixel(pixel), sample(sample), bounce(0), dimension(0),
+              sequence(sequence && sequence->type() != sampler_type::independent ? sequence : nullptr) {}
+
+        // Switches to the dimensions of the given bounce (0 = camera ray)
+        void set_bounce(uint32_t b) {
+            bounce = b;
+            dimension = 0;
+        }
+
+        // Returns the next random real number in range [0,1)
+        double next_double() {
+            if (sequence && dimension < sampler::dimensions) {
+                // The sequence yields all its dimensions of a bounce at once, on the first
+                if (dimension == 0)
+                    sequence->generate(pixel, sample, bounce, sequence_values);
+                return sequence_values[dimension++];
+            }
+
+            // Each Philox block yields two doubles, compute a new block on even dimensions only
+            if ((dimension & 1) == 0)
+                generate_block(dimension >> 1);
+
+            uint64_t bits = (dimension & 1) == 0
+                ? (static_cast<uint64_t>(block[0]) << 32) | block[1]
+                : (static_cast<uint64_t>(block[2]) << 32) | block[3];
+
+            // Advance, rolling over into the bounce word so a long sequential stream never repeats
+            if (++dimension == 0)
+                ++bounce;
+
+            return (bits >> 11) * (1.0 / 9007199254740992.0); // 53 random bits scaled by 2^-53
+        }
+
+    private:
+        uint32_t key[2];       // Key derived from the render seed
+        uint32_t pixel;        // Counter word 0
+        uint32_t sample;       // Counter word 1
+        uint32_t bounce;       // Counter word 2
+        uint32_t dimension;    // Counter word 3 (two dimensions share one block)
+        uint32_t block[4];     // Output of the most recent Philox evaluation
+        const sampler *sequence;    // Source of the first dimensions of every bounce, if any
+        double sequence_values[sampler::dimensions]{}; // Its values for the current bounce
+
+        // Evaluates the ten Philox rounds for the current counter into `block`
+        void generate_block(uint32_t block_index) {
+            const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;    // Round multipliers
+            const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;    // Weyl sequence key increments
+
+            uint32_t c0 = pixel, c1 = sample, c2 = bounce, c3 = block_index;
+            uint32_t k0 = key[0], k1 = key[1];
+
+            for (int round = 0; round < 10; round++) {
+                uint64_t prod0 = static_cast<uint64_t>(M0) * c0;
+                uint64_t prod1 = static_cast<uint64_t>(M1) * c2;
+
+                uint32_t n0 = static_cast<uint32_t>(prod1 >> 32) ^ c1 ^ k0;
+                uint32_t n1 = static_cast<uint32_t>(prod1);
+                uint32_t n2 = static_cast<uint32_t>(prod0 >> 32) ^ c3 ^ k1;
+                uint32_t n3 = static_cast<uint32_t>(prod0);
+                c0 = n0; c1 = n1; c2 = n2; c3 = n3;
+
+                k0 += W0;
+                k1 += W1;
+            }
+
+            block[0] = c0; block[1] = c1; block[2] = c2; block[3] = c3;
+        }
+};
+
+// Per-thread sequential stream used outside of rendering (e.g. procedural scene setup)
+inline rng &default_rng() {
+    thread_local rng generator(0, 0xFFFFFFFF, 0);
+    return generator;
+}
+
+#endif
\ No newline at end of file
@@ -2,8 +2,8 @@
 
 # Script to create scene .ppm image
 
-# Compile main.cpp with g++ and C++11 support
-g++ -std=c++11 main.cpp -o main
+# Configure and compile an optimized build with CMake (see CMakeLists.txt for the targets)
+cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build --target raytracer || exit 1
 
-# Run the compiled Raytracer executable
-./main > output.ppm
\ No newline at end of file
+# Run the compiled Raytracer executable (arguments such as --resume are passed on)
+./build/raytracer "$@" > output.ppm
\ No newline at end of file
@@ -0,0 +1,359 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Sequence that the first random dimensions of every sample are taken from
+enum class sampler_type {
+    independent,    // Every dimension is an independent uniform number from the sample's Philox stream
+    stratified,     // Correlated multi-jittered strata, laid out for a known number of samples per pixel
+    sobol,          // Sobol points, Owen scrambled and shuffled per pixel
+    blue_noise      // One Sobol sequence for the whole image, shifted per pixel by a blue-noise tile
+};
+
+// Name of a sampler on the command line and in benchmark reports
+inline const char *sampler_name(sampler_type type) {
+    switch (type) {
+        case sampler_type::stratified: return "stratified";
+        case sampler_type::sobol: return "sobol";
+        case sampler_type::blue_noise: return "blue-noise";
+        default: return "independent";
+    }
+}
+
+// Sets `type` to the sampler called `name`; false if there is none
+inline bool parse_sampler_type(const char *name, sampler_type &type) {
+    const sampler_type types[] = {sampler_type::independent, sampler_type::stratified, sampler_type::sobol,
+                                  sampler_type::blue_noise};
+    for (sampler_type t : types) {
+        if (std::strcmp(name, sampler_name(t)) == 0) {
+            type = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Supplies well-distributed values for the first `dimensions` dimensions of every bounce of a
+ * sample (see rng): at bounce 0 the pixel jitter (0, 1) and the lens (2, 3), at later bounces the
+ * scatter direction (0, 1) and whatever the material and Russian roulette draw next. The points
+ * of the samples of a pixel cover those dimensions more evenly than independent numbers do, so
+ * the error of a pixel falls faster with the sample count. Every bounce is scrambled with its own
+ * key ("padding"), so the dimensions of different bounces are not correlated.
+ * Like the Philox stream, every value is a pure function of (seed, pixel, sample, bounce,
+ * dimension); further dimensions come from the stream.
+ */
+class sampler {
+    public:
+        static const uint32_t dimensions = 4;   // Dimensions per bounce taken from the sequence
+
+        sampler() {}
+
+        /*
+         * `samples` is the number of samples per pixel the stratified pattern is laid out for (later
+         * samples start another pattern) and `image_width` is needed to find a pixel's place in
+         * the blue-noise tile.
+         */
+        sampler(sampler_type type, uint64_t seed, int samples, int image_width)
+            : kind(type), key(static_cast<uint32_t>(seed) ^ static_cast<uint32_t>(seed >> 32) * 0x9E3779B9u),
+              pattern_size(samples > 0 ? static_cast<uint32_t>(samples) : 1),
+              width(image_width > 0 ? static_cast<uint32_t>(image_width) : 1) {
+            // Columns and rows of the stratified grid, as square as the count allows
+            while ((columns + 1) * (columns + 1) <= pattern_size)
+                columns++;
+            rows = (pattern_size + columns - 1) / columns;
+            if (kind == sampler_type::blue_noise)
+                tile = &blue_noise_tile();
+        }
+
+        sampler_type type() const { return kind; }
+
+        // Stores the values in [0,1) of the dimensions at `bounce` of sample `sample` of pixel `pixel`
+        void generate(uint32_t pixel, uint32_t sample, uint32_t bounce, double (&values)[dimensions]) const {
+            switch (kind) {
+                case sampler_type::stratified: stratified(pixel, sample, bounce, values); break;
+                case sampler_type::sobol: sobol(pixel, sample, bounce, values); break;
+                case sampler_type::blue_noise: blue_noise(pixel, sample, bounce, values); break;
+                default: break;
+            }
+        }
+
+    private:
+        static const int tile_size = 64;    // Edge length of the blue-noise tile
+
+        sampler_type kind = sampler_type::independent;
+        uint32_t key = 0;                   // Derived from the render seed
+        uint32_t pattern_size = 1;
+        uint32_t columns = 1, rows = 1;     // Grid of the stratified pattern
+        uint32_t width = 1;
+        const std::vector<float> *tile = nullptr;
+
+        static uint32_t hash(uint32_t x) {
+            x ^= x >> 16;
+            x *= 0x7FEB352Du;
+            x ^= x >> 15;
+            x *= 0x846CA68Bu;
+            x ^= x >> 16;
+            return x;
+        }
+
+        static uint32_t hash(uint32_t a, uint32_t b) { return hash(a ^ hash(b + 0x9E3779B9u)); }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = (x << 16) | (x >> 16);
+            x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+            x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+            x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+            return ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+        }
+
+        /*
+         * Owen scrambling of the bits of x, read as a fraction: every bit is flipped or not
+         * depending on the bits above it (the hash of Laine and Karras, as improved by Burley 2020).
+         */
+        static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+            x = reverse_bits(x);
+            x += seed;
+            x ^= x * 0x6C50B47Cu;
+            x ^= x * 0xB82F1E52u;
+            x ^= x * 0xC7AFE638u;
+            x ^= x * 0x8D22F6E6u;
+            return reverse_bits(x);
+        }
+
+        /*
+         * The first four Sobol dimensions, from the direction numbers of Joe and Kuo, as tables of
+         * the contribution of every byte of the index, so a point takes four lookups per dimension.
+         */
+        struct sobol_table {
+            uint32_t bytes[dimensions][4][256];
+
+            sobol_table() {
+                // Degree s, coefficients a and initial numbers m of the primitive polynomials
+                const uint32_t degree[dimensions] = {0, 1, 2, 3};
+                const uint32_t coefficients[dimensions] = {0, 0, 1, 1};
+                const uint32_t initial[dimensions][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+                uint32_t v[dimensions][32];
+                for (uint32_t bit = 0; bit < 32; bit++)
+                    v[0][bit] = 1u << (31 - bit);
+                for (uint32_t d = 1; d < dimensions; d++) {
+                    uint32_t s = degree[d];
+                    for (uint32_t bit = 0; bit < 32; bit++) {
+                        if (bit < s) {
+                            v[d][bit] = initial[d][bit] << (31 - bit);
+                            continue;
+                        }
+                        v[d][bit] = v[d][bit - s] ^ (v[d][bit - s] >> s);
+                        for (uint32_t k = 1; k < s; k++)
+                            v[d][bit] ^= ((coefficients[d] >> (s - 1 - k)) & 1) * v[d][bit - k];
+                    }
+                }
+
+                for (uint32_t d = 0; d < dimensions; d++) {
+                    for (int byte = 0; byte < 4; byte++) {
+                        for (uint32_t value = 0; value < 256; value++) {
+                            uint32_t x = 0;
+                            for (int bit = 0; bit < 8; bit++)
+                                if (value & (1u << bit))
+                                    x ^= v[d][8 * byte + bit];
+                            bytes[d][byte][value] = x;
+                        }
+                    }
+                }
+            }
+
+            uint32_t point(uint32_t index, uint32_t d) const {
+                return bytes[d][0][index & 0xFF] ^ bytes[d][1][(index >> 8) & 0xFF]
+                    ^ bytes[d][2][(index >> 16) & 0xFF] ^ bytes[d][3][index >> 24];
+            }
+        };
+
+        static const sobol_table &sobol_points() {
+            static const sobol_table table;
+            return table;
+        }
+
+        static double to_unit(uint32_t bits) { return bits * (1.0 / 4294967296.0); }
+
+        /*
+         * Owen-scrambled Sobol point with the index `sample` shuffled by the same kind of
+         * scrambling, which keeps every aligned run of 2^k samples a (0,k,2) net in each pair of
+         * dimensions (Burley 2020). A pixel's bounce gets its own shuffle and scrambles.
+         */
+        void scrambled_sobol(uint32_t sample, uint32_t seed, double (&values)[dimensions]) const {
+            const sobol_table &table = sobol_points();
+            uint32_t index = owen_scramble(sample, seed);
+            for (uint32_t d = 0; d < dimensions; d++)
+                values[d] = to_unit(owen_scramble(table.point(index, d), hash(seed, d + 1)));
+        }
+
+        void sobol(uint32_t pixel, uint32_t sample, uint32_t bounce, double (&values)[dimensions]) const {
+            scrambled_sobol(sample, hash(hash(key, pixel), bounce), values);
+        }
+
+        /*
+         * The same Sobol sequence for every pixel, scrambled per bounce only, moved by a toroidal
+         * shift read from the blue-noise tile. Neighboring pixels get shifts that differ a lot, so
+         * their errors are unlike each other and the remaining noise is fine grained rather than
+         * blotchy, which also suits the denoiser.
+         */
+        void blue_noise(uint32_t pixel, uint32_t sample, uint32_t bounce, double (&values)[dimensions]) const {
+            uint32_t seed = hash(key, bounce);
+            scrambled_sobol(sample, seed, values);
+
+            // Every dimension reads the tile at its own offset
+            uint32_t px = pixel % width, py = pixel / width;
+            for (uint32_t d = 0; d < dimensions; d++) {
+                uint32_t offset = hash(seed, d + 0x100);
+                uint32_t x = (px + offset) % tile_size, y = (py + (offset >> 16)) % tile_size;
+                double value = values[d] + (*tile)[y * tile_size + x];
+                values[d] = value >= 1 ? value - 1 : value;
+            }
+        }
+
+        // Permutation of [0, size) chosen by `seed` (Kensler 2013)
+        static uint32_t permute(uint32_t i, uint32_t size, uint32_t seed) {
+            uint32_t w = size - 1;
+            w |= w >> 1;
+            w |= w >> 2;
+            w |= w >> 4;
+            w |= w >> 8;
+            w |= w >> 16;
+            do {
+                i ^= seed;
+                i *= 0xE170893Du;
+                i ^= seed >> 16;
+                i ^= (i & w) >> 4;
+                i ^= seed >> 8;
+                i *= 0x0929EB3Fu;
+                i ^= seed >> 23;
+                i ^= (i & w) >> 1;
+                i *= 1 | seed >> 27;
+                i *= 0x6935FA69u;
+                i ^= (i & w) >> 11;
+                i *= 0x74DCB303u;
+                i ^= (i & w) >> 2;
+                i *= 0x9E501CC3u;
+                i ^= (i & w) >> 2;
+                i *= 0xC860A3DFu;
+                i &= w;
+                i ^= i >> 5;
+            } while (i >= size);
+            return (i + seed) % size;
+        }
+
+        /*
+         * Correlated multi-jittered sampling (Kensler 2013). Dimensions go in pairs; the samples
+         * of a pattern fall one per cell of a grid of columns x rows cells, and their projections
+         * on either axis one per each of the columns * rows thin strips, so both the pair and each
+         * of its dimensions are stratified. Samples are assigned to cells in a per-pixel random
+         * order, which keeps a pattern that is cut short (adaptive sampling) spread over the pixel.
+         */
+        void stratified(uint32_t pixel, uint32_t sample, uint32_t bounce, double (&values)[dimensions]) const {
+            uint32_t n = pattern_size;
+            uint32_t pixel_seed = hash(hash(key, pixel), bounce);
+            for (uint32_t pair = 0; pair < dimensions / 2; pair++) {
+                uint32_t seed = hash(pixel_seed, sample / n * 2 + pair);
+                uint32_t s = permute(sample % n, n, seed * 0x51633E2Du);
+                uint32_t column = s % columns, row = s / columns;
+                uint32_t x_strip = permute(row, rows, seed * 0x63D83595u);
+                uint32_t y_strip = permute(column, columns, seed * 0xA511E9B3u);
+                double x_jitter = to_unit(hash(s, seed * 0xA399D265u));
+                double y_jitter = to_unit(hash(s, seed * 0x711AD6A5u));
+                values[2 * pair] = (column + (x_strip + x_jitter) / rows) / columns;
+                values[2 * pair + 1] = (row + (y_strip + y_jitter) / columns) / rows;
+            }
+        }
+
+        /*
+         * Ranks of a 64 x 64 blue-noise pattern, as values (rank + 0.5) / 4096, made once by the
+         * void-and-cluster method (Ulichney 1993): points are added one at a time where they are
+         * farthest from the others, measured by a Gaussian "energy" on the torus.
+         */
+        static const std::vector<float> &blue_noise_tile() {
+            static const std::vector<float> values = make_blue_noise_tile();
+            return values;
+        }
+
+        static std::vector<float> make_blue_noise_tile() {
+            const int n = tile_size, count = n * n;
+            const double sigma = 1.5;
+
+            // Gaussian of the toroidal distance between two cells, by offset
+            std::vector<float> kernel(count);
+            for (int dy = 0; dy < n; dy++) {
+                for (int dx = 0; dx < n; dx++) {
+                    int x = dx < n / 2 ? dx : dx - n, y = dy < n / 2 ? dy : dy - n;
+                    kernel[dy * n + dx] = static_cast<float>(std::exp(-(x * x + y * y) / (2 * sigma * sigma)));
+                }
+            }
+
+            std::vector<float> energy(count, 0.0f);
+            std::vector<char> set(count, 0);
+            auto toggle = [&](int cell, bool on) {
+                set[cell] = on;
+                int cx = cell % n, cy = cell / n;
+                float sign = on ? 1.0f : -1.0f;
+                for (int y = 0; y < n; y++) {
+                    const float *row = &kernel[((y - cy + n) % n) * n];
+                    for (int x = 0; x < n; x++)
+                        energy[y * n + x] += sign * row[(x - cx + n) % n];
+                }
+            };
+            // The set point with the most energy (tightest cluster) or the empty one with the least (largest void)
+            auto find = [&](bool cluster) {
+                int best = -1;
+                for (int cell = 0; cell < count; cell++) {
+                    if (set[cell] != cluster)
+                        continue;
+                    if (best < 0 || (cluster ? energy[cell] > energy[best] : energy[cell] < energy[best]))
+                        best = cell;
+                }
+                return best;
+            };
+
+            // Initial pattern: a tenth of the cells at random, then moved from clusters to voids until stable
+            int initial = count / 10;
+            for (uint32_t i = 0, placed = 0; placed < static_cast<uint32_t>(initial); i++) {
+                int cell = static_cast<int>(hash(i, 0x5EED) % count);
+                if (!set[cell]) {
+                    toggle(cell, true);
+                    placed++;
+                }
+            }
+            for (int moves = 0; moves < count; moves++) {
+                int cluster = find(true);
+                toggle(cluster, false);
+                int gap = find(false);
+                toggle(gap, true);
+                if (gap == cluster)
+                    break;
+            }
+
+            // Rank the initial points by taking them out tightest first, then fill the voids in order
+            std::vector<float> values(count);
+            std::vector<char> initial_set(set);
+            std::vector<float> initial_energy(energy);
+            for (int rank = initial - 1; rank >= 0; rank--) {
+                int cell = find(true);
+                toggle(cell, false);
+                values[cell] = static_cast<float>(rank);
+            }
+            set.swap(initial_set);
+            energy.swap(initial_energy);
+            for (int rank = initial; rank < count; rank++) {
+                int cell = find(false);
+                toggle(cell, true);
+                values[cell] = static_cast<float>(rank);
+            }
+            for (auto &v : values)
+                v = (v + 0.5f) / count;
+            return values;
+        }
+};
+
+#endif
\ No newline at end of file
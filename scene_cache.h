@@ -0,0 +1,441 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "utils.h"
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scene_file.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file, empty if the file cannot be mapped
+class mapped_file {
+    public:
+        explicit mapped_file(const std::string &path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void *mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    bytes = static_cast<const char *>(mapping);
+                    length = static_cast<size_t>(info.st_size);
+                }
+            }
+            close(fd);
+        }
+
+        ~mapped_file() {
+            if (bytes)
+                munmap(const_cast<char *>(bytes), length);
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        const char *data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const char *bytes = nullptr;
+        size_t length = 0;
+};
+
+/*
+ * Binary cache of a scene: the spheres of a sphere_batch, its material table and its BVH,
+ * stored exactly as they are laid out in memory, plus the camera and animation statements of the scene.
+ * Loading maps the file and copies every array out in a single block: there is nothing to
+ * parse and no BVH to build, so even a million spheres load in milliseconds.
+ * A cache remembers the device, inode, size and nanosecond modification and change times of the
+ * file it was made from and is ignored once any of them changes. File times only advance once per
+ * kernel tick (whole seconds on some file systems), so an edit made within the same tick as the
+ * cache can leave them as they were: for a file that changed that recently the cache also keeps
+ * a hash of its bytes and compares it on every load.
+ *
+ * File layout (native byte order, every section starts at a multiple of 8 bytes):
+ *   header                              see `header` below
+ *   camera and key statements           camera_bytes characters, scene file syntax
+ *   materials                           material_count material_record
+ *   center_x, center_y, center_z, radii sphere_count `real`s each
+ *   material_ids                        sphere_count uint32
+ *   sphere slots                        sphere_count int32, array index of each sphere in file order
+ *   BVH nodes                           node_count bvh_tree::node, stored raw
+ *   BVH indices                         index_count int32
+ */
+class scene_cache {
+    public:
+        // Identifies one version of a source file
+        struct source_key {
+            uint64_t device = 0;
+            uint64_t inode = 0;
+            uint64_t size = 0;
+            int64_t mtime = 0;          // Modification and status change times, in nanoseconds
+            int64_t ctime = 0;
+            int64_t read_time = 0;      // When the key was read, not part of the identity
+
+            bool operator==(const source_key &other) const {
+                return device == other.device && inode == other.inode && size == other.size
+                    && mtime == other.mtime && ctime == other.ctime;
+            }
+            bool operator!=(const source_key &other) const { return !(*this == other); }
+
+            // True if the file changed so shortly before the key was read that another change
+            // may have kept the same times: only the content tells these versions apart
+            bool racy() const { return read_time - std::max(mtime, ctime) < racy_window; }
+        };
+
+        // Reads the key of the file at `path`, returns false if it does not exist
+        static bool key_of(const std::string &path, source_key &key) {
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0)
+                return false;
+            key.device = static_cast<uint64_t>(info.st_dev);
+            key.inode = static_cast<uint64_t>(info.st_ino);
+            key.size = static_cast<uint64_t>(info.st_size);
+            key.mtime = nanoseconds(info.st_mtim);
+            key.ctime = nanoseconds(info.st_ctim);
+            key.read_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            return true;
+        }
+
+        // FNV-1a hash of the bytes of the file at `path`
+        static uint64_t content_hash(const std::string &path) {
+            mapped_file file(path);
+            return hash_bytes(fnv_offset_basis, file.data(), file.size());
+        }
+
+        /*
+         * Writes the cache of a scene made from the source identified by `key`, whose content_hash
+         * is `source_hash` if the key is racy (and is not looked at otherwise). Fails for
+         * materials other than lambertian, metal, dielectric and diffuse_light. Like the render checkpoints,
+         * the file is written next to `path` first and then renamed over it.
+         */
+        static bool save(const std::string &path, const source_key &key, uint64_t source_hash, uint64_t scene_hash,
+                         const std::string &camera_statements, const sphere_batch &batch) {
+            std::vector<material_record> records;
+            for (const auto &mat : batch.materials) {
+                material_record record;
+                if (!describe(*mat, record))
+                    return false;
+                records.push_back(record);
+            }
+
+            header head;
+            std::memcpy(head.magic, magic(), 8);
+            head.node_size = sizeof(bvh_tree::node);
+            head.real_size = sizeof(real);
+            head.padding = 0;
+            head.material_count = static_cast<uint32_t>(records.size());
+            head.sphere_count = batch.radii.size();
+            head.node_count = batch.tree.nodes.size();
+            head.index_count = batch.tree.indices.size();
+            head.camera_bytes = camera_statements.size();
+            head.source_device = key.device;
+            head.source_inode = key.inode;
+            head.source_size = key.size;
+            head.source_mtime = key.mtime;
+            head.source_ctime = key.ctime;
+            head.source_read_time = key.read_time;
+            head.source_hash = key.racy() ? source_hash : 0;
+            head.scene_hash = scene_hash;
+
+            std::string temp_path = path + ".tmp";
+            {
+                std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+                if (!out)
+                    return false;
+                write_section(out, &head, 1);
+                write_section(out, camera_statements.data(), camera_statements.size());
+                write_section(out, records.data(), records.size());
+                write_section(out, batch.center_x.data(), batch.center_x.size());
+                write_section(out, batch.center_y.data(), batch.center_y.size());
+                write_section(out, batch.center_z.data(), batch.center_z.size());
+                write_section(out, batch.radii.data(), batch.radii.size());
+                write_section(out, batch.material_ids.data(), batch.material_ids.size());
+                write_section(out, batch.slots.data(), batch.slots.size());
+                write_section(out, batch.tree.nodes.data(), batch.tree.nodes.size());
+                write_section(out, batch.tree.indices.data(), batch.tree.indices.size());
+                if (!out.flush())
+                    return false;
+            }
+            return std::rename(temp_path.c_str(), path.c_str()) == 0;
+        }
+
+        /*
+         * Loads a cache written by `save` into `batch`. Fails, leaving the arguments untouched,
+         * if the file is missing, truncated, from another build, or made from another version
+         * of the source, the one at `source_path` with key `key`.
+         */
+        static bool load(const std::string &path, const std::string &source_path, const source_key &key,
+                         uint64_t &scene_hash,
+                         std::string &camera_statements, sphere_batch &batch) {
+            mapped_file file(path);
+            section_reader in(file);
+
+            header head;
+            if (!in.read(&head, 1) || std::memcmp(head.magic, magic(), 8) != 0)
+                return false;
+            if (head.node_size != sizeof(bvh_tree::node) || head.real_size != sizeof(real))
+                return false;
+            source_key saved;
+            saved.device = head.source_device;
+            saved.inode = head.source_inode;
+            saved.size = head.source_size;
+            saved.mtime = head.source_mtime;
+            saved.ctime = head.source_ctime;
+            saved.read_time = head.source_read_time;
+            if (saved != key || (saved.racy() && content_hash(source_path) != head.source_hash))
+                return false;
+
+            // No count can exceed the file size, checked before anything is allocated
+            size_t limit = file.size();
+            if (head.camera_bytes > limit || head.material_count > limit || head.sphere_count > limit
+                || head.node_count > limit || head.index_count > limit)
+                return false;
+
+            std::string statements(head.camera_bytes, ' ');
+            std::vector<material_record> records(head.material_count);
+            sphere_batch loaded;
+            loaded.center_x.resize(head.sphere_count);
+            loaded.center_y.resize(head.sphere_count);
+            loaded.center_z.resize(head.sphere_count);
+            loaded.radii.resize(head.sphere_count);
+            loaded.material_ids.resize(head.sphere_count);
+            loaded.slots.resize(head.sphere_count);
+            loaded.tree.nodes.resize(head.node_count);
+            loaded.tree.indices.resize(head.index_count);
+
+            bool complete = in.read(&statements[0], statements.size())
+                && in.read(records.data(), records.size())
+                && in.read(loaded.center_x.data(), head.sphere_count)
+                && in.read(loaded.center_y.data(), head.sphere_count)
+                && in.read(loaded.center_z.data(), head.sphere_count)
+                && in.read(loaded.radii.data(), head.sphere_count)
+                && in.read(loaded.material_ids.data(), head.sphere_count)
+                && in.read(loaded.slots.data(), head.sphere_count)
+                && in.read(loaded.tree.nodes.data(), head.node_count)
+                && in.read(loaded.tree.indices.data(), head.index_count);
+            if (!complete)
+                return false;
+
+            for (const auto &record : records) {
+                auto mat = create(record);
+                if (!mat)
+                    return false;
+                loaded.material_id(mat);
+            }
+            for (auto id : loaded.material_ids)
+                if (id >= records.size())
+                    return false;
+            for (auto slot : loaded.slots)
+                if (slot < 0 || static_cast<uint64_t>(slot) >= head.sphere_count)
+                    return false;
+            if (!valid_tree(loaded.tree, head.sphere_count))
+                return false;
+
+            // The root box encloses every sphere; without a tree, grow the box sphere by sphere
+            if (!loaded.tree.empty()) {
+                loaded.bbox = loaded.tree.bounding_box();
+            } else {
+                for (size_t i = 0; i < loaded.radii.size(); i++) {
+                    auto rvec = vec3(loaded.radii[i], loaded.radii[i], loaded.radii[i]);
+                    auto center = point3(loaded.center_x[i], loaded.center_y[i], loaded.center_z[i]);
+                    loaded.bbox = aabb(loaded.bbox, aabb(center - rvec, center + rvec));
+                }
+            }
+
+            batch = std::move(loaded);
+            scene_hash = head.scene_hash;
+            camera_statements.swap(statements);
+            return true;
+        }
+
+    private:
+        struct header {
+            char magic[8];
+            uint32_t node_size;         // sizeof(bvh_tree::node) of the writer
+            uint32_t real_size;         // sizeof(real) of the writer: caches are per precision
+            uint32_t material_count;
+            uint32_t padding;
+            uint64_t sphere_count;
+            uint64_t node_count;
+            uint64_t index_count;
+            uint64_t camera_bytes;
+            uint64_t source_device;     // Key of the source file
+            uint64_t source_inode;
+            uint64_t source_size;
+            int64_t source_mtime;
+            int64_t source_ctime;
+            int64_t source_read_time;
+            uint64_t source_hash;       // content_hash of the source if its key is racy, else 0
+            uint64_t scene_hash;        // hittable_list::fingerprint of the scene
+        };
+
+        // A material of the table: lambertian and metal use albedo and (metal) fuzz, dielectric index,
+        // diffuse_light keeps its emission in albedo
+        struct material_record {
+            uint32_t type;              // material_type
+            uint32_t padding;
+            double albedo[3];
+            double parameter;           // Fuzz of a metal, index of refraction of a dielectric
+        };
+
+        // Reads consecutive sections out of a mapped file, checking every read against its size
+        class section_reader {
+            public:
+                explicit section_reader(const mapped_file &file) : file(file) {}
+
+                template <typename T>
+                bool read(T *values, size_t count) {
+                    size_t bytes = count * sizeof(T);
+                    if (!file.data() || bytes / sizeof(T) != count || offset > file.size()
+                        || file.size() - offset < bytes)
+                        return false;
+                    if (bytes > 0)
+                        std::memcpy(values, file.data() + offset, bytes);
+                    offset = aligned(offset + bytes);
+                    return true;
+                }
+
+            private:
+                const mapped_file &file;
+                size_t offset = 0;
+        };
+
+        static const char *magic() { return "RTSCENE4"; }
+
+        // File times only move on every kernel tick or, on some file systems, every second
+        static const int64_t racy_window = 2000000000;
+
+        static int64_t nanoseconds(const struct timespec &time) {
+            return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+        }
+
+        static size_t aligned(size_t offset) { return (offset + 7) & ~static_cast<size_t>(7); }
+
+        template <typename T>
+        static void write_section(std::ostream &out, const T *values, size_t count) {
+            static const char padding[8] = {};
+            size_t bytes = count * sizeof(T);
+            out.write(reinterpret_cast<const char *>(values), static_cast<std::streamsize>(bytes));
+            out.write(padding, static_cast<std::streamsize>(aligned(bytes) - bytes));
+        }
+
+        // Checks that every node and leaf range of a loaded tree stays inside its arrays
+        static bool valid_tree(const bvh_tree &tree, uint64_t primitive_count) {
+            if (!tree.nodes.empty() && tree.indices.size() != primitive_count)
+                return false;
+            for (size_t i = 0; i < tree.nodes.size(); i++) {
+                const auto &n = tree.nodes[i];
+                if (n.count < 0 || n.offset < 0)
+                    return false;
+                if (n.count > 0) {
+                    if (static_cast<uint64_t>(n.offset) + n.count > tree.indices.size())
+                        return false;
+                } else if (static_cast<size_t>(n.offset) <= i + 1 || static_cast<size_t>(n.offset) >= tree.nodes.size()
+                           || n.axis < 0 || n.axis > 2) {
+                    return false;
+                }
+            }
+            for (int index : tree.indices)
+                if (index < 0 || static_cast<uint64_t>(index) >= primitive_count)
+                    return false;
+            return true;
+        }
+
+        static bool describe(const material &mat, material_record &record) {
+            record = material_record{static_cast<uint32_t>(mat.type()), 0, {0, 0, 0}, 0};
+            color albedo;
+            switch (mat.type()) {
+                case material_type::lambertian:
+                    albedo = static_cast<const lambertian &>(mat).get_albedo();
+                    break;
+                case material_type::metal:
+                    albedo = static_cast<const metal &>(mat).get_albedo();
+                    record.parameter = static_cast<const metal &>(mat).get_fuzz();
+                    break;
+                case material_type::dielectric:
+                    record.parameter = static_cast<const dielectric &>(mat).get_index_of_refraction();
+                    break;
+                case material_type::light:
+                    albedo = static_cast<const diffuse_light &>(mat).get_emission();
+                    break;
+                default:
+                    return false;   // Derived classes too, they would come back as their base
+            }
+            for (int i = 0; i < 3; i++)
+                record.albedo[i] = albedo[i];
+            return true;
+        }
+
+        static shared_ptr<material> create(const material_record &record) {
+            color albedo(record.albedo[0], record.albedo[1], record.albedo[2]);
+            switch (static_cast<material_type>(record.type)) {
+                case material_type::lambertian: return make_shared<lambertian>(albedo);
+                case material_type::metal: return make_shared<metal>(albedo, record.parameter);
+                case material_type::dielectric: return make_shared<dielectric>(record.parameter);
+                case material_type::light: return make_shared<diffuse_light>(albedo);
+                default: return nullptr;
+            }
+        }
+};
+
+/*
+ * Loads the scene file at `path` as a sphere_batch with a BVH, through the cache at
+ * `path + ".cache"`. A valid cache is used as is; otherwise the file is parsed, the BVH
+ * built and the cache rewritten. Sets the camera from the file and returns the scene hash
+ * for render checkpoints in `scene_hash`, and the file's keyframes in `anim` if given.
+ */
+inline shared_ptr<sphere_batch> load_scene_cached(const std::string &path, camera &cam, uint64_t &scene_hash,
+                                                  bool &from_cache, animation *anim = nullptr) {
+    std::string cache_path = path + ".cache";
+    scene_cache::source_key key;
+    if (!scene_cache::key_of(path, key))
+        throw std::runtime_error(path + ": cannot open scene file");
+
+    auto batch = make_shared<sphere_batch>();
+    std::string camera_statements;
+    from_cache = scene_cache::load(cache_path, path, key, scene_hash, camera_statements, *batch);
+    if (from_cache) {
+        hittable_list unused;
+        scene_reader reader(unused, cam, nullptr, anim);
+        std::istringstream statements(camera_statements);
+        reader.read(statements, cache_path);
+        return batch;
+    }
+
+    // Hashed before parsing: an edit in between makes the hash, not the cache, out of date
+    uint64_t source_hash = key.racy() ? scene_cache::content_hash(path) : 0;
+
+    // The spheres only live until they are copied into the batch, so they are freed all at once
+    scene_arena arena(1 << 20);
+    hittable_list world;
+    scene_reader reader(world, cam, &arena, anim);
+    reader.read_file(path);
+    scene_hash = world.fingerprint();
+    *batch = sphere_batch(world);
+    batch->build_bvh();
+    scene_cache::save(cache_path, key, source_hash, scene_hash, reader.camera_statements(), *batch);
+    return batch;
+}
+
+#endif
\ No newline at end of file
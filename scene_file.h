@@ -0,0 +1,299 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "utils.h"
+#include "animation.h"
+#include "arena.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Text scene format, one statement per line; `#` starts a comment.
+ *
+ *   camera <setting> <values...>            e.g. "camera lookfrom 13 2 3"
+ *   material <name> lambertian <r> <g> <b>
+ *   material <name> metal <r> <g> <b> <fuzz>
+ *   material <name> dielectric <index of refraction>
+ *   material <name> light <r> <g> <b>        emitted radiance, may exceed 1
+ *   sphere <x> <y> <z> <radius> <material name>
+ *   frames <count>                          length of an animation
+ *   key <frame> camera <setting> <values...> lookfrom, lookat or focus_dist at a frame
+ *   key <frame> sphere <n> <x> <y> <z> <radius>  center and radius of the n-th sphere (from 0) at a frame
+ *
+ * Camera settings are image_width, aspect_ratio, samples_per_pixel, max_depth, vfov, lookfrom,
+ * lookat, vup, defocus_angle, focus_dist and sky_brightness (0 for a scene lit only by its lights);
+ * settings a file leaves out keep the camera's values.
+ * Materials have to be declared before the spheres that use them.
+ * `frames` and `key` statements describe an animation (see animation.h); they are only checked
+ * for syntax unless the reader is given an animation to fill in.
+ * Errors are thrown as std::runtime_error carrying the file name and line number.
+ * Spheres are created in the reader's arena when it has one. Materials, which are few and may be
+ * kept by whatever the spheres are converted into, are always reference counted.
+ */
+class scene_reader {
+    public:
+        /*
+         * Reads into `world` (objects are appended) and `cam`, creating the spheres in `arena` and
+         * keyframes in `anim` if given
+         */
+        scene_reader(hittable_list &world, camera &cam, scene_arena *arena = nullptr, animation *anim = nullptr)
+            : world(world), cam(cam), arena(arena), anim(anim) {}
+
+        // Reads every statement of `in`; `source_name` prefixes error messages
+        void read(std::istream &in, const std::string &source_name) {
+            name = source_name;
+            line_number = 0;
+            std::string line;
+            while (std::getline(in, line)) {
+                ++line_number;
+                read_statement(line);
+            }
+        }
+
+        // Reads the scene file at `path`
+        void read_file(const std::string &path) {
+            std::ifstream in(path);
+            if (!in)
+                throw std::runtime_error(path + ": cannot open scene file");
+            read(in, path);
+        }
+
+        // The camera, frames and key statements read so far, one per line (kept by the scene cache)
+        const std::string &camera_statements() const { return camera_lines; }
+
+    private:
+        hittable_list &world;
+        camera &cam;
+        scene_arena *arena;
+        animation *anim;
+        std::unordered_map<std::string, shared_ptr<material>> materials;
+        std::string camera_lines;
+        std::string name;
+        int line_number = 0;
+
+        // Position in the line being read
+        const char *cursor = nullptr;
+
+        void read_statement(const std::string &line) {
+            cursor = line.c_str();
+            std::string keyword = word();
+            if (keyword.empty() || keyword[0] == '#')
+                return;
+
+            if (keyword == "camera") {
+                read_camera_setting();
+                camera_lines += line + '\n';
+            } else if (keyword == "material") {
+                read_material();
+            } else if (keyword == "sphere") {
+                auto center = point();
+                auto radius = number();
+                auto mat = material_named(word());
+                world.add(make_in<sphere>(arena, center, radius, mat));
+            } else if (keyword == "frames") {
+                int count = integer();
+                if (count < 1)
+                    fail("frame count must be at least 1");
+                if (anim)
+                    anim->frame_count = count;
+                camera_lines += line + '\n';
+            } else if (keyword == "key") {
+                read_key();
+                camera_lines += line + '\n';
+            } else {
+                fail("unknown statement '" + keyword + "'");
+            }
+
+            std::string rest = word();
+            if (!rest.empty() && rest[0] != '#')
+                fail("unexpected '" + rest + "' at the end of the line");
+        }
+
+        void read_camera_setting() {
+            std::string setting = word();
+            if (setting == "image_width")            cam.image_width = integer();
+            else if (setting == "aspect_ratio")      cam.aspect_ratio = number();
+            else if (setting == "samples_per_pixel") cam.samples_per_pixel = integer();
+            else if (setting == "max_depth")         cam.max_depth = integer();
+            else if (setting == "vfov")              cam.vfov = number();
+            else if (setting == "lookfrom")          cam.lookfrom = point();
+            else if (setting == "lookat")            cam.lookat = point();
+            else if (setting == "vup")               cam.vup = point();
+            else if (setting == "defocus_angle")     cam.defocus_angle = number();
+            else if (setting == "focus_dist")        cam.focus_dist = number();
+            else if (setting == "sky_brightness")    cam.sky_brightness = number();
+            else fail("unknown camera setting '" + setting + "'");
+        }
+
+        void read_key() {
+            double frame = number();
+            std::string target = word();
+            if (target == "camera") {
+                std::string setting = word();
+                if (setting == "lookfrom" || setting == "lookat") {
+                    auto p = point();
+                    if (anim)
+                        (setting == "lookfrom" ? anim->lookfrom : anim->lookat).add(frame, p);
+                } else if (setting == "focus_dist") {
+                    auto distance = number();
+                    if (anim)
+                        anim->focus_dist.add(frame, distance);
+                } else {
+                    fail("camera setting '" + setting + "' cannot be keyframed");
+                }
+            } else if (target == "sphere") {
+                int sphere_number = integer();
+                if (sphere_number < 0)
+                    fail("negative sphere number");
+                auto center = point();
+                auto radius = number();
+                if (anim)
+                    anim->add_sphere_key(sphere_number, frame, center, radius);
+            } else {
+                fail("unknown key target '" + target + "'");
+            }
+        }
+
+        void read_material() {
+            std::string material_name = word();
+            std::string kind = word();
+            if (material_name.empty())
+                fail("material without a name");
+
+            shared_ptr<material> mat;
+            if (kind == "lambertian") {
+                mat = make_shared<lambertian>(point());
+            } else if (kind == "metal") {
+                auto albedo = point();
+                mat = make_shared<metal>(albedo, number());
+            } else if (kind == "dielectric") {
+                mat = make_shared<dielectric>(number());
+            } else if (kind == "light") {
+                mat = make_shared<diffuse_light>(point());
+            } else {
+                fail("unknown material type '" + kind + "'");
+            }
+            materials[material_name] = mat;
+        }
+
+        shared_ptr<material> material_named(const std::string &material_name) {
+            auto found = materials.find(material_name);
+            if (found == materials.end())
+                fail("undeclared material '" + material_name + "'");
+            return found->second;
+        }
+
+        // Next whitespace-separated word, empty at the end of the line
+        std::string word() {
+            while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+                ++cursor;
+            const char *start = cursor;
+            while (*cursor && *cursor != ' ' && *cursor != '\t' && *cursor != '\r')
+                ++cursor;
+            return std::string(start, cursor);
+        }
+
+        double number() {
+            char *end;
+            double value = std::strtod(cursor, &end);
+            if (end == cursor)
+                fail("expected a number");
+            cursor = end;
+            return value;
+        }
+
+        int integer() {
+            double value = number();
+            if (!(value == std::floor(value)))  // NaN included
+                fail("expected an integer");
+            // Checked before the cast, which is undefined for values out of range
+            if (value < std::numeric_limits<int>::min() || value > std::numeric_limits<int>::max())
+                fail("integer out of range");
+            return static_cast<int>(value);
+        }
+
+        vec3 point() {
+            auto x = number();
+            auto y = number();
+            return vec3(x, y, number());
+        }
+
+        [[noreturn]] void fail(const std::string &message) const {
+            throw std::runtime_error(name + ":" + std::to_string(line_number) + ": " + message);
+        }
+};
+
+// Reads the scene file at `path` into `world` and `cam`, and into `arena` and `anim` if given
+inline void load_scene(const std::string &path, hittable_list &world, camera &cam, scene_arena *arena = nullptr,
+                       animation *anim = nullptr) {
+    scene_reader reader(world, cam, arena, anim);
+    reader.read_file(path);
+}
+
+/*
+ * Writes the camera view and every sphere of `world` in the text format, with enough digits
+ * to read back the same values. Throws std::invalid_argument for objects or materials the
+ * format cannot describe.
+ */
+inline void save_scene(std::ostream &out, const hittable_list &world, const camera &cam) {
+    out.precision(std::numeric_limits<double>::max_digits10);  // The camera settings are doubles in every build
+    out << "camera image_width " << cam.image_width << '\n'
+        << "camera aspect_ratio " << cam.aspect_ratio << '\n'
+        << "camera samples_per_pixel " << cam.samples_per_pixel << '\n'
+        << "camera max_depth " << cam.max_depth << '\n'
+        << "camera vfov " << cam.vfov << '\n'
+        << "camera lookfrom " << cam.lookfrom << '\n'
+        << "camera lookat " << cam.lookat << '\n'
+        << "camera vup " << cam.vup << '\n'
+        << "camera defocus_angle " << cam.defocus_angle << '\n'
+        << "camera focus_dist " << cam.focus_dist << '\n'
+        << "camera sky_brightness " << cam.sky_brightness << '\n';
+
+    // Name materials in order of first use
+    std::unordered_map<const material *, std::string> names;
+    for (const auto &object : world.objects) {
+        auto s = std::dynamic_pointer_cast<sphere>(object);
+        if (!s)
+            throw std::invalid_argument("save_scene: only spheres can be written");
+
+        const material *mat = s->get_material().get();
+        if (names.find(mat) == names.end()) {
+            std::string material_name = "m" + std::to_string(names.size());
+            out << "material " << material_name << ' ';
+            switch (mat->type()) {
+                case material_type::lambertian:
+                    out << "lambertian " << static_cast<const lambertian *>(mat)->get_albedo() << '\n';
+                    break;
+                case material_type::metal:
+                    out << "metal " << static_cast<const metal *>(mat)->get_albedo() << ' '
+                        << static_cast<const metal *>(mat)->get_fuzz() << '\n';
+                    break;
+                case material_type::dielectric:
+                    out << "dielectric " << static_cast<const dielectric *>(mat)->get_index_of_refraction() << '\n';
+                    break;
+                case material_type::light:
+                    out << "light " << static_cast<const diffuse_light *>(mat)->get_emission() << '\n';
+                    break;
+                default:    // Derived classes too (see material::type), they would be read back as their base
+                    throw std::invalid_argument("save_scene: material type cannot be written");
+            }
+            names[mat] = material_name;
+        }
+
+        out << "sphere " << s->get_center() << ' ' << s->get_radius() << ' ' << names[mat] << '\n';
+    }
+}
+
+#endif
\ No newline at end of file
@@ -4,14 +4,69 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "material.h"
+#include "stats.h"
+
+/*
+ * Fills `rec` for a hit at distance t on a sphere (material excepted).
+ * The point r.at(t) is moved onto the surface along the normal: its error then depends on the
+ * size and position of the sphere only, not on the ray's length or the error of t.
+ */
+inline void record_sphere_hit(const ray &r, real t, const point3 &center, real radius, hit_record &rec) {
+    vec3 from_center = r.at(t) - center;
+    from_center *= radius / from_center.length();
+
+    rec.t = t;
+    rec.p = center + from_center;
+    rec.error = rounding_error_bound(5)
+        * (std::max(std::fabs(center.x()), std::max(std::fabs(center.y()), std::fabs(center.z()))) + radius);
+    rec.set_face_normal(r, from_center / radius);
+}
 
 class sphere : public hittable {
     public:
         // Constructor
-        sphere(point3 _center, double _radius, shared_ptr<material> _material) : center(_center), radius(_radius), mat(_material) {}
+        sphere(point3 _center, real _radius, shared_ptr<material> _material) : center(_center), radius(_radius), mat(_material) {
+            auto rvec = vec3(radius, radius, radius);
+            bbox = aabb(center - rvec, center + rvec);
+        }
 
         // Override the hit method to detect intersection with this sphere
         bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
+            real root;
+            if (!nearest_root(r, ray_t, root))
+                return false;
+
+            // Populate the hit_record structure with intersection details
+            record_sphere_hit(r, root, center, radius, rec);
+            rec.mat = mat.get();
+
+            return true;
+        }
+
+        // Same test as `hit`, without the hit record
+        bool occluded(const ray &r, interval ray_t) const override {
+            real root;
+            return nearest_root(r, ray_t, root);
+        }
+
+        // Returns the box enclosing the sphere
+        aabb bounding_box() const override { return bbox; }
+
+        // Accessors used to convert spheres into other representations
+        point3 get_center() const { return center; }
+        real get_radius() const { return radius; }
+        shared_ptr<material> get_material() const { return mat; }
+
+    private:
+        point3 center;
+        real radius;
+        shared_ptr<material> mat;
+        aabb bbox;
+
+        // Finds the nearest distance at which the ray meets the sphere inside ray_t
+        bool nearest_root(const ray &r, interval ray_t, real &root) const {
+            STAT_INC(primitive_tests);
             vec3 oc = r.origin() - center;
             auto a = r.direction().length_squared();
             auto half_b = dot(oc, r.direction());
@@ -24,27 +79,14 @@ class sphere : public hittable {
             auto sqrtd = sqrt(discriminant);
 
             // Find the nearest root that lies in the acceptable range
-            auto root = (-half_b - sqrtd) / a;
+            root = (-half_b - sqrtd) / a;
             if (!ray_t.surrounds(root)) {
                 root = (-half_b + sqrtd) / a;
                 if (!ray_t.surrounds(root))
                     return false;
             }
-
-            // Populate the hit_record structure with intersection details
-            rec.t = root;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat = mat;
-
             return true;
         }
-
-    private:
-        point3 center;
-        double radius;
-        shared_ptr<material> mat;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,468 @@
+#ifndef SPHERE_BATCH_H
+#define SPHERE_BATCH_H
+
+#include "utils.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * The SIMD register type used by sphere_batch for `real` on this instruction set, with the
+ * handful of operations its intersection loop needs. `width` lanes per register.
+ * Defining RAYTRACER_SCALAR_SPHERES tests one sphere at a time on any instruction set, so the
+ * scalar path can be checked on its own (see the check/ entries of bench.cpp).
+ */
+#if (defined(__AVX__) || defined(__SSE2__)) && !defined(RAYTRACER_SCALAR_SPHERES)
+#define SPHERE_BATCH_SIMD
+#endif
+
+#if defined(__AVX__) && !defined(RAYTRACER_FLOAT)
+struct sphere_lanes {
+    typedef __m256d type;
+    static const int width = 4;
+
+    static type set1(double x) { return _mm256_set1_pd(x); }
+    static type iota() { return _mm256_setr_pd(0, 1, 2, 3); }
+    static type load(const double *p) { return _mm256_loadu_pd(p); }
+    static void store(double *p, type x) { _mm256_store_pd(p, x); }
+    static type add(type x, type y) { return _mm256_add_pd(x, y); }
+    static type sub(type x, type y) { return _mm256_sub_pd(x, y); }
+    static type mul(type x, type y) { return _mm256_mul_pd(x, y); }
+    static type div(type x, type y) { return _mm256_div_pd(x, y); }
+    static type sqrt(type x) { return _mm256_sqrt_pd(x); }
+    static type max(type x, type y) { return _mm256_max_pd(x, y); }
+    static type greater(type x, type y) { return _mm256_cmp_pd(x, y, _CMP_GT_OQ); }
+    static type greater_equal(type x, type y) { return _mm256_cmp_pd(x, y, _CMP_GE_OQ); }
+    static type less(type x, type y) { return _mm256_cmp_pd(x, y, _CMP_LT_OQ); }
+    static type bit_and(type x, type y) { return _mm256_and_pd(x, y); }
+    static type bit_or(type x, type y) { return _mm256_or_pd(x, y); }
+    static type select(type mask, type if_true, type if_false) { return _mm256_blendv_pd(if_false, if_true, mask); }
+    static bool any(type mask) { return _mm256_movemask_pd(mask) != 0; }
+};
+#elif defined(__AVX__)
+struct sphere_lanes {
+    typedef __m256 type;
+    static const int width = 8;
+
+    static type set1(float x) { return _mm256_set1_ps(x); }
+    static type iota() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+    static type load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, type x) { _mm256_store_ps(p, x); }
+    static type add(type x, type y) { return _mm256_add_ps(x, y); }
+    static type sub(type x, type y) { return _mm256_sub_ps(x, y); }
+    static type mul(type x, type y) { return _mm256_mul_ps(x, y); }
+    static type div(type x, type y) { return _mm256_div_ps(x, y); }
+    static type sqrt(type x) { return _mm256_sqrt_ps(x); }
+    static type max(type x, type y) { return _mm256_max_ps(x, y); }
+    static type greater(type x, type y) { return _mm256_cmp_ps(x, y, _CMP_GT_OQ); }
+    static type greater_equal(type x, type y) { return _mm256_cmp_ps(x, y, _CMP_GE_OQ); }
+    static type less(type x, type y) { return _mm256_cmp_ps(x, y, _CMP_LT_OQ); }
+    static type bit_and(type x, type y) { return _mm256_and_ps(x, y); }
+    static type bit_or(type x, type y) { return _mm256_or_ps(x, y); }
+    static type select(type mask, type if_true, type if_false) { return _mm256_blendv_ps(if_false, if_true, mask); }
+    static bool any(type mask) { return _mm256_movemask_ps(mask) != 0; }
+};
+#elif defined(__SSE2__) && !defined(RAYTRACER_FLOAT)
+struct sphere_lanes {
+    typedef __m128d type;
+    static const int width = 2;
+
+    static type set1(double x) { return _mm_set1_pd(x); }
+    static type iota() { return _mm_setr_pd(0, 1); }
+    static type load(const double *p) { return _mm_loadu_pd(p); }
+    static void store(double *p, type x) { _mm_store_pd(p, x); }
+    static type add(type x, type y) { return _mm_add_pd(x, y); }
+    static type sub(type x, type y) { return _mm_sub_pd(x, y); }
+    static type mul(type x, type y) { return _mm_mul_pd(x, y); }
+    static type div(type x, type y) { return _mm_div_pd(x, y); }
+    static type sqrt(type x) { return _mm_sqrt_pd(x); }
+    static type max(type x, type y) { return _mm_max_pd(x, y); }
+    static type greater(type x, type y) { return _mm_cmpgt_pd(x, y); }
+    static type greater_equal(type x, type y) { return _mm_cmpge_pd(x, y); }
+    static type less(type x, type y) { return _mm_cmplt_pd(x, y); }
+    static type bit_and(type x, type y) { return _mm_and_pd(x, y); }
+    static type bit_or(type x, type y) { return _mm_or_pd(x, y); }
+    // SSE2 has no blend instruction, select lanes with and/andnot/or
+    static type select(type mask, type if_true, type if_false) {
+        return _mm_or_pd(_mm_and_pd(mask, if_true), _mm_andnot_pd(mask, if_false));
+    }
+    static bool any(type mask) { return _mm_movemask_pd(mask) != 0; }
+};
+#elif defined(__SSE2__)
+struct sphere_lanes {
+    typedef __m128 type;
+    static const int width = 4;
+
+    static type set1(float x) { return _mm_set1_ps(x); }
+    static type iota() { return _mm_setr_ps(0, 1, 2, 3); }
+    static type load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, type x) { _mm_store_ps(p, x); }
+    static type add(type x, type y) { return _mm_add_ps(x, y); }
+    static type sub(type x, type y) { return _mm_sub_ps(x, y); }
+    static type mul(type x, type y) { return _mm_mul_ps(x, y); }
+    static type div(type x, type y) { return _mm_div_ps(x, y); }
+    static type sqrt(type x) { return _mm_sqrt_ps(x); }
+    static type max(type x, type y) { return _mm_max_ps(x, y); }
+    static type greater(type x, type y) { return _mm_cmpgt_ps(x, y); }
+    static type greater_equal(type x, type y) { return _mm_cmpge_ps(x, y); }
+    static type less(type x, type y) { return _mm_cmplt_ps(x, y); }
+    static type bit_and(type x, type y) { return _mm_and_ps(x, y); }
+    static type bit_or(type x, type y) { return _mm_or_ps(x, y); }
+    // SSE2 has no blend instruction, select lanes with and/andnot/or
+    static type select(type mask, type if_true, type if_false) {
+        return _mm_or_ps(_mm_and_ps(mask, if_true), _mm_andnot_ps(mask, if_false));
+    }
+    static bool any(type mask) { return _mm_movemask_ps(mask) != 0; }
+};
+#endif
+
+/*
+ * Set of spheres stored as structure-of-arrays: one array per center coordinate, one for
+ * the radii and one for 32-bit indices into a shared material table.
+ * A ray is tested against several spheres per instruction (see sphere_lanes: 4 doubles or 8
+ * floats with AVX, half as many with SSE2, one at a time otherwise) and only the nearest hit is
+ * turned into a hit_record.
+ *
+ * The batch can replace a hittable_list of spheres directly, or be used as the leaf payload
+ * of an acceleration structure through `hit_range`. `build_bvh` does the latter internally:
+ * it reorders the arrays so every BVH leaf is a contiguous range of spheres. Spheres keep their
+ * number, the order they were added in, so they can still be moved afterwards (see set_sphere).
+ */
+class sphere_batch final : public hittable {
+    public:
+        sphere_batch() {} // Default constructor
+
+        // Creates a batch holding every sphere of the list (any other kind of object is rejected)
+        sphere_batch(const hittable_list &list) {
+            for (const auto &object : list.objects) {
+                auto s = std::dynamic_pointer_cast<sphere>(object);
+                if (!s)
+                    throw std::invalid_argument("sphere_batch: list contains an object that is not a sphere");
+                add(*s);
+            }
+        }
+
+        // Adds a sphere to the batch
+        void add(const point3 &center, real radius, shared_ptr<material> mat) {
+            center_x.push_back(center.x());
+            center_y.push_back(center.y());
+            center_z.push_back(center.z());
+            radii.push_back(radius);
+            material_ids.push_back(material_id(mat));
+            slots.push_back(static_cast<int>(radii.size() - 1));
+
+            auto rvec = vec3(radius, radius, radius);
+            bbox = aabb(bbox, aabb(center - rvec, center + rvec));
+            tree = bvh_tree();
+        }
+
+        // Adds a copy of an existing sphere to the batch
+        void add(const sphere &s) {
+            add(s.get_center(), s.get_radius(), s.get_material());
+        }
+
+        // Number of spheres in the batch
+        int size() const { return static_cast<int>(radii.size()); }
+
+        // Spheres hit_range tests per instruction: the SIMD lane count, 1 without SIMD
+        static int lanes() {
+#if defined(SPHERE_BATCH_SIMD)
+            return sphere_lanes::width;
+#else
+            return 1;
+#endif
+        }
+
+        // Center and radius of sphere number `sphere`, counted in the order the spheres were added
+        point3 get_center(int sphere) const {
+            int i = slots[sphere];
+            return point3(center_x[i], center_y[i], center_z[i]);
+        }
+
+        real get_radius(int sphere) const { return radii[slots[sphere]]; }
+
+        // Index of the material of sphere number `sphere` in get_materials()
+        uint32_t get_material_id(int sphere) const { return material_ids[slots[sphere]]; }
+
+        /*
+         * Moves and resizes sphere number `sphere`. The BVH and the bounding box are out of date
+         * until refit_bvh or build_bvh is called.
+         */
+        void set_sphere(int sphere, const point3 &center, real radius) {
+            int i = slots[sphere];
+            center_x[i] = center.x();
+            center_y[i] = center.y();
+            center_z[i] = center.z();
+            radii[i] = radius;
+        }
+
+        // Material table of the batch, indexed by hit_record::material_id
+        const std::vector<shared_ptr<material>> &get_materials() const { return materials; }
+
+        // True once build_bvh has run (and no sphere was added since)
+        bool has_bvh() const { return !tree.empty(); }
+
+        /*
+         * Builds a BVH over the spheres and reorders the arrays into leaf order, so that each leaf
+         * is intersected with a single `hit_range` call. Adding spheres afterwards drops the tree.
+         */
+        void build_bvh(int leaf_size = 8) {
+            tree.build(sphere_boxes(), leaf_size);
+
+            permute(center_x, tree.indices);
+            permute(center_y, tree.indices);
+            permute(center_z, tree.indices);
+            permute(radii, tree.indices);
+            permute(material_ids, tree.indices);
+
+            std::vector<int> new_slot(tree.indices.size());
+            for (size_t i = 0; i < tree.indices.size(); i++) {
+                new_slot[tree.indices[i]] = static_cast<int>(i);
+                tree.indices[i] = static_cast<int>(i);
+            }
+            for (auto &slot : slots)
+                slot = new_slot[slot];
+            bbox = tree.empty() ? aabb() : tree.bounding_box();
+        }
+
+        /*
+         * Brings the BVH boxes and the bounding box up to date after spheres were moved, keeping
+         * the tree's shape (see bvh_tree::refit); without a BVH only the bounding box is updated.
+         */
+        void refit_bvh() {
+            std::vector<aabb> boxes = sphere_boxes();
+            tree.refit(boxes);
+            bbox = aabb();
+            for (const auto &box : boxes)
+                bbox = aabb(bbox, box);
+        }
+
+        // Expected cost of a ray through the BVH (see bvh_tree::sah_cost), 0 without one
+        double bvh_cost() const { return tree.sah_cost(); }
+
+        // Finds the nearest sphere hit by the ray, through the BVH when one was built
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
+            if (tree.empty())
+                return hit_range(r, ray_t, 0, size(), rec);
+
+            return tree.intersect_leaves(r, ray_t, [&](int first, int count, real &closest_so_far) {
+                if (!hit_range(r, interval(ray_t.min, closest_so_far), first, count, rec))
+                    return false;
+                closest_so_far = rec.t;
+                return true;
+            });
+        }
+
+        // Tests the spheres [first, first + count) and fills `rec` with the nearest hit inside ray_t
+        bool hit_range(const ray &r, interval ray_t, int first, int count, hit_record &rec) const {
+            STAT_ADD(primitive_tests, count);
+            real closest = ray_t.max;
+            int closest_index = -1;
+            int end = first + count;
+            int i = first;
+
+#if defined(SPHERE_BATCH_SIMD)
+            i = hit_simd(r, ray_t.min, i, end, closest, closest_index);
+#endif
+            hit_scalar(r, ray_t.min, i, end, closest, closest_index);
+
+            if (closest_index < 0)
+                return false;
+
+            // Only the winning sphere gets its full hit record
+            auto center = point3(center_x[closest_index], center_y[closest_index], center_z[closest_index]);
+            record_sphere_hit(r, closest, center, radii[closest_index], rec);
+            rec.material_id = material_ids[closest_index];
+            rec.mat = materials[rec.material_id].get();
+
+            return true;
+        }
+
+        // True if any sphere is hit inside ray_t; the traversal ends at the first leaf with a hit
+        bool occluded(const ray &r, interval ray_t) const override {
+            if (tree.empty())
+                return occluded_range(r, ray_t, 0, size());
+            return tree.occluded_leaves(r, ray_t, [&](int first, int count) {
+                return occluded_range(r, ray_t, first, count);
+            });
+        }
+
+        // True if any of the spheres [first, first + count) is hit inside ray_t
+        bool occluded_range(const ray &r, interval ray_t, int first, int count) const {
+            STAT_ADD(primitive_tests, count);
+            real closest = ray_t.max;
+            int closest_index = -1;
+            int i = first;
+#if defined(SPHERE_BATCH_SIMD)
+            i = hit_simd(r, ray_t.min, i, first + count, closest, closest_index);
+            if (closest_index >= 0)
+                return true;
+#endif
+            hit_scalar(r, ray_t.min, i, first + count, closest, closest_index);
+            return closest_index >= 0;
+        }
+
+        // Returns the box enclosing every sphere of the batch
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        friend class scene_cache; // Stores the arrays and the tree as they are
+
+        std::vector<real> center_x, center_y, center_z;     // Sphere centers, one array per coordinate
+        std::vector<real> radii;                            // Sphere radii
+        std::vector<uint32_t> material_ids;                 // Index of each sphere's material in `materials`
+        std::vector<int> slots;                             // Array index of every sphere, in the order added
+        std::vector<shared_ptr<material>> materials;        // Material table, each material stored once
+        std::unordered_map<const material *, uint32_t> material_lookup;
+        aabb bbox;
+        bvh_tree tree;
+
+        // Returns the table index of the material, adding it on first use
+        uint32_t material_id(const shared_ptr<material> &mat) {
+            auto found = material_lookup.find(mat.get());
+            if (found != material_lookup.end())
+                return found->second;
+
+            auto id = static_cast<uint32_t>(materials.size());
+            materials.push_back(mat);
+            material_lookup[mat.get()] = id;
+            return id;
+        }
+
+        // Box of every sphere, in array order
+        std::vector<aabb> sphere_boxes() const {
+            std::vector<aabb> boxes(radii.size());
+            for (size_t i = 0; i < radii.size(); i++) {
+                auto rvec = vec3(radii[i], radii[i], radii[i]);
+                auto center = point3(center_x[i], center_y[i], center_z[i]);
+                boxes[i] = aabb(center - rvec, center + rvec);
+            }
+            return boxes;
+        }
+
+        // Reorders `values` so that values[i] becomes old values[order[i]]
+        template <typename T>
+        static void permute(std::vector<T> &values, const std::vector<int> &order) {
+            std::vector<T> reordered(values.size());
+            for (size_t i = 0; i < order.size(); i++)
+                reordered[i] = values[order[i]];
+            values.swap(reordered);
+        }
+
+        // One sphere at a time, same arithmetic as sphere::hit
+        void hit_scalar(const ray &r, real t_min, int begin, int end, real &closest, int &closest_index) const {
+            const point3 o = r.origin();
+            const vec3 d = r.direction();
+            auto a = d.length_squared();
+
+            for (int i = begin; i < end; i++) {
+                vec3 oc = o - point3(center_x[i], center_y[i], center_z[i]);
+                auto half_b = dot(oc, d);
+                auto c = oc.length_squared() - radii[i] * radii[i];
+
+                auto discriminant = half_b * half_b - a * c;
+                if (discriminant < 0)
+                    continue;
+                auto sqrtd = sqrt(discriminant);
+
+                auto root = (-half_b - sqrtd) / a;
+                if (!(t_min < root && root < closest)) {
+                    root = (-half_b + sqrtd) / a;
+                    if (!(t_min < root && root < closest))
+                        continue;
+                }
+
+                closest = root;
+                closest_index = i;
+            }
+        }
+
+#if defined(SPHERE_BATCH_SIMD)
+        /*
+         * `lanes::width` spheres per iteration, returns the index of the first sphere left for the
+         * scalar tail. Lane indices are counted relative to `begin` in `real`, which is exact
+         * for far longer ranges than a BVH leaf (2^24 spheres in single precision).
+         */
+        int hit_simd(const ray &r, real t_min, int begin, int end, real &closest, int &closest_index) const {
+            typedef sphere_lanes lanes;
+            typedef lanes::type reg;
+            const point3 o = r.origin();
+            const vec3 d = r.direction();
+
+            const reg ox = lanes::set1(o.x()), oy = lanes::set1(o.y()), oz = lanes::set1(o.z());
+            const reg dx = lanes::set1(d.x()), dy = lanes::set1(d.y()), dz = lanes::set1(d.z());
+            const reg a = lanes::set1(d.length_squared());
+            const reg tmin = lanes::set1(t_min);
+            const reg zero = lanes::set1(0);
+            const reg step = lanes::set1(lanes::width);
+
+            // Per-lane nearest hit so far and the sphere it belongs to
+            reg best_t = lanes::set1(closest);
+            reg best_index = lanes::set1(-1);
+            reg index = lanes::iota();
+
+            int i = begin;
+            for (; i + lanes::width <= end; i += lanes::width) {
+                reg ocx = lanes::sub(ox, lanes::load(&center_x[i]));
+                reg ocy = lanes::sub(oy, lanes::load(&center_y[i]));
+                reg ocz = lanes::sub(oz, lanes::load(&center_z[i]));
+                reg rad = lanes::load(&radii[i]);
+
+                reg half_b = lanes::add(lanes::add(lanes::mul(ocx, dx), lanes::mul(ocy, dy)), lanes::mul(ocz, dz));
+                reg oc_len2 = lanes::add(lanes::add(lanes::mul(ocx, ocx), lanes::mul(ocy, ocy)), lanes::mul(ocz, ocz));
+                reg c = lanes::sub(oc_len2, lanes::mul(rad, rad));
+                reg discriminant = lanes::sub(lanes::mul(half_b, half_b), lanes::mul(a, c));
+
+                reg has_roots = lanes::greater_equal(discriminant, zero);
+                if (lanes::any(has_roots)) {
+                    reg sqrtd = lanes::sqrt(lanes::max(discriminant, zero));
+                    reg neg_half_b = lanes::sub(zero, half_b);
+                    reg near_root = lanes::div(lanes::sub(neg_half_b, sqrtd), a);
+                    reg far_root = lanes::div(lanes::add(neg_half_b, sqrtd), a);
+
+                    // Prefer the near root, fall back to the far one when the near root is out of range
+                    reg near_ok = lanes::bit_and(lanes::greater(near_root, tmin), lanes::less(near_root, best_t));
+                    reg far_ok = lanes::bit_and(lanes::greater(far_root, tmin), lanes::less(far_root, best_t));
+                    reg root = lanes::select(near_ok, near_root, far_root);
+                    reg take = lanes::bit_and(has_roots, lanes::bit_or(near_ok, far_ok));
+
+                    best_t = lanes::select(take, root, best_t);
+                    best_index = lanes::select(take, index, best_index);
+                }
+
+                index = lanes::add(index, step);
+            }
+
+            // Reduce the lanes to the single nearest hit
+            alignas(64) real lane_t[lanes::width], lane_index[lanes::width];
+            lanes::store(lane_t, best_t);
+            lanes::store(lane_index, best_index);
+            for (int lane = 0; lane < lanes::width; lane++) {
+                if (lane_index[lane] >= 0 && lane_t[lane] < closest) {
+                    closest = lane_t[lane];
+                    closest_index = begin + static_cast<int>(lane_index[lane]);
+                }
+            }
+
+            return i;
+        }
+#endif
+};
+
+#endif
\ No newline at end of file
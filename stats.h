@@ -0,0 +1,148 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+/*
+ * Event counters for the hot paths of the renderer (rays, intersection tests, scatters and
+ * how paths end). They are compiled in only when RAYTRACER_STATS is defined, e.g. with
+ * `cmake -DRAYTRACER_STATS=ON`; otherwise the STAT_* macros expand to nothing.
+ * Every thread counts into a block of its own, so counting needs no atomics or locks. A render
+ * hands its threads blocks it owns through `counter_scope` and sums them once the threads are
+ * done, so renders running side by side (render_server, stream_renderer) count apart; counts
+ * outside any scope go to a block per thread, summed by `counter_registry::total`.
+ */
+
+// Event counts of one thread
+struct ray_counters {
+    enum { depth_buckets = 64 };             // Paths this long or longer share the last bucket
+
+    long long primary_rays = 0;              // Camera rays traced
+    long long secondary_rays = 0;            // Scattered rays traced
+    long long hit_calls = 0;                 // Calls to hittable::hit of any object, nested calls included
+    long long primitive_tests = 0;           // Ray-sphere intersection tests
+    long long box_tests = 0;                 // Ray-box tests of BVH nodes
+    long long shadow_rays = 0;               // Rays toward lights, tested with hittable::occluded
+    long long scatter_calls[5] = {0, 0, 0, 0, 0}; // Calls to material::scatter, indexed by material_type
+    long long escaped = 0;                   // Paths that left the scene
+    long long absorbed = 0;                  // Paths ended by a material that did not scatter
+    long long roulette_kills = 0;            // Paths ended by Russian roulette
+    long long depth_limit = 0;               // Paths ended by reaching max_depth
+    long long path_lengths[depth_buckets + 1] = {}; // Number of paths by count of rays traced
+
+    // Records the end of a path of `length` rays, for the reason counted by `reason`
+    void end_path(long long ray_counters::*reason, int length) {
+        ++(this->*reason);
+        ++path_lengths[length < depth_buckets ? length : depth_buckets];
+    }
+
+    // Adds the counts of another block to this one
+    void add(const ray_counters &other) {
+        primary_rays += other.primary_rays;
+        secondary_rays += other.secondary_rays;
+        hit_calls += other.hit_calls;
+        primitive_tests += other.primitive_tests;
+        box_tests += other.box_tests;
+        shadow_rays += other.shadow_rays;
+        for (int i = 0; i < 5; i++)
+            scatter_calls[i] += other.scatter_calls[i];
+        escaped += other.escaped;
+        absorbed += other.absorbed;
+        roulette_kills += other.roulette_kills;
+        depth_limit += other.depth_limit;
+        for (int i = 0; i <= depth_buckets; i++)
+            path_lengths[i] += other.path_lengths[i];
+    }
+
+    // Writes the counts as a JSON object; the histogram stops at its last non-empty bucket
+    void write_json(std::ostream &out) const {
+        out << "{\"primary_rays\": " << primary_rays << ", \"secondary_rays\": " << secondary_rays
+            << ", \"hit_calls\": " << hit_calls << ", \"primitive_tests\": " << primitive_tests
+            << ", \"box_tests\": " << box_tests << ", \"shadow_rays\": " << shadow_rays
+            << ", \"scatter_calls\": {\"lambertian\": " << scatter_calls[0] << ", \"metal\": " << scatter_calls[1]
+            << ", \"dielectric\": " << scatter_calls[2] << ", \"light\": " << scatter_calls[3]
+            << ", \"other\": " << scatter_calls[4] << "}"
+            << ", \"escaped\": " << escaped << ", \"absorbed\": " << absorbed
+            << ", \"roulette_kills\": " << roulette_kills << ", \"depth_limit\": " << depth_limit
+            << ", \"path_lengths\": [";
+        int last = depth_buckets;
+        while (last > 0 && path_lengths[last] == 0)
+            last--;
+        for (int i = 0; i <= last; i++)
+            out << (i > 0 ? ", " : "") << path_lengths[i];
+        out << "]}";
+    }
+};
+
+// Owns the counter blocks of all threads that ever counted something
+class counter_registry {
+    public:
+        static counter_registry &instance() {
+            static counter_registry registry;
+            return registry;
+        }
+
+        // Adds a zeroed block for a new thread
+        ray_counters *create() {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocks.emplace_back(new ray_counters());
+            return blocks.back().get();
+        }
+
+        // Sum of all blocks (only exact while no thread is counting)
+        ray_counters total() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            ray_counters sum;
+            for (const auto &block : blocks)
+                sum.add(*block);
+            return sum;
+        }
+
+    private:
+        mutable std::mutex mutex;
+        std::vector<std::unique_ptr<ray_counters>> blocks;
+};
+
+// Block the calling thread was directed to by a counter_scope, or null
+inline ray_counters *&scoped_counters() {
+    thread_local ray_counters *block = nullptr;
+    return block;
+}
+
+// The counter block of the calling thread
+inline ray_counters &thread_counters() {
+    if (ray_counters *block = scoped_counters())
+        return *block;
+    thread_local ray_counters *counters = counter_registry::instance().create();
+    return *counters;
+}
+
+// Directs the counts of the calling thread to `block` while it exists (scopes may nest)
+class counter_scope {
+    public:
+        explicit counter_scope(ray_counters &block) : previous(scoped_counters()) { scoped_counters() = &block; }
+        ~counter_scope() { scoped_counters() = previous; }
+
+        counter_scope(const counter_scope &) = delete;
+        counter_scope &operator=(const counter_scope &) = delete;
+
+    private:
+        ray_counters *previous;
+};
+
+#if defined(RAYTRACER_STATS)
+const bool stats_enabled = true;
+#define STAT_INC(field) (++thread_counters().field)
+#define STAT_ADD(field, count) (thread_counters().field += (count))
+#define STAT_PATH_END(reason, length) (thread_counters().end_path(&ray_counters::reason, (length)))
+#else
+const bool stats_enabled = false;
+#define STAT_INC(field) ((void)0)
+#define STAT_ADD(field, count) ((void)0)
+#define STAT_PATH_END(reason, length) ((void)0)
+#endif
+
+#endif
\ No newline at end of file
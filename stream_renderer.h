@@ -0,0 +1,163 @@
+#ifndef STREAM_RENDERER_H
+#define STREAM_RENDERER_H
+
+#include "utils.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/*
+ * Renders images too large to hold in memory, e.g. a 40000 x 22500 print, straight to a stream.
+ * The image is cut into bands of rows that worker threads render independently, each with a
+ * camera whose buffers cover only its band (see camera::render_window), and that finish out of
+ * order. Finished bands wait in a reorder buffer until the calling thread, the writer, has
+ * encoded every band before them (image_stream_writer), so PNG compression overlaps rendering.
+ * A worker does not start a band more than `max_pending_bands` ahead of the writer: a slow
+ * writer (a pipe, a network disk) holds the workers back instead of the buffer growing, and
+ * memory stays a few bands whatever the height of the image.
+ */
+class stream_renderer {
+    public:
+        int band_height = 16;               // Rows per band
+        int num_threads = 0;                // Worker threads (0 = all hardware threads)
+        int max_pending_bands = 0;          // Bands rendering or done ahead of the writer (0 = twice the workers)
+        bool show_progress = true;          // Report the bands written on std::clog
+
+        int peak_pending_bands = 0;         // Most bands the reorder buffer held during the last render()
+        render_stats stats;                 // Sample, ray and event counts of the bands, and the wall time
+
+        /*
+         * Renders the image of `cam` to `out` in cam.output_format, the camera itself is left alone.
+         * Adaptive sampling only looks at neighbors within a band; denoising, snapshots, previews
+         * and the sample and cost maps need the whole image and are left out. Returns false if
+         * stopped by a signal or cam.cancel, with the image cut short, and throws
+         * std::runtime_error if `out` fails.
+         */
+        template <typename scene_type>
+        bool render(const camera &cam, const scene_type &world, std::ostream &out) {
+            auto start = std::chrono::steady_clock::now();
+            stats = render_stats();
+            peak_pending_bands = 0;
+
+            camera settings = band_settings(cam);
+            int width = cam.image_width, height = cam.get_image_height();
+            int rows = std::max(band_height, 1);
+            int bands = (height + rows - 1) / rows;
+            int workers = num_threads > 0 ? num_threads : static_cast<int>(std::thread::hardware_concurrency());
+            workers = std::max(1, std::min(workers, bands));
+            int window = std::max(1, max_pending_bands > 0 ? max_pending_bands : 2 * workers);
+            bool bottom_up = image_stream_writer::rows_bottom_up(cam.output_format);
+
+            // Bands are numbered in file order; `written` bands have been encoded
+            std::mutex mutex;
+            std::condition_variable changed;
+            std::map<int, framebuffer> done;
+            int next_band = 0, written = 0;
+            bool stopped = false;
+
+            auto render_bands = [&] {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    changed.wait(lock, [&] { return stopped || next_band >= bands || next_band < written + window; });
+                    if (stopped || next_band >= bands)
+                        return;
+                    int band = next_band++;
+                    lock.unlock();
+
+                    int y0 = (bottom_up ? bands - 1 - band : band) * rows;
+                    camera band_cam = settings;
+                    band_cam.render_window = pixel_rect(0, y0, width, std::min(y0 + rows, height));
+                    bool finished = band_cam.render(world);
+
+                    lock.lock();
+                    if (!finished) {
+                        stopped = true;
+                    } else {
+                        stats.samples += band_cam.stats.samples;
+                        stats.rays += band_cam.stats.rays;
+                        stats.counters.add(band_cam.stats.counters);
+                        done[band] = std::move(band_cam.frame);
+                        peak_pending_bands = std::max(peak_pending_bands, static_cast<int>(done.size()));
+                    }
+                    changed.notify_all();
+                }
+            };
+            std::vector<std::thread> threads;
+            for (int t = 0; t < workers; t++)
+                threads.emplace_back(render_bands);
+
+            // Encode the bands in file order as they come in
+            image_stream_writer encoder(out, width, height, cam.output_format);
+            bool write_failed = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (written < bands) {
+                    changed.wait(lock, [&] { return stopped || done.count(written) > 0; });
+                    if (stopped)
+                        break;
+                    framebuffer band = std::move(done[written]);
+                    done.erase(written);
+                    lock.unlock();
+                    encoder.write_band(band);
+                    write_failed = !out;
+                    lock.lock();
+
+                    written++;
+                    stopped = write_failed;
+                    changed.notify_all();
+                    if (show_progress)
+                        std::clog << "\rBands written: " << written << " of " << bands << "   " << std::flush;
+                }
+            }
+            for (auto &thread : threads)
+                thread.join();
+
+            stats.add_phase("render", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            if (write_failed)
+                throw std::runtime_error("Cannot write the image");
+            if (stopped)
+                return false;
+            encoder.finish();
+            if (show_progress)
+                std::clog << "\rDone, " << bands << " bands of " << rows << " rows, at most " << peak_pending_bands
+                          << " waiting to be written.\n";
+            return true;
+        }
+
+    private:
+        // Settings of the cameras rendering the bands, one thread each and without the whole-image outputs
+        static camera band_settings(const camera &cam) {
+            camera settings = cam;
+            settings.accum = accumulation_buffer();
+            settings.frame = framebuffer();
+            settings.albedo_aov = framebuffer();
+            settings.normal_aov = framebuffer();
+            settings.num_threads = 1;
+            settings.output = nullptr;
+            settings.show_progress = false;
+            settings.checkpoint_path.clear();
+            settings.resume = false;
+            settings.sample_map_path.clear();
+            settings.cost_map_path.clear();
+            settings.preview_path.clear();
+            settings.time_limit = 0;
+            settings.noise_target = 0;
+            settings.denoise = false;
+            settings.first_sample = 0;
+            return settings;
+        }
+};
+
+#endif
\ No newline at end of file
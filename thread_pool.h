@@ -0,0 +1,169 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed-size pool of worker threads with one work queue per worker.
+ * Work items are plain indices: `parallel_for` deals them out in contiguous blocks,
+ * each worker pops from the front of its own queue and, once it runs dry,
+ * steals from the back of the other queues. Expensive items therefore never
+ * leave the remaining workers idle while a single thread grinds through its block.
+ * A pool of one thread starts none: its work runs on the thread calling parallel_for.
+ */
+class thread_pool {
+    public:
+        // Creates the pool; a thread count of 0 or less uses every available hardware thread
+        explicit thread_pool(int num_threads = 0) {
+            if (num_threads <= 0)
+                num_threads = static_cast<int>(std::thread::hardware_concurrency());
+            threads = std::max(num_threads, 1);
+            if (threads == 1)
+                return;
+
+            queues = std::vector<work_queue>(threads);
+            for (int id = 0; id < threads; ++id)
+                workers.emplace_back(&thread_pool::worker_loop, this, id);
+        }
+
+        // Stops and joins all worker threads
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lock(state_mutex);
+                stopping = true;
+            }
+            work_available.notify_all();
+            for (auto &worker : workers)
+                worker.join();
+        }
+
+        thread_pool(const thread_pool &) = delete;
+        thread_pool &operator=(const thread_pool &) = delete;
+
+        // Number of worker threads
+        int size() const { return threads; }
+
+        /*
+         * Runs task(index, thread_id) for every index in [0, count) and blocks until all are done.
+         * `thread_id` is in [0, size()) and is stable for the duration of one call,
+         * so it can be used to address per-thread scratch data without locking.
+         */
+        void parallel_for(int count, const std::function<void(int, int)> &task) {
+            if (count <= 0)
+                return;
+            if (workers.empty()) {
+                for (int index = 0; index < count; ++index)
+                    task(index, 0);
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(state_mutex);
+
+            // Deal out the indices in contiguous blocks so neighbouring items start on the same worker
+            int n = size();
+            for (int id = 0; id < n; ++id) {
+                int begin = static_cast<int>(static_cast<long long>(count) * id / n);
+                int end = static_cast<int>(static_cast<long long>(count) * (id + 1) / n);
+                std::lock_guard<std::mutex> queue_lock(queues[id].mutex);
+                for (int index = begin; index < end; ++index)
+                    queues[id].items.push_back(index);
+            }
+
+            current_task = &task;
+            remaining = count;
+            ++generation;
+            work_available.notify_all();
+
+            // Wait until every item ran and no worker still holds a reference to `task`
+            work_done.wait(lock, [this] { return remaining == 0 && active_workers == 0; });
+            current_task = nullptr;
+        }
+
+    private:
+        // Per-worker queue of pending indices
+        struct work_queue {
+            std::mutex mutex;
+            std::deque<int> items;
+        };
+
+        int threads;
+        std::vector<std::thread> workers;
+        std::vector<work_queue> queues;
+
+        std::mutex state_mutex;                          // Guards everything below
+        std::condition_variable work_available;          // Signalled when a new batch is published
+        std::condition_variable work_done;               // Signalled when the last item of a batch finishes
+        const std::function<void(int, int)> *current_task = nullptr;
+        int remaining = 0;                               // Items of the current batch not yet finished
+        int active_workers = 0;                          // Workers currently draining the queues
+        unsigned long generation = 0;                    // Incremented for every published batch
+        bool stopping = false;
+
+        // Pops the next index for worker `id`, stealing from the other queues when its own is empty
+        bool next_item(int id, int &index) {
+            {
+                std::lock_guard<std::mutex> lock(queues[id].mutex);
+                if (!queues[id].items.empty()) {
+                    index = queues[id].items.front();
+                    queues[id].items.pop_front();
+                    return true;
+                }
+            }
+
+            int n = size();
+            for (int offset = 1; offset < n; ++offset) {
+                auto &victim = queues[(id + offset) % n];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.items.empty()) {
+                    index = victim.items.back();
+                    victim.items.pop_back();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Main loop of each worker thread
+        void worker_loop(int id) {
+            unsigned long seen_generation = 0;
+
+            while (true) {
+                const std::function<void(int, int)> *task;
+                {
+                    std::unique_lock<std::mutex> lock(state_mutex);
+                    work_available.wait(lock, [&] { return stopping || generation != seen_generation; });
+                    if (stopping)
+                        return;
+                    seen_generation = generation;
+
+                    // Woke up after the batch was already completed by the other workers
+                    if (!current_task)
+                        continue;
+                    task = current_task;
+                    ++active_workers;
+                }
+
+                int index;
+                int finished = 0;
+                while (next_item(id, index)) {
+                    (*task)(index, id);
+                    ++finished;
+                }
+
+                std::lock_guard<std::mutex> lock(state_mutex);
+                remaining -= finished;
+                --active_workers;
+                if (remaining == 0 && active_workers == 0)
+                    work_done.notify_all();
+            }
+        }
+};
+
+#endif
\ No newline at end of file
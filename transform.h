@@ -0,0 +1,132 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "utils.h"
+#include "aabb.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+/*
+ * Affine transform p -> A p + t, stored as the 3x4 matrix [A | t].
+ * Transforms compose right to left like matrices: (a * b).point(p) == a.point(b.point(p)).
+ */
+class affine_transform {
+    public:
+        real m[3][4];
+
+        // Identity
+        affine_transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+        static affine_transform translation(const vec3 &offset) {
+            affine_transform result;
+            for (int i = 0; i < 3; i++)
+                result.m[i][3] = offset[i];
+            return result;
+        }
+
+        static affine_transform scaling(const vec3 &factors) {
+            affine_transform result;
+            for (int i = 0; i < 3; i++)
+                result.m[i][i] = factors[i];
+            return result;
+        }
+
+        static affine_transform scaling(real factor) { return scaling(vec3(factor, factor, factor)); }
+
+        // Rotation by `degrees` around `axis` (right-handed, the axis need not be a unit vector)
+        static affine_transform rotation(const vec3 &axis, double degrees) {
+            vec3 u = unit_vector(axis);
+            real c = static_cast<real>(std::cos(degrees_to_radians(degrees)));
+            real s = static_cast<real>(std::sin(degrees_to_radians(degrees)));
+            affine_transform result;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++)
+                    result.m[i][j] = (1 - c) * u[i] * u[j] + (i == j ? c : 0);
+            }
+            result.m[0][1] -= s * u[2];
+            result.m[0][2] += s * u[1];
+            result.m[1][0] += s * u[2];
+            result.m[1][2] -= s * u[0];
+            result.m[2][0] -= s * u[1];
+            result.m[2][1] += s * u[0];
+            return result;
+        }
+
+        affine_transform operator*(const affine_transform &other) const {
+            affine_transform result;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    result.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j]
+                                   + (j == 3 ? m[i][3] : 0);
+                }
+            }
+            return result;
+        }
+
+        point3 point(const point3 &p) const {
+            return point3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                          m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                          m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+        }
+
+        vec3 vector(const vec3 &v) const {
+            return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                        m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                        m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+        }
+
+        // Applies the transposed linear part; maps normals back through the inverse of a transform
+        vec3 transposed_vector(const vec3 &v) const {
+            return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                        m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                        m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+        }
+
+        // Same ray in the transformed space; the direction is not normalized, so hit distances carry over
+        ray apply(const ray &r) const { return ray(point(r.origin()), vector(r.direction())); }
+
+        // Throws std::invalid_argument if the transform is singular
+        affine_transform inverse() const {
+            real cofactor[3][3];
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+                    cofactor[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+                }
+            }
+            real det = m[0][0] * cofactor[0][0] + m[0][1] * cofactor[0][1] + m[0][2] * cofactor[0][2];
+            if (det == 0 || !std::isfinite(det))
+                throw std::invalid_argument("affine_transform: singular transform has no inverse");
+
+            affine_transform result;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++)
+                    result.m[i][j] = cofactor[j][i] / det;
+            }
+            for (int i = 0; i < 3; i++)
+                result.m[i][3] = -(result.m[i][0] * m[0][3] + result.m[i][1] * m[1][3] + result.m[i][2] * m[2][3]);
+            return result;
+        }
+
+        // Box enclosing the transformed box, widened by the rounding error of transforming its corners
+        aabb box(const aabb &b) const {
+            if (b.is_empty())
+                return b;
+            interval axes[3];
+            for (int i = 0; i < 3; i++) {
+                real low = m[i][3], high = m[i][3];
+                for (int j = 0; j < 3; j++) {
+                    real a = m[i][j] * b.axis(j).min, c = m[i][j] * b.axis(j).max;
+                    low += std::min(a, c);
+                    high += std::max(a, c);
+                }
+                real error = rounding_error_bound(3) * std::max(std::fabs(low), std::fabs(high));
+                axes[i] = interval(low - error, high + error);
+            }
+            return aabb(axes[0], axes[1], axes[2]);
+        }
+};
+
+#endif
\ No newline at end of file
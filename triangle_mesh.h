@@ -0,0 +1,249 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "utils.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Indexed triangle geometry with its own BVH: a vertex position array and three 32-bit vertex
+ * indices per triangle. The triangles are reordered into BVH leaf order when the geometry is
+ * built, so every leaf is a contiguous run of triangles. It carries no material and is immutable
+ * once built, so any number of meshes can share it through a shared_ptr.
+ *
+ * Rays are tested with the watertight algorithm of Woop, Benthin and Wald (2013): the triangle
+ * is transformed into a space where the ray runs along +z from the origin and its edge functions
+ * are evaluated in 2D, so a ray through a shared edge or vertex hits at least one of the
+ * triangles around it. The distance is accepted only beyond its rounding error bound. This needs
+ * every product rounded on its own, so the build turns off fused multiply-adds (CMakeLists.txt).
+ */
+class mesh_geometry {
+    public:
+        // Builds the geometry; throws std::invalid_argument if an index is out of range
+        mesh_geometry(std::vector<point3> vertex_positions, std::vector<uint32_t> vertex_indices)
+            : positions(std::move(vertex_positions)), indices(std::move(vertex_indices)) {
+            if (indices.size() % 3 != 0)
+                throw std::invalid_argument("mesh_geometry: index count is not a multiple of 3");
+            for (auto index : indices) {
+                if (index >= positions.size())
+                    throw std::invalid_argument("mesh_geometry: vertex index " + std::to_string(index)
+                                                + " out of range (" + std::to_string(positions.size()) + " vertices)");
+            }
+            build_bvh();
+        }
+
+        // Finds the nearest triangle hit; fills everything in `rec` but the material
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const {
+            ray_space space = space_of(r);
+            int closest_triangle = -1;
+            real closest = ray_t.max;
+            real b[3];
+            bool hit_anything = tree.intersect_leaves(r, ray_t, [&](int first, int count, real &closest_so_far) {
+                bool hit_leaf = false;
+                for (int i = first; i < first + count; i++) {
+                    STAT_INC(primitive_tests);
+                    if (intersect(space, i, ray_t.min, closest_so_far, b)) {
+                        closest_triangle = i;
+                        closest = closest_so_far;
+                        hit_leaf = true;
+                    }
+                }
+                return hit_leaf;
+            });
+            if (!hit_anything)
+                return false;
+
+            // Interpolate the point from the vertices: its error no longer grows with the ray's length
+            const point3 &p0 = positions[indices[3 * closest_triangle]];
+            const point3 &p1 = positions[indices[3 * closest_triangle + 1]];
+            const point3 &p2 = positions[indices[3 * closest_triangle + 2]];
+            rec.t = closest;
+            rec.p = b[0] * p0 + b[1] * p1 + b[2] * p2;
+            real error = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                error = std::max(error, std::fabs(b[0] * p0[axis]) + std::fabs(b[1] * p1[axis])
+                                        + std::fabs(b[2] * p2[axis]));
+            }
+            rec.error = rounding_error_bound(7) * error;
+            rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+            return true;
+        }
+
+        // True if any triangle is hit within ray_t; stops at the first one found
+        bool occluded(const ray &r, interval ray_t) const {
+            ray_space space = space_of(r);
+            real b[3];
+            return tree.occluded_leaves(r, ray_t, [&](int first, int count) {
+                for (int i = first; i < first + count; i++) {
+                    STAT_INC(primitive_tests);
+                    real t_max = ray_t.max;
+                    if (intersect(space, i, ray_t.min, t_max, b))
+                        return true;
+                }
+                return false;
+            });
+        }
+
+        // Box enclosing every triangle
+        aabb bounding_box() const { return tree.bounding_box(); }
+
+        int triangle_count() const { return static_cast<int>(indices.size() / 3); }
+        int vertex_count() const { return static_cast<int>(positions.size()); }
+
+        // Heap memory held by the vertex and index arrays and the BVH
+        size_t memory_bytes() const {
+            return positions.capacity() * sizeof(point3) + indices.capacity() * sizeof(uint32_t)
+                 + tree.nodes.capacity() * sizeof(bvh_tree::node) + tree.indices.capacity() * sizeof(int);
+        }
+
+        // Vertex positions and triangle vertex indices, the triangles in BVH leaf order
+        const std::vector<point3> &get_positions() const { return positions; }
+        const std::vector<uint32_t> &get_indices() const { return indices; }
+
+    private:
+        // Per-ray constants of the watertight test
+        struct ray_space {
+            int kx, ky, kz;     // Axes mapped to x, y and z, z being the ray's dominant axis
+            real sx, sy, sz;    // Shear taking the permuted direction to (0, 0, 1)
+            point3 origin;
+        };
+
+        // Permutation and shear that take the ray direction onto +z
+        static ray_space space_of(const ray &r) {
+            const vec3 &d = r.direction();
+            int kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                         : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+            ray_space space;
+            space.kx = kz == 2 ? 0 : kz + 1;
+            space.ky = space.kx == 2 ? 0 : space.kx + 1;
+            space.kz = kz;
+            space.sx = -d[space.kx] / d[kz];
+            space.sy = -d[space.ky] / d[kz];
+            space.sz = 1 / d[kz];
+            space.origin = r.origin();
+            return space;
+        }
+
+        std::vector<point3> positions;
+        std::vector<uint32_t> indices;
+        bvh_tree tree;
+
+        void build_bvh() {
+            std::vector<aabb> boxes(triangle_count());
+            for (int i = 0; i < triangle_count(); i++) {
+                const point3 &p0 = positions[indices[3 * i]];
+                const point3 &p1 = positions[indices[3 * i + 1]];
+                const point3 &p2 = positions[indices[3 * i + 2]];
+                boxes[i] = aabb(aabb(p0, p1), aabb(p2, p2));
+            }
+            tree.build(boxes, 4);
+
+            // Store the triangles in leaf order, leaf ranges then index the triangles directly
+            std::vector<uint32_t> reordered(indices.size());
+            for (size_t i = 0; i < tree.indices.size(); i++) {
+                for (int corner = 0; corner < 3; corner++)
+                    reordered[3 * i + corner] = indices[3 * tree.indices[i] + corner];
+                tree.indices[i] = static_cast<int>(i);
+            }
+            indices.swap(reordered);
+        }
+
+        /*
+         * Tests triangle `i` against the ray (t_min, t_max). On a hit stores its barycentric
+         * coordinates in `b`, shrinks t_max to the hit distance and returns true.
+         */
+        bool intersect(const ray_space &space, int i, real t_min, real &t_max, real b[3]) const {
+            // Vertices relative to the ray origin, permuted and sheared
+            vec3 p0 = positions[indices[3 * i]] - space.origin;
+            vec3 p1 = positions[indices[3 * i + 1]] - space.origin;
+            vec3 p2 = positions[indices[3 * i + 2]] - space.origin;
+            real x0 = p0[space.kx] + space.sx * p0[space.kz], y0 = p0[space.ky] + space.sy * p0[space.kz];
+            real x1 = p1[space.kx] + space.sx * p1[space.kz], y1 = p1[space.ky] + space.sy * p1[space.kz];
+            real x2 = p2[space.kx] + space.sx * p2[space.kz], y2 = p2[space.ky] + space.sy * p2[space.kz];
+
+            // Edge functions: twice the signed areas of the sub-triangles facing each vertex
+            real e0 = x1 * y2 - y1 * x2;
+            real e1 = x2 * y0 - y2 * x0;
+            real e2 = x0 * y1 - y0 * x1;
+
+            // An edge through the origin in single precision: decide it in double precision instead
+            if (sizeof(real) < sizeof(double) && (e0 == 0 || e1 == 0 || e2 == 0)) {
+                e0 = static_cast<real>(double(x1) * double(y2) - double(y1) * double(x2));
+                e1 = static_cast<real>(double(x2) * double(y0) - double(y2) * double(x0));
+                e2 = static_cast<real>(double(x0) * double(y1) - double(y0) * double(x1));
+            }
+
+            if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+                return false;
+            real det = e0 + e1 + e2;
+            if (det == 0)
+                return false;
+
+            // Distance scaled by det, compared without dividing
+            real z0 = space.sz * p0[space.kz], z1 = space.sz * p1[space.kz], z2 = space.sz * p2[space.kz];
+            real t_scaled = e0 * z0 + e1 * z1 + e2 * z2;
+            if (det < 0 ? (t_scaled >= t_min * det || t_scaled <= t_max * det)
+                        : (t_scaled <= t_min * det || t_scaled >= t_max * det))
+                return false;
+
+            real inv_det = 1 / det;
+            real t = t_scaled * inv_det;
+
+            // Reject distances not safely above zero given the rounding errors of the test
+            real max_x = std::max(std::fabs(x0), std::max(std::fabs(x1), std::fabs(x2)));
+            real max_y = std::max(std::fabs(y0), std::max(std::fabs(y1), std::fabs(y2)));
+            real max_z = std::max(std::fabs(z0), std::max(std::fabs(z1), std::fabs(z2)));
+            real max_e = std::max(std::fabs(e0), std::max(std::fabs(e1), std::fabs(e2)));
+            real delta_x = rounding_error_bound(5) * (max_x + max_z);
+            real delta_y = rounding_error_bound(5) * (max_y + max_z);
+            real delta_z = rounding_error_bound(3) * max_z;
+            real delta_e = 2 * (rounding_error_bound(2) * max_x * max_y + delta_y * max_x + delta_x * max_y);
+            real delta_t = 3 * (rounding_error_bound(3) * max_e * max_z + delta_e * max_z + delta_z * max_e)
+                         * std::fabs(inv_det);
+            if (t <= delta_t)
+                return false;
+
+            b[0] = e0 * inv_det;
+            b[1] = e1 * inv_det;
+            b[2] = e2 * inv_det;
+            t_max = t;
+            return true;
+        }
+};
+
+// A mesh_geometry with a single material
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh(shared_ptr<const mesh_geometry> geometry, shared_ptr<material> mat)
+            : geometry(std::move(geometry)), mat(std::move(mat)) {}
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override {
+            STAT_INC(hit_calls);
+            if (!geometry->hit(r, ray_t, rec))
+                return false;
+            rec.mat = mat.get();
+            return true;
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override { return geometry->occluded(r, ray_t); }
+
+        aabb bounding_box() const override { return geometry->bounding_box(); }
+
+        const mesh_geometry &get_geometry() const { return *geometry; }
+        shared_ptr<material> get_material() const { return mat; }
+
+    private:
+        shared_ptr<const mesh_geometry> geometry;
+        shared_ptr<material> mat;
+};
+
+#endif
\ No newline at end of file
@@ -2,14 +2,34 @@
 #define UTILS_H
 
 #include <cmath>
-#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
 #include <limits>
 #include <memory>
 
+#include "rng.h"
+
 using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 
+// Pointer to an object kept alive elsewhere (e.g. by a scene_arena): it shares no ownership and copying it counts no references
+template <typename T>
+shared_ptr<T> unowned(T *object) {
+    return shared_ptr<T>(shared_ptr<T>(), object);
+}
+
+/*
+ * Scalar type of the geometry: vectors, rays, boxes and hit distances. Defining RAYTRACER_FLOAT,
+ * e.g. with `cmake -DRAYTRACER_FLOAT=ON`, builds the renderer in single precision; colors,
+ * statistics and random numbers are converted where they meet the geometry.
+ */
+#if defined(RAYTRACER_FLOAT)
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
@@ -20,16 +40,48 @@ inline double degrees_to_radians(double degrees)
     return degrees * pi / 180.0;
 }
 
-// Returns a random real number in range [0,1)
+// Bound on the relative rounding error of `n` chained operations in `real` (gamma_n in PBRT)
+constexpr real rounding_error_bound(int n)
+{
+    return n * (std::numeric_limits<real>::epsilon() / 2) / (1 - n * (std::numeric_limits<real>::epsilon() / 2));
+}
+
+// Starting value of an FNV-1a hash
+const uint64_t fnv_offset_basis = 14695981039346656037ULL;
+
+// Folds `size` bytes into the FNV-1a hash `hash` and returns the result
+inline uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns the next random real number in range [0,1) from the given generator
+inline double random_double(rng &gen)
+{
+    return gen.next_double();
+}
+
+// Returns the next random real number in range [min,max) from the given generator
+inline double random_double(rng &gen, double min, double max)
+{
+    return min + (max - min) * random_double(gen);
+}
+
+// Returns a random real number in range [0,1) from the calling thread's default stream
 inline double random_double()
 {
-    return rand() / (RAND_MAX + 1.0);
+    return random_double(default_rng());
 }
 
-// Returns a random real number in range [min,max)
+// Returns a random real number in range [min,max) from the calling thread's default stream
 inline double random_double(double min, double max)
 {
-    return min + (max - min) * random_double();
+    return random_double(default_rng(), min, max);
 }
 
 #include "interval.h"
@@ -4,30 +4,77 @@
 #include <cmath>
 #include <iostream>
 
+/*
+ * 3D vector templated on its scalar type; the renderer uses `vec3`, i.e. basic_vec3<real>
+ * (see utils.h for the precision switch).
+ * With RAYTRACER_SIMD_VEC3 defined, basic_vec3<float> is stored in 4 lanes (x, y, z and a zero
+ * pad) aligned to 16 bytes, and the arithmetic, `dot`, `cross`, `unit_vector` and `reflect` run on
+ * one SSE or NEON register. It is off by default: on the demo scene the compiler's scalar code
+ * renders about 10% faster than the register-per-vector form.
+ * Other scalar types, and float without the option, keep 3 lanes and plain scalar code.
+ */
+#if !defined(RAYTRACER_SIMD_VEC3)
+#elif defined(__SSE2__) || defined(_M_X64)
+#define VEC3_SSE
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define VEC3_NEON
+#include <arm_neon.h>
+#endif
+
 using std::sqrt;
 
-class vec3 {
+// Storage of a basic_vec3<T>: number of lanes and alignment
+template <typename T>
+struct vec3_layout {
+    static const int lanes = 3;
+    static const size_t alignment = alignof(T);
+};
+
+#if defined(VEC3_SSE) || defined(VEC3_NEON)
+template <>
+struct vec3_layout<float> {
+    static const int lanes = 4;
+    static const size_t alignment = 16;
+};
+#endif
+
+// Scalar parameter that takes no part in template argument deduction, so `2 * v` and `0.5 * v` work for any T
+template <typename T>
+struct vec3_scalar {
+    typedef T type;
+};
+
+template <typename T>
+class basic_vec3 {
     public:
-        double e[3]; // Array to store the three components of the vector
+        alignas(vec3_layout<T>::alignment) T e[vec3_layout<T>::lanes]; // Components, then the zero pad if any
+
+        basic_vec3() : e{} {} // Default constructor
 
-        vec3() : e{0, 0, 0} {} // Default constructor
+        basic_vec3(T e0, T e1, T e2) : e{e0, e1, e2} {} // Parametrized constructor
 
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {} // Parametrized constructor
+        // Converts a vector of another precision
+        template <typename U>
+        explicit basic_vec3(const basic_vec3<U> &v) : e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
 
         // Member functions for accessing elements
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
 
         // Unary minus operator (returns the negation of the vector)
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+        basic_vec3 operator-() const { return basic_vec3(-e[0], -e[1], -e[2]); }
 
         // Subscript operators for element access
-        double operator[](int i) const { return e[i]; }
-        double &operator[](int i) { return e[i]; }
+        T operator[](int i) const { return e[i]; }
+        T &operator[](int i) { return e[i]; }
 
         // Adds the given vector to this vector (compound assignment operator)
-        vec3 &operator+=(const vec3 &v) {
+        basic_vec3 &operator+=(const basic_vec3 &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
@@ -35,7 +82,7 @@ class vec3 {
         }
 
         // Multiplies this vector by a given scalar (compound assignment operator)
-        vec3 &operator*=(double t) {
+        basic_vec3 &operator*=(T t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
@@ -43,37 +90,56 @@ class vec3 {
         }
 
         // Divides this vector by a given scalar (compound assignment operator)
-        vec3 &operator/=(double t) {
+        basic_vec3 &operator/=(T t) {
             return *this *= 1 / t;
         }
 
         // Returns the length (magnitude) of the vector
-        double length() const {
+        T length() const {
             return sqrt(length_squared());
         }
 
         // Returns the square of the length (magnitude) of the vector
-        double length_squared() const {
+        T length_squared() const {
             return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
         }
 
         // Returns true if the vector is close to zero in all dimensions
         bool near_zero() const {
-            auto s = 1e-8;
-            return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
+            auto s = T(1e-8);
+            return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
         }
 
         // Generates a random vector with components in range [0,1)
-        static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        static basic_vec3 random(rng &gen) {
+            auto x = random_double(gen);
+            auto y = random_double(gen);
+            auto z = random_double(gen);
+            return basic_vec3(T(x), T(y), T(z));
         }
 
         // Generates a random vector with components in range [min,max)
-        static vec3 random(double min, double max) {
-            return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        static basic_vec3 random(rng &gen, double min, double max) {
+            auto x = random_double(gen, min, max);
+            auto y = random_double(gen, min, max);
+            auto z = random_double(gen, min, max);
+            return basic_vec3(T(x), T(y), T(z));
+        }
+
+        // Generates a random vector with components in range [0,1) from the default stream
+        static basic_vec3 random() {
+            return random(default_rng());
+        }
+
+        // Generates a random vector with components in range [min,max) from the default stream
+        static basic_vec3 random(double min, double max) {
+            return random(default_rng(), min, max);
         }
 };
 
+// The vector type of the renderer, in its configured precision
+using vec3 = basic_vec3<real>;
+
 // Alias for vec3
 using point3 = vec3;
 
@@ -82,90 +148,253 @@ using point3 = vec3;
  */
 
 // Output vector components
-inline std::ostream &operator<<(std::ostream &out, const vec3 &v)
+template <typename T>
+inline std::ostream &operator<<(std::ostream &out, const basic_vec3<T> &v)
 {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
 // Adds two vectors component-wise
-inline vec3 operator+(const vec3 &u, const vec3 &v)
+template <typename T>
+inline basic_vec3<T> operator+(const basic_vec3<T> &u, const basic_vec3<T> &v)
 {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    return basic_vec3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
 // Subtracts vector v from vector u component-wise
-inline vec3 operator-(const vec3 &u, const vec3 &v)
+template <typename T>
+inline basic_vec3<T> operator-(const basic_vec3<T> &u, const basic_vec3<T> &v)
 {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    return basic_vec3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
 // Multiplies two vectors component-wise
-inline vec3 operator*(const vec3 &u, const vec3 &v)
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T> &u, const basic_vec3<T> &v)
 {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    return basic_vec3<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
 // Multiplies a vector by a scalar
-inline vec3 operator*(double t, const vec3 &v)
+template <typename T>
+inline basic_vec3<T> operator*(typename vec3_scalar<T>::type t, const basic_vec3<T> &v)
 {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+    return basic_vec3<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
 // Multiplies a vector by a scalar (alternative syntax)
-inline vec3 operator*(const vec3 &v, double t)
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T> &v, typename vec3_scalar<T>::type t)
 {
     return t * v;
 }
 
 // Divides a vector by a scalar
-inline vec3 operator/(vec3 v, double t)
+template <typename T>
+inline basic_vec3<T> operator/(const basic_vec3<T> &v, typename vec3_scalar<T>::type t)
 {
     return (1 / t) * v;
 }
 
 // Calculates the dot product of two vectors
-inline double dot(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline T dot(const basic_vec3<T> &u, const basic_vec3<T> &v) {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
 // Calculates the cross product of two vectors
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T>
+inline basic_vec3<T> cross(const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                         u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
+/*
+ * Single precision overloads on 4-lane registers. Being plain functions they win overload
+ * resolution over the templates above. Every operation keeps the pad lane at zero (for finite
+ * scalars), and `dot` only sums the three real lanes.
+ */
+#if defined(VEC3_SSE)
+inline __m128 vec3_load(const basic_vec3<float> &v) { return _mm_load_ps(v.e); }
+
+inline basic_vec3<float> vec3_store(__m128 lanes) {
+    basic_vec3<float> v;
+    _mm_store_ps(v.e, lanes);
+    return v;
+}
+
+// Sum of the three real lanes, broadcast to all four
+inline __m128 vec3_dot_lanes(__m128 u, __m128 v) {
+#if defined(__SSE4_1__)
+    return _mm_dp_ps(u, v, 0x7f);
+#else
+    __m128 product = _mm_mul_ps(u, v);
+    __m128 x = _mm_shuffle_ps(product, product, _MM_SHUFFLE(0, 0, 0, 0));
+    __m128 y = _mm_shuffle_ps(product, product, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(product, product, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_add_ps(_mm_add_ps(x, y), z);
+#endif
+}
+
+inline basic_vec3<float> operator+(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vec3_store(_mm_add_ps(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator-(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vec3_store(_mm_sub_ps(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator*(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vec3_store(_mm_mul_ps(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator*(float t, const basic_vec3<float> &v) {
+    return vec3_store(_mm_mul_ps(_mm_set1_ps(t), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator*(const basic_vec3<float> &v, float t) {
+    return t * v;
+}
+
+inline basic_vec3<float> operator/(const basic_vec3<float> &v, float t) {
+    return (1 / t) * v;
+}
+
+inline float dot(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return _mm_cvtss_f32(vec3_dot_lanes(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> cross(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    __m128 a = vec3_load(u), b = vec3_load(v);
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    return vec3_store(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+inline basic_vec3<float> unit_vector(const basic_vec3<float> &v) {
+    __m128 a = vec3_load(v);
+    return vec3_store(_mm_div_ps(a, _mm_sqrt_ps(vec3_dot_lanes(a, a))));
+}
+
+inline basic_vec3<float> reflect(const basic_vec3<float> &v, const basic_vec3<float> &n) {
+    __m128 a = vec3_load(v), b = vec3_load(n);
+    __m128 twice_dot = _mm_add_ps(vec3_dot_lanes(a, b), vec3_dot_lanes(a, b));
+    return vec3_store(_mm_sub_ps(a, _mm_mul_ps(twice_dot, b)));
+}
+#elif defined(VEC3_NEON)
+inline float32x4_t vec3_load(const basic_vec3<float> &v) { return vld1q_f32(v.e); }
+
+inline basic_vec3<float> vec3_store(float32x4_t lanes) {
+    basic_vec3<float> v;
+    vst1q_f32(v.e, lanes);
+    return v;
+}
+
+// Sum of the three real lanes, broadcast to all four
+inline float32x4_t vec3_dot_lanes(float32x4_t u, float32x4_t v) {
+    float32x4_t product = vmulq_f32(u, v);
+    float sum = vgetq_lane_f32(product, 0) + vgetq_lane_f32(product, 1) + vgetq_lane_f32(product, 2);
+    return vdupq_n_f32(sum);
+}
+
+inline basic_vec3<float> operator+(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vec3_store(vaddq_f32(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator-(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vec3_store(vsubq_f32(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator*(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vec3_store(vmulq_f32(vec3_load(u), vec3_load(v)));
+}
+
+inline basic_vec3<float> operator*(float t, const basic_vec3<float> &v) {
+    return vec3_store(vmulq_n_f32(vec3_load(v), t));
+}
+
+inline basic_vec3<float> operator*(const basic_vec3<float> &v, float t) {
+    return t * v;
+}
+
+inline basic_vec3<float> operator/(const basic_vec3<float> &v, float t) {
+    return (1 / t) * v;
+}
+
+inline float dot(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    return vgetq_lane_f32(vec3_dot_lanes(vec3_load(u), vec3_load(v)), 0);
+}
+
+inline basic_vec3<float> cross(const basic_vec3<float> &u, const basic_vec3<float> &v) {
+    // (y, z, x, pad) of each operand: rotate the lanes by one and move the pad back to the last lane
+    float32x4_t a = vec3_load(u), b = vec3_load(v);
+    float32x4_t a_yzx = vsetq_lane_f32(0.0f, vextq_f32(a, a, 1), 3);
+    float32x4_t b_yzx = vsetq_lane_f32(0.0f, vextq_f32(b, b, 1), 3);
+    a_yzx = vsetq_lane_f32(vgetq_lane_f32(a, 0), a_yzx, 2);
+    b_yzx = vsetq_lane_f32(vgetq_lane_f32(b, 0), b_yzx, 2);
+    float32x4_t c = vsubq_f32(vmulq_f32(a, b_yzx), vmulq_f32(a_yzx, b));
+    float32x4_t c_yzx = vsetq_lane_f32(0.0f, vextq_f32(c, c, 1), 3);
+    return vec3_store(vsetq_lane_f32(vgetq_lane_f32(c, 0), c_yzx, 2));
+}
+
+inline basic_vec3<float> unit_vector(const basic_vec3<float> &v) {
+    float32x4_t a = vec3_load(v);
+    return vec3_store(vdivq_f32(a, vsqrtq_f32(vec3_dot_lanes(a, a))));
+}
+
+inline basic_vec3<float> reflect(const basic_vec3<float> &v, const basic_vec3<float> &n) {
+    float32x4_t a = vec3_load(v), b = vec3_load(n);
+    float32x4_t twice_dot = vaddq_f32(vec3_dot_lanes(a, b), vec3_dot_lanes(a, b));
+    return vec3_store(vsubq_f32(a, vmulq_f32(twice_dot, b)));
+}
+#endif
+
 // Returns a unit vector in the direction of the vector v
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline basic_vec3<T> unit_vector(const basic_vec3<T> &v) {
     return v / v.length();
 }
 
-// Generates a random point inside a unit disk
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
+// Generates a random point inside a unit disk from two dimensions of `gen`, by the concentric
+// mapping of the square onto the disk (Shirley and Chiu 1997), which keeps well spread points well spread
+inline vec3 random_in_unit_disk(rng &gen) {
+    auto a = random_double(gen, -1, 1);
+    auto b = random_double(gen, -1, 1);
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    double r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = pi / 2 - (pi / 4) * (a / b);
     }
+    return vec3(real(r * std::cos(theta)), real(r * std::sin(theta)), 0);
 }
 
 // Generates a random point inside a unit sphere
-inline vec3 random_in_unit_sphere(){
+inline vec3 random_in_unit_sphere(rng &gen) {
     while (true) {
-        auto p = vec3::random(-1, 1);
+        auto p = vec3::random(gen, -1, 1);
         if (p.length_squared() < 1)
             return p;
     }
 }
 
-// Generates a random unit vector
-inline vec3 random_unit_vector(){
-    return unit_vector(random_in_unit_sphere());
+// Generates a random unit vector from two dimensions of `gen`, uniformly distributed over the sphere
+inline vec3 random_unit_vector(rng &gen) {
+    auto z = 1 - 2 * random_double(gen);
+    auto phi = 2 * pi * random_double(gen);
+    auto r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    return vec3(real(r * std::cos(phi)), real(r * std::sin(phi)), real(z));
 }
 
 // Generates a random vector on the hemisphere around a normal
-inline vec3 random_on_hemisphere(const vec3 &normal) {
-    vec3 on_unit_sphere = random_unit_vector();
+inline vec3 random_on_hemisphere(const vec3 &normal, rng &gen) {
+    vec3 on_unit_sphere = random_unit_vector(gen);
     if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return on_unit_sphere;
     else
@@ -173,15 +402,18 @@ inline vec3 random_on_hemisphere(const vec3 &normal) {
 }
 
 // Reflects a vector v around the normal n
-vec3 reflect(const vec3 &v, const vec3 &n) {
+template <typename T>
+inline basic_vec3<T> reflect(const basic_vec3<T> &v, const basic_vec3<T> &n) {
     return v - 2 * dot(v, n) * n;
 }
 
 // Refracts a vector uv according to Snell's law, given the normal n and the ratio of indices of refraction
-inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
-    vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+template <typename T>
+inline basic_vec3<T> refract(const basic_vec3<T> &uv, const basic_vec3<T> &n,
+                             typename vec3_scalar<T>::type etai_over_etat) {
+    auto cos_theta = std::fmin(dot(-uv, n), T(1));
+    basic_vec3<T> r_out_perp = etai_over_etat * (uv + cos_theta * n);
+    basic_vec3<T> r_out_parallel = -sqrt(std::fabs(T(1) - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 